@@ -58,6 +58,8 @@ extern "C" {
 #define LCB_X11_ACTION_TIMEOUT_DEFAULT 1500
 /** Default transfer size (X11 only), default 1MB (must be multiple of 4) **/
 #define LCB_X11_TRANSFER_SIZE_DEFAULT  1048576
+/** Default max size of prefetched text (X11 only), default 4MB **/
+#define LCB_X11_PREFETCH_SIZE_DEFAULT  4194304
 /** Default max number of retries to try to obtain clipboard lock **/
 #define LCB_WIN32_MAX_RETRIES_DEFAULT 5
 /** Default delay in ms between retries to obtain clipboard lock **/
@@ -84,6 +86,31 @@ typedef void *(*clipboard_calloc_fn)(size_t nmemb, size_t size);
 typedef void *(*clipboard_realloc_fn)(void *ptr, size_t size);
 /** Custom free function signature **/
 typedef void (*clipboard_free_fn)(void *ptr);
+/** Callback signature for clipboard_text_visit **/
+typedef void (*clipboard_visit_fn)(const char *text, size_t length, void *user);
+/**
+ *  Callback signature for clipboard_text_async. text is NULL if no text was
+ *  available or the read timed out; otherwise it must be free()'d by the user.
+ */
+typedef void (*clipboard_text_fn)(char *text, size_t length, void *user);
+/**
+ *  Callback signature for clipboard_read_stream. Passed each successive chunk
+ *  of the text, which is only valid for the duration of the call. Returns
+ *  false to stop the read.
+ */
+typedef bool (*clipboard_write_fn)(const void *data, size_t length, void *user);
+/**
+ *  Callback signature for clipboard_provider. Returns the UTF-8 encoded text,
+ *  allocated with the context's malloc (user_malloc_fn or malloc), and its
+ *  length in bytes. Returns NULL on failure.
+ */
+typedef char *(*clipboard_provider_fn)(void *user, size_t *length);
+/**
+ *  Callback signature for clipboard_reader. Copies up to cap bytes of the
+ *  UTF-8 encoded text, starting offset bytes in, into buf. Returns the
+ *  number of bytes copied, which is 0 only at the end of the text.
+ */
+typedef size_t (*clipboard_read_fn)(void *user, size_t offset, void *buf, size_t cap);
 
 /**
  *  Determines which clipboard is used in called functions.
@@ -110,12 +137,24 @@ typedef struct clipboard_opts {
 
     /** X11 specific options **/
     struct clipboard_opts_x11 {
-        /** Max time (ms) to wait for action to complete **/
+        /**
+         *  Max time (ms) to wait for each reply from a selection owner, as
+         *  measured on the monotonic clock where available. See
+         *  clipboard_text_timed to bound a whole read.
+         */
         int action_timeout;
         /** Transfer size, in bytes. Must be a multiple of 4. **/
         uint32_t transfer_size;
         /** The name of the X11 display (NULL for default - DISPLAY env. var.) **/
         const char *display_name;
+        /**
+         *  Retrieve the text of each clipboard in the background as soon as
+         *  another application takes ownership, so that reads are served
+         *  from cache. Requires XFixes; see clipboard_subscribe.
+         */
+        bool prefetch;
+        /** Max size (bytes) of text to prefetch. If zero, the default value will be used. **/
+        size_t prefetch_size;
     } x11;
 
     /** Win32 specific options **/
@@ -144,6 +183,44 @@ typedef struct clipboard_opts {
     clipboard_free_fn user_free_fn;
 } clipboard_opts;
 
+/**
+ *  Generates clipboard text on demand; see clipboard_set_text_provider.
+ */
+typedef struct clipboard_provider {
+    /** Generates the text **/
+    clipboard_provider_fn fn;
+    /** User data passed to fn **/
+    void *user;
+    /** Releases user once the provider is no longer needed (optional) **/
+    clipboard_free_fn user_free;
+    /** Keep the generated text instead of calling fn for every request **/
+    bool memoise;
+} clipboard_provider;
+
+/** clipboard_reader length of text whose length is not known in advance **/
+#define LCB_LENGTH_UNKNOWN ((size_t)-1)
+
+/**
+ *  Reads clipboard text chunk by chunk on demand; see clipboard_set_text_reader.
+ */
+typedef struct clipboard_reader {
+    /** Reads the text **/
+    clipboard_read_fn fn;
+    /** User data passed to fn **/
+    void *user;
+    /** Releases user once the reader is no longer needed (optional) **/
+    clipboard_free_fn user_free;
+    /** The length of the text in bytes, or LCB_LENGTH_UNKNOWN **/
+    size_t length;
+} clipboard_reader;
+
+/**
+ *  Callback signature for clipboard_subscribe. Passed the clipboard whose
+ *  owner changed, the new owner (an X11 window, or 0 if the clipboard was
+ *  released) and the server time (in ms) of the change.
+ */
+typedef void (*clipboard_owner_fn)(clipboard_mode mode, unsigned long owner, unsigned long timestamp, void *user);
+
 /** Opaque data structure for a clipboard context/instance **/
 typedef struct clipboard_c clipboard_c;
 
@@ -152,9 +229,59 @@ typedef struct clipboard_c clipboard_c;
  *
  *  \param [in] cb_opts Implementation specific options (optional).
  *  \return The new clipboard instance, or NULL on failure.
+ *
+ *  \details On X11, instances on the same display share one connection,
+ *           one event loop thread and one thread to time out reads. The
+ *           event loop thread reads the data of incoming transfers (each
+ *           INCR chunk, or a whole property) with blocking round trips to
+ *           the X server. While it does, the other
+ *           instances on the display neither serve requests for their
+ *           selections nor receive data. Each stall lasts about one
+ *           round trip per transfer_size bytes, and never waits on the
+ *           remote owner. Reading large selections often in one instance
+ *           therefore slows the others. Use a separate display connection
+ *           (clipboard_new_with_connection) to isolate them. Callbacks run
+ *           on the event loop thread too, so a callback that makes a blocking call
+ *           on any instance on the same display (such as reading a
+ *           selection, whose reply only the loop can receive) stalls the
+ *           loop until the call times out, and the call then fails.
  */
 LCB_API clipboard_c *LCB_CC clipboard_new(clipboard_opts *cb_opts);
 
+/** The XCB connection type, from <xcb/xcb.h> **/
+struct xcb_connection_t;
+
+/**
+ *  \brief Instantiates a new X11 clipboard instance on the application's own connection.
+ *
+ *  \param [in] xc The XCB connection, which must outlive the instance.
+ *  \param [in] screen The screen number to create the instance's window on.
+ *  \param [in] cb_opts Implementation specific options (optional).
+ *                      x11.display_name is ignored.
+ *  \return The new clipboard instance, or NULL on failure (or if not on X11).
+ *
+ *  \details No event loop thread is started. Instead, the application must
+ *           pass every event it receives on xc to clipboard_handle_event.
+ *           Blocking reads (such as clipboard_text_ex) wait on those events,
+ *           so must not be made from the thread that feeds them; use
+ *           clipboard_text_async there instead. clipboard_free must not be
+ *           called concurrently with clipboard_handle_event.
+ */
+LCB_API clipboard_c *LCB_CC clipboard_new_with_connection(struct xcb_connection_t *xc, int screen, clipboard_opts *cb_opts);
+
+/**
+ *  \brief Passes an event from the application's connection to the library.
+ *
+ *  \param [in] cb A clipboard instance from clipboard_new_with_connection.
+ *  \param [in] event The xcb_generic_event_t received on the connection.
+ *  \return true iff the event was for a clipboard instance on the connection.
+ *           The event is not freed either way.
+ *
+ *  \details Any instance on the connection may be passed; the event is
+ *           routed to the instance it concerns. X errors are not consumed.
+ */
+LCB_API bool LCB_CC clipboard_handle_event(clipboard_c *cb, const void *event);
+
 /**
  *  \brief Frees associated clipboard data from the provided structure.
  *
@@ -179,6 +306,39 @@ LCB_API void LCB_CC clipboard_clear(clipboard_c *cb, clipboard_mode mode);
  */
 LCB_API bool LCB_CC clipboard_has_ownership(clipboard_c *cb, clipboard_mode mode);
 
+/**
+ *  \brief Subscribes to changes of clipboard ownership, in place of polling.
+ *
+ *  \param [in] cb The clipboard context
+ *  \param [in] fn Called on every change of owner of any clipboard, including
+ *                 by this context. Pass NULL to unsubscribe.
+ *  \param [in] user User data passed through to fn.
+ *  \return true iff the subscription was changed. false if unsupported.
+ *
+ *  \details Only supported on X11 when built with XFixes (see
+ *           LIBCLIPBOARD_USE_XFIXES) and the server has the extension,
+ *           in which case owner changes are tracked from clipboard_new.
+ *           fn is called from the display's event loop thread, so must
+ *           not block, nor make blocking calls on any context on the same
+ *           display (see clipboard_new). Each context holds at most one
+ *           subscription.
+ */
+LCB_API bool LCB_CC clipboard_subscribe(clipboard_c *cb, clipboard_owner_fn fn, void *user);
+
+/**
+ *  \brief Reports how reads of clipboards owned by other applications were served.
+ *
+ *  \param [in] cb The clipboard context
+ *  \param [out] hits Returns the number of reads served from cache (optional).
+ *  \param [out] misses Returns the number of reads that asked the owner (optional).
+ *
+ *  \details On X11, the text of a clipboard owned by another application is
+ *           cached until its owner changes, as reported by XFixes. Without
+ *           XFixes (see clipboard_subscribe), every read is a miss. Other
+ *           platforms do not cache, and report 0 for both.
+ */
+LCB_API void LCB_CC clipboard_cache_stats(clipboard_c *cb, unsigned long *hits, unsigned long *misses);
+
 /**
  *  \brief Retrieves the text currently held on the clipboard.
  *
@@ -187,10 +347,171 @@ LCB_API bool LCB_CC clipboard_has_ownership(clipboard_c *cb, clipboard_mode mode
  *                      the NULL terminator (optional).
  *  \param [in] mode Which clipboard to clear (platform dependent)
  *  \return A copy to the retrieved text. This must be free()'d by the user.
- *          Note that the text is encoded in UTF-8 format.
+ *          Note that the text is encoded in UTF-8 format. NULL if length is
+ *          given and the text is too long for it (see clipboard_text_ex2).
  */
 LCB_API char *LCB_CC clipboard_text_ex(clipboard_c *cb, int *length, clipboard_mode mode);
 
+/**
+ *  \brief Retrieves the text currently held on the clipboard, whatever its length.
+ *
+ *  \param [in] cb The clipboard to retrieve from
+ *  \param [out] length Returns the length of the retrieved data, excluding
+ *                      the NULL terminator (optional).
+ *  \param [in] mode Which clipboard to retrieve from (platform dependent)
+ *  \return As per clipboard_text_ex.
+ *
+ *  \details As clipboard_text_ex, but also for text of 2GB or more. The
+ *           Win32 clipboard cannot convert text that long.
+ */
+LCB_API char *LCB_CC clipboard_text_ex2(clipboard_c *cb, size_t *length, clipboard_mode mode);
+
+/**
+ *  \brief Retrieves the text currently held on the clipboard, giving up after a time.
+ *
+ *  \param [in] cb The clipboard to retrieve from
+ *  \param [out] length Returns the length of the retrieved data, excluding
+ *                      the NULL terminator (optional).
+ *  \param [in] mode Which clipboard to retrieve from (platform dependent)
+ *  \param [in] timeout The most time (ms) the read may take, or a negative
+ *                      value for no limit besides action_timeout.
+ *  \return As per clipboard_text_ex2. NULL if the read times out or is
+ *          cancelled (see clipboard_cancel).
+ *
+ *  \details On X11 the time is measured on the monotonic clock where
+ *           available, so changes to the system time do not affect it.
+ *           action_timeout still bounds each reply from the owner, while
+ *           timeout bounds the whole read, however many chunks it takes.
+ *           Other platforms read the clipboard without waiting on its owner.
+ */
+LCB_API char *LCB_CC clipboard_text_timed(clipboard_c *cb, size_t *length, clipboard_mode mode, int timeout);
+
+/**
+ *  \brief Copies the text currently held on the clipboard into a caller-supplied buffer.
+ *
+ *  \param [in] cb The clipboard to retrieve from
+ *  \param [out] buf The buffer to copy the (NULL terminated) text into.
+ *  \param [in] cap The size of buf, in bytes.
+ *  \param [out] needed Returns the size of buffer required, including the
+ *                      NULL terminator, or 0 if no text is available (optional).
+ *  \param [in] mode Which clipboard to retrieve from (platform dependent)
+ *  \return true iff the text was copied. false if no text is available or
+ *          if buf is too small, in which case needed holds the required size.
+ *
+ *  \details Nothing is allocated when reading text that the context owns.
+ *           Note that the text is encoded in UTF-8 format.
+ */
+LCB_API bool LCB_CC clipboard_text_into(clipboard_c *cb, char *buf, size_t cap, size_t *needed, clipboard_mode mode);
+
+/**
+ *  \brief Provides in-place access to the text currently held on the clipboard.
+ *
+ *  \param [in] cb The clipboard to retrieve from
+ *  \param [in] mode Which clipboard to access (platform dependent)
+ *  \param [in] fn Callback that is passed the UTF-8 encoded text and its
+ *                 length (in bytes). The text is not guaranteed to be NULL
+ *                 terminated and is only valid for the duration of the call.
+ *  \param [in] user User data passed through to fn.
+ *  \return true iff text was available and fn was called.
+ *
+ *  \details On X11 the text is not copied. The callback visits a reference
+ *           to an immutable snapshot of the selection data and runs with no
+ *           lock held. The text stays valid until it returns, even if the
+ *           selection is set, cleared or changes owner meanwhile. fn may call
+ *           back into the library, including on the same context and from
+ *           other threads. Such calls act on the current selection, not on
+ *           the snapshot being visited. It must not call clipboard_free on
+ *           the context. On Win32 a converted copy is visited.
+ */
+LCB_API bool LCB_CC clipboard_text_visit(clipboard_c *cb, clipboard_mode mode, clipboard_visit_fn fn, void *user);
+
+/**
+ *  \brief Retrieves the text currently held on the clipboard without blocking.
+ *
+ *  \param [in] cb The clipboard to retrieve from
+ *  \param [in] mode Which clipboard to retrieve from (platform dependent)
+ *  \param [in] fn Completion callback, passed a copy of the text (as per
+ *                 clipboard_text_ex) and its length, or NULL on failure.
+ *  \param [in] user User data passed through to fn.
+ *  \return true iff the read was started, in which case fn is called exactly once.
+ *
+ *  \details On X11, fn is called from the event loop once the selection owner
+ *           replies, or from a watchdog thread after action_timeout if it
+ *           does not. It must not block, nor make blocking calls on any
+ *           context on the same display (see clipboard_new), and must not
+ *           call clipboard_free.
+ *           Reads of several modes may be in flight at once. If the
+ *           context owns the clipboard, or on other platforms, fn is called
+ *           before this function returns. clipboard_free completes any reads
+ *           still pending with NULL.
+ */
+LCB_API bool LCB_CC clipboard_text_async(clipboard_c *cb, clipboard_mode mode, clipboard_text_fn fn, void *user);
+
+/**
+ *  \brief Retrieves the text currently held on several clipboards at once.
+ *
+ *  \param [in] cb The clipboard context to retrieve from.
+ *  \param [in] modes The clipboards to retrieve from (platform dependent).
+ *  \param [in] count The number of clipboards.
+ *  \param [out] texts Returns a copy of the text on each clipboard, as per
+ *                     clipboard_text_ex, or NULL where none is available.
+ *  \param [out] lengths Returns the length of each text (optional).
+ *  \return The number of texts retrieved.
+ *
+ *  \details On X11 the selections are all asked for before any reply is
+ *           waited on, so the call takes as long as the slowest owner rather
+ *           than the sum of all of them. Other platforms have one clipboard,
+ *           which is read once per mode.
+ */
+LCB_API size_t LCB_CC clipboard_text_modes(clipboard_c *cb, const clipboard_mode *modes, size_t count, char **texts, size_t *lengths);
+
+/**
+ *  \brief Passes the text currently held on the clipboard to a callback,
+ *         chunk by chunk, without holding all of it in memory.
+ *
+ *  \param [in] cb The clipboard to retrieve from
+ *  \param [in] mode Which clipboard to retrieve from (platform dependent)
+ *  \param [in] fn Callback passed each chunk of the UTF-8 encoded text, in
+ *                 order. It is called from the calling thread.
+ *  \param [in] user User data passed through to fn.
+ *  \return true iff all of the text was passed to fn. false if no text is
+ *          available, the owner stopped replying, or fn returned false.
+ *
+ *  \details On X11 text from another application is passed on as each
+ *           chunk arrives and is not kept, so at most a few times
+ *           transfer_size bytes are held at once. Owners sending the text
+ *           incrementally (INCR) are held back until fn has taken each
+ *           chunk. Other platforms copy the whole text first.
+ */
+LCB_API bool LCB_CC clipboard_read_stream(clipboard_c *cb, clipboard_mode mode, clipboard_write_fn fn, void *user);
+
+/**
+ *  \brief Writes the text currently held on the clipboard to a file descriptor.
+ *
+ *  \param [in] cb The clipboard to retrieve from
+ *  \param [in] mode Which clipboard to retrieve from (platform dependent)
+ *  \param [in] fd The file descriptor to write to, e.g. a file or socket.
+ *  \return As per clipboard_read_stream. On a write error, errno is set.
+ *
+ *  \details The text is written as per clipboard_read_stream.
+ */
+LCB_API bool LCB_CC clipboard_read_to_fd(clipboard_c *cb, clipboard_mode mode, int fd);
+
+/**
+ *  \brief Cancels the reads of the clipboard context in progress.
+ *
+ *  \param [in] cb The clipboard context.
+ *
+ *  \details Blocking reads from any thread that are waiting on a selection
+ *           owner return straight away, as if the owner had not replied.
+ *           Reads started after the call are unaffected. Useful when the
+ *           application is shutting down, or the user abandons a paste.
+ *           Asynchronous reads still complete as per clipboard_text_async.
+ *           On other platforms reads do not wait on the owner, and this
+ *           does nothing.
+ */
+LCB_API void LCB_CC clipboard_cancel(clipboard_c *cb);
+
 /**
  *  \brief Simplified version of clipboard_text_ex
  *
@@ -216,6 +537,115 @@ LCB_API char *LCB_CC clipboard_text(clipboard_c *cb);
  */
 LCB_API bool LCB_CC clipboard_set_text_ex(clipboard_c *cb, const char *src, int length, clipboard_mode mode);
 
+/**
+ *  \brief Sets the text for the provided clipboard, whatever its length.
+ *
+ *  \param [in] cb The clipboard to set the text.
+ *  \param [in] src The UTF-8 encoded text to be set in the clipboard.
+ *  \param [in] length The length of text to be set (excluding the NULL
+ *                     terminator), or LCB_LENGTH_UNKNOWN if src is NULL
+ *                     terminated.
+ *  \param [in] mode Which clipboard to set (platform dependent)
+ *  \return true iff the clipboard was set (false on error)
+ *
+ *  \details As clipboard_set_text_ex, but also for text of 2GB or more. The
+ *           Win32 clipboard cannot convert text that long.
+ */
+LCB_API bool LCB_CC clipboard_set_text_ex2(clipboard_c *cb, const char *src, size_t length, clipboard_mode mode);
+
+/**
+ *  \brief Sets the text for the provided clipboard, taking ownership of
+ *         the buffer instead of copying it.
+ *
+ *  \param [in] cb The clipboard to set the text.
+ *  \param [in] buf The UTF-8 encoded text to be set in the clipboard. It
+ *                  need not be NULL terminated.
+ *  \param [in] length The length of text to be set, in bytes.
+ *  \param [in] free_fn Function to release buf once the clipboard no longer
+ *                      needs it. If NULL, the context's free function is
+ *                      used (i.e. user_free_fn, or free).
+ *  \param [in] mode Which clipboard to set (platform dependent)
+ *  \return true iff the clipboard was set. On success the clipboard owns
+ *          buf, which must not be modified or freed by the caller. On
+ *          failure, ownership of buf remains with the caller.
+ *
+ *  \details On X11 the buffer is served to other applications as-is. Other
+ *           platforms copy the text and release buf immediately.
+ */
+LCB_API bool LCB_CC clipboard_set_text_take(clipboard_c *cb, char *buf, size_t length, clipboard_free_fn free_fn, clipboard_mode mode);
+
+/**
+ *  \brief Sets the text for the provided clipboard to the contents of a file.
+ *
+ *  \param [in] cb The clipboard to set the text.
+ *  \param [in] path The path of a non-empty regular file of UTF-8 encoded text.
+ *  \param [in] mode Which clipboard to set (platform dependent)
+ *  \return true iff the clipboard was set.
+ *
+ *  \details On X11 the file is mapped read-only and served from the mapping
+ *           for as long as the clipboard is owned, so its contents cost page
+ *           cache rather than heap. Changes made to the file in place are
+ *           seen by later readers.
+ *
+ *  \warning Do not truncate the file while the clipboard is owned. Touching
+ *           a mapping past the end of its file raises SIGBUS, which kills
+ *           the whole process. The file's size is checked before each use,
+ *           and a truncated file is read with pread instead. A truncation
+ *           that races with a transfer in progress can still cause SIGBUS.
+ *           For files that other processes may rewrite, copy the text
+ *           with clipboard_set_text_ex2 instead.
+ *
+ *           Other platforms map the file only while copying it to the
+ *           system clipboard, which then holds a copy, so none of this
+ *           applies there.
+ */
+LCB_API bool LCB_CC clipboard_set_file(clipboard_c *cb, const char *path, clipboard_mode mode);
+
+/**
+ *  \brief Takes ownership of the clipboard, generating its text only when
+ *         it is actually requested.
+ *
+ *  \param [in] cb The clipboard to set.
+ *  \param [in] provider The provider to generate the text. It is copied.
+ *  \param [in] mode Which clipboard to set (platform dependent)
+ *  \return true iff the clipboard was set (false on error)
+ *
+ *  \details On X11, provider->fn is called (from the event loop thread, or
+ *           from the caller's thread on a local read) only when the text is
+ *           requested, and provider->user_free is called once the clipboard
+ *           is cleared, replaced or lost to another application and no
+ *           read or transfer still uses the provider. Neither may call
+ *           back into the library for the same context, and provider->fn
+ *           must not make blocking calls on other contexts on the same
+ *           display either, as the event loop thread cannot serve them
+ *           meanwhile (see clipboard_new). Other platforms call
+ *           provider->fn immediately.
+ */
+LCB_API bool LCB_CC clipboard_set_text_provider(clipboard_c *cb, const clipboard_provider *provider, clipboard_mode mode);
+
+/**
+ *  \brief Takes ownership of the clipboard, reading its text chunk by chunk
+ *         only as it is transferred.
+ *
+ *  \param [in] cb The clipboard to set.
+ *  \param [in] reader The reader of the text. It is copied.
+ *  \param [in] mode Which clipboard to set (platform dependent)
+ *  \return true iff the clipboard was set (false on error)
+ *
+ *  \details On X11, each application reading the clipboard pulls the text
+ *           through reader->fn a chunk (of up to transfer_size bytes) at a
+ *           time, as it is ready for it, so the text is never held whole.
+ *           Text longer than a chunk, or of unknown length, is sent using
+ *           INCR. Reads by the context itself still read all of the text
+ *           at once. reader->fn is called from the event loop thread, or
+ *           from the caller's thread on a local read, and may be asked for
+ *           the same offset more than once, and is bound by the same rules
+ *           as provider->fn. reader->user_free is called as per
+ *           clipboard_set_text_provider. Other platforms read all of the
+ *           text immediately.
+ */
+LCB_API bool LCB_CC clipboard_set_text_reader(clipboard_c *cb, const clipboard_reader *reader, clipboard_mode mode);
+
 /**
  *  \brief Simplified version of clipboard_set_text_ex
  *
@@ -227,6 +657,93 @@ LCB_API bool LCB_CC clipboard_set_text_ex(clipboard_c *cb, const char *src, int
  */
 LCB_API bool LCB_CC clipboard_set_text(clipboard_c *cb, const char *src);
 
+/**
+ *  \brief Retrieves the contents of the given clipboard in a given format.
+ *
+ *  \param [in] cb The clipboard to retrieve from.
+ *  \param [in] mime The format wanted, as a MIME type (e.g. "image/png").
+ *  \param [out] length Returns the length of the data, in bytes (optional).
+ *  \param [in] mode Which clipboard to retrieve from (platform dependent)
+ *  \return The raw data, or NULL if not available in that format. It is
+ *          NULL terminated for convenience (not counted in length), and
+ *          must be freed with the context's free function.
+ *
+ *  \details On X11 the MIME type is used as the selection target. On
+ *           Windows it names a registered clipboard format, and on OS X a
+ *           pasteboard type.
+ */
+LCB_API void *LCB_CC clipboard_data(clipboard_c *cb, const char *mime, size_t *length, clipboard_mode mode);
+
+/**
+ *  \brief Retrieves the contents of the given clipboard in a given format, giving up after a time.
+ *
+ *  \param [in] cb The clipboard to retrieve from.
+ *  \param [in] mime The format wanted, as a MIME type (e.g. "image/png").
+ *  \param [out] length Returns the length of the data, in bytes (optional).
+ *  \param [in] mode Which clipboard to retrieve from (platform dependent)
+ *  \param [in] timeout The most time (ms) the read may take, as per
+ *                      clipboard_text_timed.
+ *  \return As per clipboard_data. NULL if the read times out or is cancelled.
+ */
+LCB_API void *LCB_CC clipboard_data_timed(clipboard_c *cb, const char *mime, size_t *length, clipboard_mode mode, int timeout);
+
+/**
+ *  \brief Retrieves the contents of the given clipboard in several formats at once.
+ *
+ *  \param [in] cb The clipboard to retrieve from.
+ *  \param [in] mimes The distinct formats wanted, as MIME types.
+ *  \param [in] count The number of formats wanted.
+ *  \param [out] data Returns the data in each format, as per clipboard_data,
+ *                    or NULL where it is not available. Each must be freed
+ *                    with the context's free function.
+ *  \param [out] lengths Returns the length of each data, in bytes (optional).
+ *  \param [in] mode Which clipboard to retrieve from (platform dependent)
+ *  \return The number of formats retrieved.
+ *
+ *  \details On X11 all formats are asked for in a single MULTIPLE
+ *           conversion, which saves a round trip to the owner per format.
+ *           Formats the owner sends incrementally, or all of them if it
+ *           does not support MULTIPLE, are then converted one at a time.
+ */
+LCB_API size_t LCB_CC clipboard_data_multiple(clipboard_c *cb, const char * const *mimes, size_t count, void **data, size_t *lengths, clipboard_mode mode);
+
+/**
+ *  \brief Retrieves the contents of the given clipboard in the most preferred
+ *         format available.
+ *
+ *  \param [in] cb The clipboard to retrieve from.
+ *  \param [in] mimes The formats wanted as MIME types, most preferred first.
+ *  \param [in] count The number of formats.
+ *  \param [out] chosen Returns the index of the format retrieved, or count
+ *                      on failure (optional).
+ *  \param [out] length Returns the length of the data, in bytes (optional).
+ *  \param [in] mode Which clipboard to retrieve from (platform dependent)
+ *  \return The data, as per clipboard_data, or NULL if none of the formats
+ *          is available.
+ *
+ *  \details On X11 the owner's TARGETS are converted first, and the data is
+ *           asked for as soon as they arrive, without waking the caller in
+ *           between. The TARGETS of the current owner are cached while
+ *           owner changes are tracked (see clipboard_subscribe), so repeat
+ *           reads skip that step.
+ */
+LCB_API void *LCB_CC clipboard_data_preferred(clipboard_c *cb, const char * const *mimes, size_t count, size_t *chosen, size_t *length, clipboard_mode mode);
+
+/**
+ *  \brief Sets the contents of the given clipboard to data in a given format.
+ *
+ *  \param [in] cb The clipboard to set.
+ *  \param [in] mime The format of data, as a MIME type (e.g. "image/png").
+ *  \param [in] data The raw data, which is copied.
+ *  \param [in] length The length of data, in bytes.
+ *  \param [in] mode Which clipboard to set (platform dependent)
+ *  \return true iff the clipboard was set (false on error)
+ *
+ *  \details The data is only offered in that format, replacing any text.
+ *           Use clipboard_data with the same MIME type to read it back.
+ */
+LCB_API bool LCB_CC clipboard_set_data(clipboard_c *cb, const char *mime, const void *data, size_t length, clipboard_mode mode);
+
 #ifdef __cplusplus
 }
 #endif
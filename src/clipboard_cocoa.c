@@ -11,7 +11,10 @@
 #ifdef LIBCLIPBOARD_BUILD_COCOA
 
 #include "libclipboard.h"
+#include <errno.h>
+#include <limits.h>
 #include <stdlib.h>
+#include <unistd.h>
 
 #include <libkern/OSAtomic.h>
 #include <Cocoa/Cocoa.h>
@@ -44,6 +47,15 @@ LCB_API clipboard_c *LCB_CC clipboard_new(clipboard_opts *cb_opts) {
     return cb;
 }
 
+LCB_API clipboard_c *LCB_CC clipboard_new_with_connection(struct xcb_connection_t *xc, int screen, clipboard_opts *cb_opts) {
+    /* Only X11 connections can be shared */
+    return NULL;
+}
+
+LCB_API bool LCB_CC clipboard_handle_event(clipboard_c *cb, const void *event) {
+    return false;
+}
+
 LCB_API void LCB_CC clipboard_free(clipboard_c *cb) {
     if (cb) {
         cb->free(cb);
@@ -63,7 +75,37 @@ LCB_API bool LCB_CC clipboard_has_ownership(clipboard_c *cb, clipboard_mode mode
     return false;
 }
 
+LCB_API bool LCB_CC clipboard_subscribe(clipboard_c *cb, clipboard_owner_fn fn, void *user) {
+    /* NSPasteboard offers no change notifications, only changeCount polling */
+    return false;
+}
+
+LCB_API void LCB_CC clipboard_cache_stats(clipboard_c *cb, unsigned long *hits, unsigned long *misses) {
+    /* Reads are not cached */
+    if (hits != NULL) {
+        *hits = 0;
+    }
+    if (misses != NULL) {
+        *misses = 0;
+    }
+}
+
 LCB_API char *LCB_CC clipboard_text_ex(clipboard_c *cb, int *length, clipboard_mode mode) {
+    size_t len = 0;
+    char *ret = clipboard_text_ex2(cb, &len, mode);
+
+    if (ret != NULL && length != NULL) {
+        if (len > INT_MAX) {
+            /* Too long to report; see clipboard_text_ex2 */
+            cb->free(ret);
+            return NULL;
+        }
+        *length = (int)len;
+    }
+    return ret;
+}
+
+LCB_API char *LCB_CC clipboard_text_ex2(clipboard_c *cb, size_t *length, clipboard_mode mode) {
     NSString *ns_clip;
     const char *utf8_clip;
     char *ret;
@@ -93,7 +135,143 @@ LCB_API char *LCB_CC clipboard_text_ex(clipboard_c *cb, int *length, clipboard_m
     return ret;
 }
 
+LCB_API char *LCB_CC clipboard_text_timed(clipboard_c *cb, size_t *length, clipboard_mode mode, int timeout) {
+    /* Reads do not wait on the clipboard owner, so have nothing to time out */
+    return clipboard_text_ex2(cb, length, mode);
+}
+
+LCB_API bool LCB_CC clipboard_text_into(clipboard_c *cb, char *buf, size_t cap, size_t *needed, clipboard_mode mode) {
+    NSString *ns_clip;
+    const char *utf8_clip;
+    size_t len;
+
+    if (needed != NULL) {
+        *needed = 0;
+    }
+    if (cb == NULL) {
+        return false;
+    }
+
+    ns_clip = [cb->pb stringForType:NSStringPboardType];
+    if (ns_clip == nil) {
+        return false;
+    }
+
+    utf8_clip = [ns_clip UTF8String];
+    len = strlen(utf8_clip);
+    if (needed != NULL) {
+        *needed = len + 1;
+    }
+    if (buf == NULL || cap <= len) {
+        return false;
+    }
+
+    memcpy(buf, utf8_clip, len + 1);
+    return true;
+}
+
+LCB_API bool LCB_CC clipboard_text_visit(clipboard_c *cb, clipboard_mode mode, clipboard_visit_fn fn, void *user) {
+    NSString *ns_clip;
+    const char *utf8_clip;
+
+    if (cb == NULL || fn == NULL) {
+        return false;
+    }
+
+    ns_clip = [cb->pb stringForType:NSStringPboardType];
+    if (ns_clip == nil) {
+        return false;
+    }
+
+    utf8_clip = [ns_clip UTF8String];
+    fn(utf8_clip, strlen(utf8_clip), user);
+    return true;
+}
+
+LCB_API bool LCB_CC clipboard_text_async(clipboard_c *cb, clipboard_mode mode, clipboard_text_fn fn, void *user) {
+    size_t length = 0;
+    char *text;
+
+    if (cb == NULL || fn == NULL) {
+        return false;
+    }
+
+    /* The pasteboard is read synchronously, so complete straight away */
+    text = clipboard_text_ex2(cb, &length, mode);
+    fn(text, text != NULL ? length : 0, user);
+    return true;
+}
+
+LCB_API size_t LCB_CC clipboard_text_modes(clipboard_c *cb, const clipboard_mode *modes, size_t count, char **texts, size_t *lengths) {
+    size_t ret = 0;
+
+    if (cb == NULL || modes == NULL || texts == NULL) {
+        return 0;
+    }
+
+    /* The pasteboard is read synchronously, so there is nothing to overlap */
+    for (size_t i = 0; i < count; i++) {
+        texts[i] = clipboard_text_ex2(cb, lengths != NULL ? &lengths[i] : NULL, modes[i]);
+        if (texts[i] != NULL) {
+            ret++;
+        }
+    }
+    return ret;
+}
+
+LCB_API bool LCB_CC clipboard_read_stream(clipboard_c *cb, clipboard_mode mode, clipboard_write_fn fn, void *user) {
+    size_t length = 0;
+    char *text;
+    bool ret;
+
+    /* The pasteboard hands out the text as a whole, so it is passed on in one chunk */
+    if (fn == NULL || (text = clipboard_text_ex2(cb, &length, mode)) == NULL) {
+        return false;
+    }
+
+    ret = fn(text, length, user);
+    cb->free(text);
+    return ret;
+}
+
+/**
+ *  \brief Writes a chunk to a file descriptor.
+ *
+ *  \param [in] data The chunk.
+ *  \param [in] length The length of the chunk.
+ *  \param [in] user The file descriptor, as an (int *).
+ *  \return true iff the whole chunk was written.
+ */
+static bool write_fd(const void *data, size_t length, void *user) {
+    const char *pos = (const char *)data;
+    int fd = *(int *)user;
+
+    while (length > 0) {
+        ssize_t n = write(fd, pos, length);
+        if (n < 0 ? errno != EINTR : n == 0) {
+            /* A write that makes no progress would never finish */
+            return false;
+        } else if (n > 0) {
+            pos += n;
+            length -= (size_t)n;
+        }
+    }
+    return true;
+}
+
+LCB_API bool LCB_CC clipboard_read_to_fd(clipboard_c *cb, clipboard_mode mode, int fd) {
+    return clipboard_read_stream(cb, mode, write_fd, &fd);
+}
+
+LCB_API void LCB_CC clipboard_cancel(clipboard_c *cb) {
+    /* No read waits on the clipboard owner, so there is nothing to wake */
+}
+
 LCB_API bool LCB_CC clipboard_set_text_ex(clipboard_c *cb, const char *src, int length, clipboard_mode mode) {
+    return clipboard_set_text_ex2(cb, src, length < 0 ? LCB_LENGTH_UNKNOWN : (size_t)length, mode);
+}
+
+LCB_API bool LCB_CC clipboard_set_text_ex2(clipboard_c *cb, const char *src, size_t length, clipboard_mode mode) {
     if (cb == NULL || src == NULL || length == 0) {
         return false;
     }
@@ -101,7 +279,7 @@ LCB_API bool LCB_CC clipboard_set_text_ex(clipboard_c *cb, const char *src, int
     NSString *ns_clip;
     bool ret;
 
-    if (length < 0) {
+    if (length == LCB_LENGTH_UNKNOWN) {
         ns_clip = [[NSString alloc] initWithUTF8String:src];
     } else {
         ns_clip = [[NSString alloc] initWithBytes:src length:length encoding:NSUTF8StringEncoding];
@@ -116,4 +294,183 @@ LCB_API bool LCB_CC clipboard_set_text_ex(clipboard_c *cb, const char *src, int
     return ret;
 }
 
+LCB_API bool LCB_CC clipboard_set_text_take(clipboard_c *cb, char *buf, size_t length, clipboard_free_fn free_fn, clipboard_mode mode) {
+    /* The text must be converted for the system clipboard anyway */
+    if (cb == NULL || !clipboard_set_text_ex2(cb, buf, length, mode)) {
+        return false;
+    }
+
+    (free_fn != NULL ? free_fn : cb->free)(buf);
+    return true;
+}
+
+LCB_API bool LCB_CC clipboard_set_text_provider(clipboard_c *cb, const clipboard_provider *provider, clipboard_mode mode) {
+    size_t length = 0;
+    char *text;
+    bool ret = false;
+
+    if (cb == NULL || provider == NULL || provider->fn == NULL) {
+        return false;
+    }
+
+    /* No lazy rendering support; generate the text up front */
+    text = provider->fn(provider->user, &length);
+    if (text != NULL) {
+        ret = clipboard_set_text_take(cb, text, length, NULL, mode);
+        if (!ret) {
+            cb->free(text);
+        }
+    }
+    if (provider->user_free != NULL) {
+        provider->user_free(provider->user);
+    }
+    return ret;
+}
+
+LCB_API bool LCB_CC clipboard_set_text_reader(clipboard_c *cb, const clipboard_reader *reader, clipboard_mode mode) {
+    size_t capacity, length = 0, n;
+    char *text;
+    bool ret = false;
+
+    if (cb == NULL || reader == NULL || reader->fn == NULL || reader->length == 0) {
+        return false;
+    }
+
+    /* The system clipboard takes the text whole, so read all of it up front */
+    capacity = reader->length != LCB_LENGTH_UNKNOWN ? reader->length : 4096;
+    text = cb->malloc(capacity);
+    while (text != NULL && (n = reader->fn(reader->user, length, text + length, capacity - length)) > 0) {
+        length += n < capacity - length ? n : capacity - length;
+        if (length == capacity) {
+            char *grown;
+            if (reader->length != LCB_LENGTH_UNKNOWN) {
+                break;
+            } else if ((grown = cb->realloc(text, capacity * 2)) == NULL) {
+                cb->free(text);
+                text = NULL;
+            } else {
+                text = grown;
+                capacity *= 2;
+            }
+        }
+    }
+
+    if (text != NULL && length > 0) {
+        ret = clipboard_set_text_take(cb, text, length, NULL, mode);
+    }
+    if (!ret) {
+        cb->free(text);
+    }
+    if (reader->user_free != NULL) {
+        reader->user_free(reader->user);
+    }
+    return ret;
+}
+
+LCB_API void *LCB_CC clipboard_data(clipboard_c *cb, const char *mime, size_t *length, clipboard_mode mode) {
+    NSString *type;
+    NSData *data;
+    unsigned char *ret;
+
+    if (cb == NULL || mime == NULL) {
+        return NULL;
+    }
+
+    /* The MIME type is used as the pasteboard type as-is */
+    type = [NSString stringWithUTF8String:mime];
+    data = [cb->pb dataForType:type];
+    if (data == nil) {
+        return NULL;
+    }
+
+    ret = cb->malloc([data length] + 1);
+    if (ret != NULL) {
+        memcpy(ret, [data bytes], [data length]);
+        ret[[data length]] = '\0';
+
+        if (length) {
+            *length = [data length];
+        }
+    }
+    return ret;
+}
+
+LCB_API void *LCB_CC clipboard_data_timed(clipboard_c *cb, const char *mime, size_t *length, clipboard_mode mode, int timeout) {
+    return clipboard_data(cb, mime, length, mode);
+}
+
+LCB_API size_t LCB_CC clipboard_data_multiple(clipboard_c *cb, const char * const *mimes, size_t count, void **data, size_t *lengths, clipboard_mode mode) {
+    size_t ret = 0;
+
+    if (cb == NULL || mimes == NULL || data == NULL) {
+        return 0;
+    }
+
+    /* The pasteboard is read locally, so there is no round trip to save */
+    for (size_t i = 0; i < count; i++) {
+        data[i] = mimes[i] != NULL ? clipboard_data(cb, mimes[i], lengths != NULL ? &lengths[i] : NULL, mode) : NULL;
+        if (data[i] != NULL) {
+            ret++;
+        } else if (lengths != NULL) {
+            lengths[i] = 0;
+        }
+    }
+    return ret;
+}
+
+LCB_API void *LCB_CC clipboard_data_preferred(clipboard_c *cb, const char * const *mimes, size_t count, size_t *chosen, size_t *length, clipboard_mode mode) {
+    void *ret = NULL;
+
+    if (chosen != NULL) {
+        *chosen = count;
+    }
+    if (cb == NULL || mimes == NULL) {
+        return NULL;
+    }
+
+    /* Each format is checked locally, so trying them in turn is cheap */
+    for (size_t i = 0; i < count; i++) {
+        if (mimes[i] != NULL && (ret = clipboard_data(cb, mimes[i], length, mode)) != NULL) {
+            if (chosen != NULL) {
+                *chosen = i;
+            }
+            break;
+        }
+    }
+    return ret;
+}
+
+LCB_API bool LCB_CC clipboard_set_file(clipboard_c *cb, const char *path, clipboard_mode mode) {
+    NSData *contents;
+
+    if (cb == NULL || path == NULL) {
+        return false;
+    }
+
+    /* The pasteboard keeps its own copy, but the file need not be read into the heap first */
+    contents = [NSData dataWithContentsOfFile:[NSString stringWithUTF8String:path]
+                                      options:NSDataReadingMappedIfSafe error:nil];
+    if (contents == nil || [contents length] == 0) {
+        return false;
+    }
+    return clipboard_set_text_ex2(cb, (const char *)[contents bytes], [contents length], mode);
+}
+
+LCB_API bool LCB_CC clipboard_set_data(clipboard_c *cb, const char *mime, const void *data, size_t length, clipboard_mode mode) {
+    NSString *type;
+    bool ret;
+
+    if (cb == NULL || mime == NULL || data == NULL || length == 0) {
+        return false;
+    }
+
+    type = [NSString stringWithUTF8String:mime];
+    [cb->pb declareTypes:[NSArray arrayWithObject:type] owner:nil];
+    ret = [cb->pb setData:[NSData dataWithBytes:data length:length] forType:type];
+
+    long serial = [cb->pb changeCount];
+    OSAtomicCompareAndSwapLong(cb->last_cb_serial, serial, &cb->last_cb_serial);
+    return ret;
+}
+
 #endif /* LIBCLIPBOARD_BUILD_COCOA */
@@ -13,7 +13,11 @@
 
 #include "libclipboard.h"
 #include <windows.h>
+#include <errno.h>
+#include <io.h>
 #include <tchar.h>
+#include <limits.h>
+#include <string.h>
 
 
 /** Win32 Implementation of the clipboard context **/
@@ -121,6 +125,15 @@ LCB_API clipboard_c *LCB_CC clipboard_new(clipboard_opts *cb_opts) {
     return ret;
 }
 
+LCB_API clipboard_c *LCB_CC clipboard_new_with_connection(struct xcb_connection_t *xc, int screen, clipboard_opts *cb_opts) {
+    /* Only X11 connections can be shared */
+    return NULL;
+}
+
+LCB_API bool LCB_CC clipboard_handle_event(clipboard_c *cb, const void *event) {
+    return false;
+}
+
 LCB_API void LCB_CC clipboard_free(clipboard_c *cb) {
     if (cb == NULL) {
         return;
@@ -147,6 +160,21 @@ LCB_API bool LCB_CC clipboard_has_ownership(clipboard_c *cb, clipboard_mode mode
     return cb && (GetClipboardOwner() == cb->hwnd);
 }
 
+LCB_API bool LCB_CC clipboard_subscribe(clipboard_c *cb, clipboard_owner_fn fn, void *user) {
+    /* Not yet supported; would need a message loop for WM_CLIPBOARDUPDATE */
+    return false;
+}
+
+LCB_API void LCB_CC clipboard_cache_stats(clipboard_c *cb, unsigned long *hits, unsigned long *misses) {
+    /* Reads are not cached */
+    if (hits != NULL) {
+        *hits = 0;
+    }
+    if (misses != NULL) {
+        *misses = 0;
+    }
+}
+
 LCB_API char *LCB_CC clipboard_text_ex(clipboard_c *cb, int *length, clipboard_mode mode) {
     char *ret = NULL;
 
@@ -187,6 +215,156 @@ LCB_API char *LCB_CC clipboard_text_ex(clipboard_c *cb, int *length, clipboard_m
     return ret;
 }
 
+LCB_API char *LCB_CC clipboard_text_ex2(clipboard_c *cb, size_t *length, clipboard_mode mode) {
+    int len = 0;
+    /* Text is converted from UTF-16 with int lengths, so never reaches 2GB */
+    char *ret = clipboard_text_ex(cb, &len, mode);
+
+    if (ret != NULL && length != NULL) {
+        *length = (size_t)len;
+    }
+    return ret;
+}
+
+LCB_API char *LCB_CC clipboard_text_timed(clipboard_c *cb, size_t *length, clipboard_mode mode, int timeout) {
+    /* Reads do not wait on the clipboard owner, so have nothing to time out */
+    return clipboard_text_ex2(cb, length, mode);
+}
+
+LCB_API bool LCB_CC clipboard_text_into(clipboard_c *cb, char *buf, size_t cap, size_t *needed, clipboard_mode mode) {
+    bool ret = false;
+
+    if (needed != NULL) {
+        *needed = 0;
+    }
+    if (cb == NULL || !get_clipboard_lock(cb)) {
+        return false;
+    }
+
+    HANDLE hData = GetClipboardData(CF_UNICODETEXT);
+    if (hData == NULL) {
+        CloseClipboard();
+        return false;
+    }
+
+    wchar_t *pData = (wchar_t *)GlobalLock(hData);
+    if (pData == NULL) {
+        CloseClipboard();
+        return false;
+    }
+
+    /* Includes the NULL terminator */
+    int len_required =
+        WideCharToMultiByte(CP_UTF8, 0, pData, -1, NULL, 0, NULL, NULL);
+    if (len_required != 0) {
+        if (needed != NULL) {
+            *needed = len_required;
+        }
+        if (buf != NULL && cap >= (size_t)len_required) {
+            ret = WideCharToMultiByte(CP_UTF8, 0, pData, -1, buf,
+                                      cap > INT_MAX ? INT_MAX : (int)cap,
+                                      NULL, NULL) != 0;
+        }
+    }
+
+    GlobalUnlock(hData);
+    CloseClipboard();
+    return ret;
+}
+
+LCB_API bool LCB_CC clipboard_text_visit(clipboard_c *cb, clipboard_mode mode, clipboard_visit_fn fn, void *user) {
+    size_t length = 0;
+    char *text;
+
+    /* The clipboard holds UTF-16 text, so a converted copy is unavoidable */
+    if (fn == NULL || (text = clipboard_text_ex2(cb, &length, mode)) == NULL) {
+        return false;
+    }
+
+    fn(text, length, user);
+    cb->free(text);
+    return true;
+}
+
+LCB_API bool LCB_CC clipboard_text_async(clipboard_c *cb, clipboard_mode mode, clipboard_text_fn fn, void *user) {
+    size_t length = 0;
+    char *text;
+
+    if (cb == NULL || fn == NULL) {
+        return false;
+    }
+
+    /* Reading the clipboard does not wait on its owner, so complete straight away */
+    text = clipboard_text_ex2(cb, &length, mode);
+    fn(text, text != NULL ? length : 0, user);
+    return true;
+}
+
+LCB_API size_t LCB_CC clipboard_text_modes(clipboard_c *cb, const clipboard_mode *modes, size_t count, char **texts, size_t *lengths) {
+    size_t ret = 0;
+
+    if (cb == NULL || modes == NULL || texts == NULL) {
+        return 0;
+    }
+
+    /* Reading the clipboard does not wait on its owner, so there is nothing to overlap */
+    for (size_t i = 0; i < count; i++) {
+        texts[i] = clipboard_text_ex2(cb, lengths != NULL ? &lengths[i] : NULL, modes[i]);
+        if (texts[i] != NULL) {
+            ret++;
+        }
+    }
+    return ret;
+}
+
+LCB_API bool LCB_CC clipboard_read_stream(clipboard_c *cb, clipboard_mode mode, clipboard_write_fn fn, void *user) {
+    size_t length = 0;
+    char *text;
+    bool ret;
+
+    /* The text is converted from UTF-16 as a whole, so it is passed on in one chunk */
+    if (fn == NULL || (text = clipboard_text_ex2(cb, &length, mode)) == NULL) {
+        return false;
+    }
+
+    ret = fn(text, length, user);
+    cb->free(text);
+    return ret;
+}
+
+/**
+ *  \brief Writes a chunk to a file descriptor.
+ *
+ *  \param [in] data The chunk.
+ *  \param [in] length The length of the chunk.
+ *  \param [in] user The file descriptor, as an (int *).
+ *  \return true iff the whole chunk was written.
+ */
+static bool write_fd(const void *data, size_t length, void *user) {
+    const char *pos = (const char *)data;
+    int fd = *(int *)user;
+
+    while (length > 0) {
+        int n = _write(fd, pos, (unsigned int)length);
+        if (n < 0 ? errno != EINTR : n == 0) {
+            /* A write that makes no progress would never finish */
+            return false;
+        } else if (n > 0) {
+            pos += n;
+            length -= (size_t)n;
+        }
+    }
+    return true;
+}
+
+LCB_API bool LCB_CC clipboard_read_to_fd(clipboard_c *cb, clipboard_mode mode, int fd) {
+    return clipboard_read_stream(cb, mode, write_fd, &fd);
+}
+
+LCB_API void LCB_CC clipboard_cancel(clipboard_c *cb) {
+    /* No read waits on the clipboard owner, so there is nothing to wake */
+}
+
 LCB_API bool LCB_CC clipboard_set_text_ex(clipboard_c *cb, const char *src, int length, clipboard_mode mode) {
     if (cb == NULL || src == NULL || length == 0) {
         return false;
@@ -237,4 +415,244 @@ LCB_API bool LCB_CC clipboard_set_text_ex(clipboard_c *cb, const char *src, int
     return true;
 }
 
+LCB_API bool LCB_CC clipboard_set_text_ex2(clipboard_c *cb, const char *src, size_t length, clipboard_mode mode) {
+    /* As above, the conversion to UTF-16 takes int lengths (including the terminator) */
+    if (length == LCB_LENGTH_UNKNOWN) {
+        return clipboard_set_text_ex(cb, src, -1, mode);
+    } else if (length >= INT_MAX) {
+        return false;
+    }
+    return clipboard_set_text_ex(cb, src, (int)length, mode);
+}
+
+LCB_API bool LCB_CC clipboard_set_text_take(clipboard_c *cb, char *buf, size_t length, clipboard_free_fn free_fn, clipboard_mode mode) {
+    /* The text must be converted for the system clipboard anyway */
+    if (cb == NULL || !clipboard_set_text_ex2(cb, buf, length, mode)) {
+        return false;
+    }
+
+    (free_fn != NULL ? free_fn : cb->free)(buf);
+    return true;
+}
+
+LCB_API bool LCB_CC clipboard_set_text_provider(clipboard_c *cb, const clipboard_provider *provider, clipboard_mode mode) {
+    size_t length = 0;
+    char *text;
+    bool ret = false;
+
+    if (cb == NULL || provider == NULL || provider->fn == NULL) {
+        return false;
+    }
+
+    /* No lazy rendering support; generate the text up front */
+    text = provider->fn(provider->user, &length);
+    if (text != NULL) {
+        ret = clipboard_set_text_take(cb, text, length, NULL, mode);
+        if (!ret) {
+            cb->free(text);
+        }
+    }
+    if (provider->user_free != NULL) {
+        provider->user_free(provider->user);
+    }
+    return ret;
+}
+
+LCB_API bool LCB_CC clipboard_set_text_reader(clipboard_c *cb, const clipboard_reader *reader, clipboard_mode mode) {
+    size_t capacity, length = 0, n;
+    char *text;
+    bool ret = false;
+
+    if (cb == NULL || reader == NULL || reader->fn == NULL || reader->length == 0) {
+        return false;
+    }
+
+    /* The system clipboard takes the text whole, so read all of it up front */
+    capacity = reader->length != LCB_LENGTH_UNKNOWN ? reader->length : 4096;
+    text = cb->malloc(capacity);
+    while (text != NULL && (n = reader->fn(reader->user, length, text + length, capacity - length)) > 0) {
+        length += n < capacity - length ? n : capacity - length;
+        if (length == capacity) {
+            char *grown;
+            if (reader->length != LCB_LENGTH_UNKNOWN) {
+                break;
+            } else if ((grown = cb->realloc(text, capacity * 2)) == NULL) {
+                cb->free(text);
+                text = NULL;
+            } else {
+                text = grown;
+                capacity *= 2;
+            }
+        }
+    }
+
+    if (text != NULL && length > 0) {
+        ret = clipboard_set_text_take(cb, text, length, NULL, mode);
+    }
+    if (!ret) {
+        cb->free(text);
+    }
+    if (reader->user_free != NULL) {
+        reader->user_free(reader->user);
+    }
+    return ret;
+}
+
+LCB_API void *LCB_CC clipboard_data(clipboard_c *cb, const char *mime, size_t *length, clipboard_mode mode) {
+    unsigned char *ret = NULL;
+
+    if (cb == NULL || mime == NULL) {
+        return NULL;
+    }
+
+    /* The MIME type names a registered format; the same name gives the same format */
+    UINT format = RegisterClipboardFormatA(mime);
+    if (format == 0 || !get_clipboard_lock(cb)) {
+        return NULL;
+    }
+
+    HANDLE hData = GetClipboardData(format);
+    if (hData == NULL) {
+        CloseClipboard();
+        return NULL;
+    }
+
+    void *pData = GlobalLock(hData);
+    if (pData == NULL) {
+        CloseClipboard();
+        return NULL;
+    }
+
+    /* May be rounded up from the size that was set */
+    SIZE_T size = GlobalSize(hData);
+    if ((ret = cb->malloc(size + 1)) != NULL) {
+        memcpy(ret, pData, size);
+        ret[size] = '\0';
+        if (length != NULL) {
+            *length = size;
+        }
+    }
+
+    GlobalUnlock(hData);
+    CloseClipboard();
+    return ret;
+}
+
+LCB_API void *LCB_CC clipboard_data_timed(clipboard_c *cb, const char *mime, size_t *length, clipboard_mode mode, int timeout) {
+    return clipboard_data(cb, mime, length, mode);
+}
+
+LCB_API size_t LCB_CC clipboard_data_multiple(clipboard_c *cb, const char * const *mimes, size_t count, void **data, size_t *lengths, clipboard_mode mode) {
+    size_t ret = 0;
+
+    if (cb == NULL || mimes == NULL || data == NULL) {
+        return 0;
+    }
+
+    /* Reading the clipboard does not involve its owner, so there is no round trip to save */
+    for (size_t i = 0; i < count; i++) {
+        data[i] = mimes[i] != NULL ? clipboard_data(cb, mimes[i], lengths != NULL ? &lengths[i] : NULL, mode) : NULL;
+        if (data[i] != NULL) {
+            ret++;
+        } else if (lengths != NULL) {
+            lengths[i] = 0;
+        }
+    }
+    return ret;
+}
+
+LCB_API void *LCB_CC clipboard_data_preferred(clipboard_c *cb, const char * const *mimes, size_t count, size_t *chosen, size_t *length, clipboard_mode mode) {
+    void *ret = NULL;
+
+    if (chosen != NULL) {
+        *chosen = count;
+    }
+    if (cb == NULL || mimes == NULL) {
+        return NULL;
+    }
+
+    /* Each format is checked locally, so trying them in turn is cheap */
+    for (size_t i = 0; i < count; i++) {
+        if (mimes[i] != NULL && (ret = clipboard_data(cb, mimes[i], length, mode)) != NULL) {
+            if (chosen != NULL) {
+                *chosen = i;
+            }
+            break;
+        }
+    }
+    return ret;
+}
+
+LCB_API bool LCB_CC clipboard_set_file(clipboard_c *cb, const char *path, clipboard_mode mode) {
+    LARGE_INTEGER size;
+    HANDLE file, mapping;
+    const char *view;
+    bool ret = false;
+
+    if (cb == NULL || path == NULL) {
+        return false;
+    }
+
+    file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    if (!GetFileSizeEx(file, &size) || size.QuadPart <= 0 || size.QuadPart >= INT_MAX) {
+        CloseHandle(file);
+        return false;
+    }
+
+    /* The text is converted to UTF-16 from the mapping, without a copy in between */
+    mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(file);
+    if (mapping == NULL) {
+        return false;
+    }
+    if ((view = (const char *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0)) != NULL) {
+        ret = clipboard_set_text_ex(cb, view, (int)size.QuadPart, mode);
+        UnmapViewOfFile(view);
+    }
+    CloseHandle(mapping);
+    return ret;
+}
+
+LCB_API bool LCB_CC clipboard_set_data(clipboard_c *cb, const char *mime, const void *data, size_t length, clipboard_mode mode) {
+    if (cb == NULL || mime == NULL || data == NULL || length == 0) {
+        return false;
+    }
+
+    UINT format = RegisterClipboardFormatA(mime);
+    if (format == 0) {
+        return false;
+    }
+
+    HGLOBAL buf = GlobalAlloc(GMEM_MOVEABLE, length);
+    if (buf == NULL) {
+        return false;
+    }
+
+    void *locked;
+    if ((locked = GlobalLock(buf)) == NULL) {
+        GlobalFree(buf);
+        return false;
+    }
+    memcpy(locked, data, length);
+    GlobalUnlock(buf);
+
+    if (!get_clipboard_lock(cb)) {
+        GlobalFree(buf);
+        return false;
+    }
+
+    EmptyClipboard();
+    if (SetClipboardData(format, buf) == NULL) {
+        CloseClipboard();
+        GlobalFree(buf);
+        return false;
+    }
+
+    CloseClipboard();
+    return true;
+}
+
 #endif /* LIBCLIPBOARD_BUILD_WIN32 */
@@ -7,28 +7,45 @@
  *             See LICENSE for details.
  */
 
-#define _POSIX_C_SOURCE 199309L
+#define _POSIX_C_SOURCE 200809L
 
 #include "libclipboard.h"
 
 #ifdef LIBCLIPBOARD_BUILD_X11
 
 #include <assert.h>
+#include <errno.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
 #include <stdio.h>
-#include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
 
 #include <xcb/xcb.h>
+#ifdef LIBCLIPBOARD_USE_XFIXES
+#  include <xcb/xfixes.h>
+#endif
 #include <pthread.h>
 
-/* X11 headers are borked */
-#if defined(__MINGW32__) && defined(gettimeofday)
-#  undef gettimeofday
+/* Timeouts are measured on the monotonic clock, unless condition variables can't wait on it */
+#if defined(_POSIX_MONOTONIC_CLOCK) && _POSIX_MONOTONIC_CLOCK >= 0 && \
+    defined(_POSIX_CLOCK_SELECTION) && _POSIX_CLOCK_SELECTION >= 0
+#  define X11_CLOCK CLOCK_MONOTONIC
+#  define X11_CLOCK_MONOTONIC
+#else
+#  define X11_CLOCK CLOCK_REALTIME
 #endif
 
 #define VALID_MODE(x) ((x) >= LCB_CLIPBOARD && (x) < LCB_MODE_END)
+/** Max number of GetProperty requests in flight when reading a selection **/
+#define X11_PIPELINE_DEPTH 8
+/** Max bytes allocated up front for an INCR transfer, whatever size the owner claims **/
+#define X11_INCR_PREALLOC_MAX (4u << 20)
 
 /**
  *  Enumeration of standard X11 atom identifiers
@@ -46,6 +63,8 @@ typedef enum std_x_atoms {
     X_ATOM_CLIPBOARD,
     /** The UTF8_STRING atom identifier **/
     X_ATOM_UTF8_STRING,
+    /** The ATOM_PAIR atom identifier **/
+    X_ATOM_ATOM_PAIR,
     /** End marker sentinel **/
     X_ATOM_END
 } std_x_atoms;
@@ -60,49 +79,324 @@ typedef union atom_c {
     xcb_intern_atom_cookie_t cookie;
 } atom_c;
 
+/**
+ *  State of an incremental (INCR) transfer being received
+ */
+typedef struct incr_c {
+    /** Determines if an INCR transfer is in progress **/
+    bool active;
+    /** The data received so far **/
+    unsigned char *data;
+    /** The number of bytes received so far **/
+    size_t length;
+    /** The allocated size (in bytes) of data **/
+    size_t capacity;
+    /** The type of the data being transferred (XCB_NONE until known) **/
+    xcb_atom_t type;
+    /** Running count of chunks received; never reset **/
+    unsigned long chunks;
+} incr_c;
+
+/**
+ *  State of a conversion read by clipboard_read_stream, which reads the
+ *  property itself instead of leaving it to the event loop
+ */
+typedef struct stream_c {
+    /** Determines if the conversion in flight is read by a stream reader **/
+    bool active;
+    /** Set by the event loop once the owner has written the property (SelectionNotify) **/
+    bool ready;
+    /** Running count of new values written to the property (INCR chunks); never reset **/
+    unsigned long chunks;
+} stream_c;
+
+/**
+ *  A pending asynchronous read of a selection (see clipboard_text_async)
+ */
+typedef struct async_c {
+    /** The completion callback (NULL for a prefetch, which only sets the deadline) **/
+    clipboard_text_fn fn;
+    /** User data passed through to fn **/
+    void *user;
+    /** When the read times out, on X11_CLOCK **/
+    struct timespec deadline;
+    /** The text to complete with, once detached (NULL on failure) **/
+    char *text;
+    /** The length of text **/
+    size_t length;
+    /** The next pending read **/
+    struct async_c *next;
+} async_c;
+
+/**
+ *  The bounds of a blocking read
+ */
+typedef struct x11_call_c {
+    /** Set if the read has a deadline of its own, besides the per-reply action_timeout **/
+    bool has_deadline;
+    /** When the read times out, on X11_CLOCK **/
+    struct timespec deadline;
+    /** The value of cb->cancels when the read started **/
+    unsigned long cancels;
+} x11_call_c;
+
+/**
+ *  One target of a MULTIPLE conversion
+ */
+typedef struct multi_item_c {
+    /** The target (XCB_NONE to skip) **/
+    xcb_atom_t target;
+    /** The property on our window the owner converts the target into **/
+    xcb_atom_t property;
+    /** The data received, allocated with cb->malloc and NULL terminated, or NULL **/
+    unsigned char *data;
+    /** The length of data **/
+    size_t length;
+    /** Set if the target is still to be converted on its own (e.g. it was sent using INCR) **/
+    bool retry;
+} multi_item_c;
+
+/**
+ *  A reader waiting on a MULTIPLE conversion (see clipboard_data_multiple)
+ */
+typedef struct multi_c {
+    /** The targets wanted **/
+    multi_item_c *items;
+    /** The number of items **/
+    size_t count;
+} multi_c;
+
+/**
+ *  A reader waiting on a TARGETS conversion to choose a type to convert to
+ *  (see clipboard_data_preferred)
+ */
+typedef struct prefs_c {
+    /** The types wanted, in order of preference **/
+    const xcb_atom_t *types;
+    /** The number of types **/
+    size_t count;
+    /** The index of the type chosen and converted to, or count if none **/
+    size_t chosen;
+    /** Set once the owner's TARGETS were received **/
+    bool listed;
+} prefs_c;
+
+/**
+ *  Selection data, immutable once published. Readers take a reference, so
+ *  that they can use the data without holding the selection lock, even
+ *  while the selection is replaced.
+ */
+typedef struct snapshot_c {
+    /** References held, including the selection's while current; updated atomically **/
+    unsigned int refs;
+    /** The data (NULL if generated on demand by provider) **/
+    unsigned char *data;
+    /** The length (in bytes) of data **/
+    size_t length;
+    /** The type (target atom) of data, e.g. UTF8_STRING **/
+    xcb_atom_t type;
+    /** Releases data; NULL if it was allocated with cb->malloc **/
+    clipboard_free_fn data_free;
+    /** Whether data is a read-only file mapping, released with munmap **/
+    bool mapped;
+    /** The mapped file, to check that it still backs the mapping (-1 if not mapped) **/
+    int fd;
+    /** Generates the data on demand (provider.fn is NULL if unused) **/
+    clipboard_provider provider;
+    /** Reads the data chunk by chunk on demand (reader.fn is NULL if unused) **/
+    clipboard_reader reader;
+} snapshot_c;
+
 /**
  *  Contains selection data
  */
 typedef struct selection_c {
-    /** Determines if we currently own the given selection **/
+    /** Determines if we currently own the given selection; written atomically under mu **/
     bool has_ownership;
-    /** The pointer to the data of the selection **/
-    unsigned char *data;
-    /** The length (in bytes) of the selection data **/
-    size_t length;
-    /** The type of data held in this selection **/
+    /** The data of the selection (owned, or converted from its owner), or NULL **/
+    snapshot_c *snap;
+    /** The type of data owned, or being converted; see snap->type for the data held **/
     xcb_atom_t target;
     /** The X11 atom for the selection mode e.g. XA_PRIMARY **/
     xcb_atom_t xmode;
+    /** Determines if we are waiting for the owner to convert the selection **/
+    bool converting;
+    /** The number of threads blocked waiting for the conversion **/
+    unsigned int waiters;
+    /** Running count of conversions ended by the owner's reply; never reset **/
+    unsigned long conversions;
+    /** Asynchronous reads completed by the conversion **/
+    async_c *async;
+    /** The reader of the conversion, if target is MULTIPLE (NULL once it gave up) **/
+    multi_c *multi;
+    /** The reader choosing a type once TARGETS arrive, if target is TARGETS (else NULL) **/
+    prefs_c *prefs;
+    /** The owner's TARGETS, as last converted, allocated with cb->malloc (or NULL) **/
+    xcb_atom_t *targets;
+    /** The number of targets **/
+    size_t ntargets;
+    /** The owner and time targets was converted from, as per cache_owner (XCB_NONE if not cacheable) **/
+    xcb_window_t targets_owner;
+    /** See targets_owner **/
+    xcb_timestamp_t targets_time;
+    /** The owner, as last reported by XFixes (XCB_NONE if unknown or none) **/
+    xcb_window_t owner;
+    /** When the owner took the selection, as last reported by XFixes **/
+    xcb_timestamp_t owner_time;
+    /** The owner and time that data was converted from; data is a valid cache iff they are current **/
+    xcb_window_t cache_owner;
+    /** See cache_owner **/
+    xcb_timestamp_t cache_time;
+    /** Determines if data was converted from a foreign owner **/
+    bool cached;
+    /** Determines if the owner changed while converting, so the result is not cacheable **/
+    bool convert_stale;
+    /** Determines if the conversion was only started to prefetch the data **/
+    bool prefetching;
+    /** State of any INCR transfer into this selection **/
+    incr_c incr;
+    /** State of any stream reader of the conversion **/
+    stream_c stream;
+    /** Reads of the foreign selection served from cache **/
+    unsigned long cache_hits;
+    /** Reads of the foreign selection that needed a conversion **/
+    unsigned long cache_misses;
+
+    /** Mutex for access to the selection, so that selections don't contend **/
+    pthread_mutex_t mu;
+    /** Indicates true iff mu is initted **/
+    bool mu_initted;
+    /** Condition variable to notify when a conversion completes or progresses **/
+    pthread_cond_t cond;
+    /** Indicates true iff cond is initted **/
+    bool cond_initted;
 } selection_c;
 
-/** X11 Implementation of the clipboard context **/
-struct clipboard_c {
+/**
+ *  State of an incremental (INCR) transfer being sent to a requestor
+ */
+typedef struct incr_send_c {
+    /** The requestor window **/
+    xcb_window_t requestor;
+    /** The property on the requestor window being written to **/
+    xcb_atom_t property;
+    /** The data being sent, which later changes to the selection don't affect **/
+    snapshot_c *snap;
+    /** Offset (in bytes) of the next chunk to send **/
+    size_t offset;
+    /** The next transfer in progress **/
+    struct incr_send_c *next;
+} incr_send_c;
+
+/**
+ *  An X11 connection and event loop, shared by all contexts on the same display.
+ *  Allocated with calloc, as it outlives the context that created it.
+ */
+typedef struct x11_display_c {
+    /** The display name (NULL for the default), allocated with malloc **/
+    char *name;
     /** XCB Display connection **/
     xcb_connection_t *xc;
     /** XCB Default screen **/
     xcb_screen_t *xs;
     /** Standard atoms **/
     atom_c std_atoms[X_ATOM_END];
+    /** First XFixes event code, or 0 if XFixes is unavailable **/
+    uint8_t xfixes_event_base;
+    /** Window whose destruction ends the event loop **/
+    xcb_window_t xw;
+    /** Number of contexts using the display; protected by g_displays_mu **/
+    unsigned int refs;
+    /** The next display in g_displays **/
+    struct x11_display_c *next;
+
+    /** Event loop thread, dispatching events to contexts by window **/
+    pthread_t event_loop;
+    /** Indicates true iff event_loop is initted **/
+    bool event_loop_initted;
+    /** Mutex for access to contexts, dead and the watchdog state **/
+    pthread_mutex_t mu;
+    /** Indicates true iff mu is initted **/
+    bool mu_initted;
+    /** Contexts with a window on this display **/
+    struct clipboard_c *contexts;
+    /** Set if the event loop stopped because the connection broke **/
+    bool dead;
+    /** Set if the connection belongs to the host, which feeds us its events **/
+    bool foreign;
+
+    /** Watchdog thread to time out asynchronous reads of all contexts; started on first use **/
+    pthread_t watchdog;
+    /** Indicates true iff watchdog is initted **/
+    bool watchdog_initted;
+    /** Condition variable to notify the watchdog of new reads, and clipboard_free of each scan **/
+    pthread_cond_t watchdog_cond;
+    /** Indicates true iff watchdog_cond is initted **/
+    bool watchdog_cond_initted;
+    /** Tells the watchdog to exit; protected by mu **/
+    bool watchdog_quit;
+    /** Tells the watchdog to rescan the selections for reads; protected by mu **/
+    bool watchdog_kick;
+    /** Contexts that have used the watchdog; protected by mu **/
+    struct clipboard_c *watched;
+    /** The context the watchdog is scanning, if any; protected by mu **/
+    struct clipboard_c *scanning;
+    /** Number of the watchdog's current pass over watched; protected by mu **/
+    unsigned long watch_pass;
+} x11_display_c;
+
+/** X11 Implementation of the clipboard context **/
+struct clipboard_c {
+    /** The shared connection **/
+    x11_display_c *display;
+    /** The next context on the display; protected by display->mu **/
+    struct clipboard_c *next_context;
+    /** XCB Display connection (as per display) **/
+    xcb_connection_t *xc;
+    /** XCB Default screen (as per display) **/
+    xcb_screen_t *xs;
+    /** Standard atoms (as per display) **/
+    atom_c std_atoms[X_ATOM_END];
     /** Our window to use for messages **/
     xcb_window_t xw;
+    /** Set by the event loop once xw is destroyed; no more events are dispatched to us **/
+    bool destroyed;
     /** Action timeout (ms) **/
     int action_timeout;
     /** Transfer size (bytes) **/
     uint32_t transfer_size;
+    /** Max size (bytes) of data to prefetch, or 0 if not prefetching **/
+    size_t prefetch_size;
+    /** Max size (bytes) of a property we write; larger data is sent using INCR **/
+    uint32_t incr_threshold;
+    /** INCR transfers being sent; only accessed from the event loop **/
+    incr_send_c *incr_sends;
+    /** Set while a MULTIPLE conversion is in flight, as the properties it uses are named after its targets **/
+    bool multiple_busy;
 
-    /** Event loop thread **/
-    pthread_t event_loop;
-    /** Indicates true iff event_loop is initted **/
-    bool event_loop_initted;
-    /** Mutex for access to context data **/
+    /** Mutex for access to context data; selection data is guarded per selection **/
     pthread_mutex_t mu;
     /** Indicates true iff mu is initted **/
     bool mu_initted;
-    /** Condition variable to notify when action is complete **/
+    /** Condition variable to notify when the window is destroyed **/
     pthread_cond_t cond;
     /** Indicates true iff cond is initted **/
     bool cond_initted;
+    /** Set while on display->watched; protected by display->mu **/
+    bool watched;
+    /** The next context on display->watched; protected by display->mu **/
+    struct clipboard_c *next_watched;
+    /** The display watchdog's pass that last scanned us; protected by display->mu **/
+    unsigned long watch_pass;
+    /** Running count of clipboard_cancel calls; updated atomically **/
+    unsigned long cancels;
+
+    /** First XFixes event code, or 0 if owner changes are not tracked **/
+    uint8_t xfixes_event_base;
+    /** Subscriber to ownership changes (NULL if none) **/
+    clipboard_owner_fn owner_fn;
+    /** User data for owner_fn **/
+    void *owner_user;
 
     /** Selection data **/
     selection_c selections[LCB_MODE_END];
@@ -123,9 +417,14 @@ struct clipboard_c {
  */
 const char * const g_std_atom_names[X_ATOM_END] = {
     "TARGETS", "MULTIPLE", "TIMESTAMP", "INCR",
-    "CLIPBOARD", "UTF8_STRING",
+    "CLIPBOARD", "UTF8_STRING", "ATOM_PAIR",
 };
 
+/** Mutex for access to g_displays (and the refs of each display) **/
+static pthread_mutex_t g_displays_mu = PTHREAD_MUTEX_INITIALIZER;
+/** The displays in use **/
+static x11_display_c *g_displays = NULL;
+
 /**
  *  \brief Interns the list of atoms
  *
@@ -133,11 +432,13 @@ const char * const g_std_atom_names[X_ATOM_END] = {
  *  \param [out] atoms The location to store interned atoms.
  *  \param [in] atom_names The names of the atoms to intern.
  *  \param [in] number The number of atoms to intern.
+ *  \param [in] only_if_exists If set, atoms that no client has interned yet
+ *                             are not created, but returned as XCB_NONE.
  *  \return true iff all atoms were interned.
  */
-static bool x11_intern_atoms(xcb_connection_t *xc, atom_c *atoms, const char * const *atom_names, int number) {
+static bool x11_intern_atoms(xcb_connection_t *xc, atom_c *atoms, const char * const *atom_names, int number, bool only_if_exists) {
     for (int i = 0; i < number; i++) {
-        atoms[i].cookie = xcb_intern_atom(xc, 0,
+        atoms[i].cookie = xcb_intern_atom(xc, only_if_exists,
                                           strlen(atom_names[i]), atom_names[i]);
     }
 
@@ -178,516 +479,3630 @@ static xcb_screen_t *x11_get_screen(xcb_connection_t *xc, int screen) {
 }
 
 /**
- *  \brief Clears the selection data held in our cache on SelectionClear.
+ *  \brief Finds the context that a window belongs to.
  *
- *  \param [in] cb The clipboard context.
- *  \param [in] e The selection clear event.
+ *  \param [in] d The display.
+ *  \param [in] xw The window.
+ *  \return The context, or NULL if the window is not one of ours.
+ *
+ *  The context remains valid for the event loop until it has processed
+ *  the DestroyNotify of xw, so may be used after d->mu is released.
  */
-static void x11_clear_selection(clipboard_c *cb, xcb_selection_clear_event_t *e) {
-    if (e->owner != cb->xw) {
-        return;
+static clipboard_c *x11_find_context(x11_display_c *d, xcb_window_t xw) {
+    clipboard_c *cb;
+
+    pthread_mutex_lock(&d->mu);
+    for (cb = d->contexts; cb != NULL && cb->xw != xw; cb = cb->next_context);
+    pthread_mutex_unlock(&d->mu);
+    return cb;
+}
+
+/**
+ *  \brief Finds the context sending an INCR transfer to a requestor's property.
+ *
+ *  \param [in] d The display.
+ *  \param [in] requestor The requestor window.
+ *  \param [in] property The property being written to, or XCB_NONE for any.
+ *  \return The context, or NULL if there is no such transfer.
+ *
+ *  Only to be called from the event loop, which owns the transfer lists.
+ */
+static clipboard_c *x11_find_sender(x11_display_c *d, xcb_window_t requestor, xcb_atom_t property) {
+    clipboard_c *cb;
+
+    pthread_mutex_lock(&d->mu);
+    for (cb = d->contexts; cb != NULL; cb = cb->next_context) {
+        incr_send_c *t;
+        for (t = cb->incr_sends; t != NULL; t = t->next) {
+            if (t->requestor == requestor && (property == XCB_NONE || t->property == property)) {
+                break;
+            }
+        }
+        if (t != NULL) {
+            break;
+        }
     }
+    pthread_mutex_unlock(&d->mu);
+    return cb;
+}
 
+/**
+ *  \brief Finds the selection context for the given selection atom.
+ *
+ *  \param [in] cb The clipboard context.
+ *  \param [in] xmode The selection atom (also used as our property name).
+ *  \return The selection context, or NULL if not found.
+ */
+static selection_c *x11_find_selection(clipboard_c *cb, xcb_atom_t xmode) {
     for (int i = 0; i < LCB_MODE_END; i++) {
-        selection_c *sel = &cb->selections[i];
-        if (sel->xmode == e->selection && (pthread_mutex_lock(&cb->mu) == 0)) {
-            cb->free(sel->data);
-            sel->data = NULL;
-            sel->length = 0;
-            sel->has_ownership = false;
-            sel->target = XCB_NONE;
-            pthread_mutex_unlock(&cb->mu);
-            break;
+        if (cb->selections[i].xmode == xmode) {
+            return &cb->selections[i];
         }
     }
+    return NULL;
 }
 
 /**
- *  \brief Retrieves the selection into our cache on SelectionNotify
+ *  \brief Initialises a condition variable whose timed waits use X11_CLOCK.
+ *
+ *  \param [out] cond The condition variable.
+ *  \return true iff cond was initialised.
+ */
+static bool x11_cond_init(pthread_cond_t *cond) {
+    pthread_condattr_t attr;
+    bool ret;
+
+    if (pthread_condattr_init(&attr) != 0) {
+        return false;
+    }
+#ifdef X11_CLOCK_MONOTONIC
+    ret = pthread_condattr_setclock(&attr, X11_CLOCK) == 0 && pthread_cond_init(cond, &attr) == 0;
+#else
+    ret = pthread_cond_init(cond, &attr) == 0;
+#endif
+    pthread_condattr_destroy(&attr);
+    return ret;
+}
+
+/**
+ *  \brief Gets the current time.
+ *
+ *  \param [out] now The current time, on X11_CLOCK.
+ */
+static void x11_get_time(struct timespec *now) {
+    clock_gettime(X11_CLOCK, now);
+}
+
+/**
+ *  \brief Adds a number of milliseconds to a point in time.
+ *
+ *  \param [in,out] ts The time.
+ *  \param [in] ms The milliseconds to add.
+ */
+static void x11_add_time(struct timespec *ts, int ms) {
+    ts->tv_sec += ms / 1000;
+    ts->tv_nsec += (ms % 1000) * 1000000L;
+    if (ts->tv_nsec >= 1000000000L) {
+        ts->tv_sec += ts->tv_nsec / 1000000000L;
+        ts->tv_nsec = ts->tv_nsec % 1000000000L;
+    }
+}
+
+/**
+ *  \brief Calculates the absolute time at which an action times out.
  *
  *  \param [in] cb The clipboard context.
- *  \param [in] e The selection notify event.
+ *  \param [out] timeout The deadline, on X11_CLOCK.
+ */
+static void x11_get_deadline(clipboard_c *cb, struct timespec *timeout) {
+    x11_get_time(timeout);
+    x11_add_time(timeout, cb->action_timeout);
+}
+
+/**
+ *  \brief Determines if one point in time precedes another.
  *
- *  The INCR format is not supported.
+ *  \param [in] a The first time.
+ *  \param [in] b The second time.
+ *  \return true iff a is before b.
  */
-static void x11_retrieve_selection(clipboard_c *cb, xcb_selection_notify_event_t *e) {
-    unsigned char *buf = NULL;
-    size_t bufsiz = 0, bytes_after = 1;
-    xcb_get_property_reply_t *reply = NULL;
-    xcb_atom_t actual_type;
-    uint8_t actual_format;
+static bool x11_time_before(const struct timespec *a, const struct timespec *b) {
+    return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
 
-    if (e->property != XCB_ATOM_PRIMARY && e->property != XCB_ATOM_SECONDARY && e->property != cb->std_atoms[X_ATOM_CLIPBOARD].atom) {
-        fprintf(stderr, "x11_retrieve_selection: [Warn] Unknown selection property returned: %d\n", e->property);
+/**
+ *  \brief Creates a snapshot of selection data, with one reference.
+ *
+ *  \param [in] cb The clipboard context.
+ *  \param [in] data The data (NULL if provided on demand). Taken on success.
+ *  \param [in] length The length of data.
+ *  \param [in] type The type of data.
+ *  \param [in] data_free Releases data (NULL for cb->free).
+ *  \param [in] provider Generates the data on demand (optional).
+ *  \return The snapshot, or NULL on error.
+ */
+static snapshot_c *x11_snapshot_new(clipboard_c *cb, unsigned char *data, size_t length, xcb_atom_t type, clipboard_free_fn data_free, const clipboard_provider *provider) {
+    snapshot_c *snap = cb->malloc(sizeof(snapshot_c));
+    if (snap == NULL) {
+        return NULL;
+    }
+
+    snap->refs = 1;
+    snap->data = data;
+    snap->length = length;
+    snap->type = type;
+    snap->data_free = data_free;
+    snap->mapped = false;
+    snap->fd = -1;
+    if (provider != NULL) {
+        snap->provider = *provider;
+    } else {
+        memset(&snap->provider, 0, sizeof(snap->provider));
+    }
+    memset(&snap->reader, 0, sizeof(snap->reader));
+    return snap;
+}
+
+/**
+ *  \brief Takes another reference to a snapshot.
+ *
+ *  \param [in] snap The snapshot, to which the caller already holds a reference.
+ *  \return snap.
+ */
+static snapshot_c *x11_snapshot_ref(snapshot_c *snap) {
+    __atomic_add_fetch(&snap->refs, 1, __ATOMIC_RELAXED);
+    return snap;
+}
+
+/**
+ *  \brief Drops a reference to a snapshot, freeing it with the last one.
+ *
+ *  \param [in] cb The clipboard context.
+ *  \param [in] snap The snapshot (may be NULL).
+ */
+static void x11_snapshot_unref(clipboard_c *cb, snapshot_c *snap) {
+    if (snap == NULL || __atomic_sub_fetch(&snap->refs, 1, __ATOMIC_ACQ_REL) != 0) {
         return;
     }
 
-    while (bytes_after > 0) {
-        free(reply); /* XCB: Do not use custom allocators */
-        xcb_get_property_cookie_t ck = xcb_get_property(cb->xc, true, cb->xw,
-                                       e->property, XCB_ATOM_ANY,
-                                       bufsiz / 4, cb->transfer_size / 4);
-        reply = xcb_get_property_reply(cb->xc, ck, NULL);
-        /* reply->format should be 8, 16 or 32. */
-        if (reply == NULL || (bufsiz > 0 && (reply->format != actual_format || reply->type != actual_type)) || ((reply->format % 8) != 0)) {
-            fprintf(stderr, "x11_retrieve_selection: [Err] Invalid return value from xcb_get_property_reply\n");
-            cb->free(buf);
-            buf = NULL;
-            break;
-        }
+    if (snap->mapped) {
+        munmap(snap->data, snap->length);
+        close(snap->fd);
+    } else if (snap->data != NULL) {
+        (snap->data_free != NULL ? snap->data_free : cb->free)(snap->data);
+    }
+    if (snap->provider.fn != NULL && snap->provider.user_free != NULL) {
+        snap->provider.user_free(snap->provider.user);
+    }
+    if (snap->reader.fn != NULL && snap->reader.user_free != NULL) {
+        snap->reader.user_free(snap->reader.user);
+    }
+    cb->free(snap);
+}
 
-        if (bufsiz == 0) {
-            actual_type = reply->type;
-            actual_format = reply->format;
-        }
+/**
+ *  \brief Takes a reference to the selection's current data.
+ *
+ *  \param [in] sel The selection context. sel->mu must be held.
+ *  \param [in] type The type of data wanted.
+ *  \return The snapshot, or NULL if there is no data of that type.
+ */
+static snapshot_c *x11_snapshot_get(selection_c *sel, xcb_atom_t type) {
+    return sel->snap != NULL && sel->snap->type == type ? x11_snapshot_ref(sel->snap) : NULL;
+}
 
-        /* Todo: Check for INCR */
+/**
+ *  \brief Pulls data from a reader until buf is full or the data ends.
+ *
+ *  \param [in] reader The reader.
+ *  \param [in] offset The offset (in bytes) of the data to read.
+ *  \param [out] buf The buffer to read into.
+ *  \param [in] cap The size of buf.
+ *  \return The number of bytes read; less than cap only at the end of the data.
+ */
+static size_t x11_reader_fill(const clipboard_reader *reader, size_t offset, unsigned char *buf, size_t cap) {
+    size_t got = 0, n;
 
-        int nitems = xcb_get_property_value_length(reply);
-        if (nitems > 0) {
-            if ((bufsiz % 4) != 0) {
-                fprintf(stderr, "x11_retrieve_selection: [Err] Got more data but read data size is not a multiple of 4\n");
-                cb->free(buf);
-                buf = NULL;
-                break;
-            }
+    if (reader->length != LCB_LENGTH_UNKNOWN) {
+        cap = offset < reader->length ? (reader->length - offset < cap ? reader->length - offset : cap) : 0;
+    }
+    while (got < cap && (n = reader->fn(reader->user, offset + got, buf + got, cap - got)) > 0) {
+        got += n < cap - got ? n : cap - got;
+    }
+    return got;
+}
 
-            size_t unit_size = (reply->format / 8);
-            buf = cb->realloc(buf, unit_size * (bufsiz + nitems));
-            if (buf == NULL) {
-                fprintf(stderr, "x11_retrieve_selection: [Err] realloc failed\n");
-                break;
-            }
+/**
+ *  \brief Pulls all of the data from a reader into a single buffer.
+ *
+ *  \param [in] cb The clipboard context.
+ *  \param [in] reader The reader.
+ *  \param [out] length The length of the data read.
+ *  \return The data, allocated with cb->malloc, or NULL if there is none.
+ */
+static unsigned char *x11_reader_read_all(clipboard_c *cb, const clipboard_reader *reader, size_t *length) {
+    bool known = reader->length != LCB_LENGTH_UNKNOWN;
+    size_t capacity = known ? reader->length : cb->transfer_size;
+    unsigned char *buf = cb->malloc(capacity);
+    size_t got;
 
-            memcpy(buf + bufsiz, xcb_get_property_value(reply), nitems * unit_size);
-            bufsiz += nitems * unit_size;
+    if (buf == NULL) {
+        fprintf(stderr, "x11_reader_read_all: [Err] malloc failed\n");
+        return NULL;
+    }
+
+    got = x11_reader_fill(reader, 0, buf, capacity);
+    while (!known && got == capacity) {
+        /* Grow geometrically so the total copy volume stays linear */
+        unsigned char *grown = cb->realloc(buf, capacity * 2);
+        if (grown == NULL) {
+            fprintf(stderr, "x11_reader_read_all: [Err] realloc failed\n");
+            cb->free(buf);
+            return NULL;
         }
+        buf = grown;
+        got += x11_reader_fill(reader, got, buf + got, capacity);
+        capacity *= 2;
+    }
 
-        bytes_after = reply->bytes_after;
+    if (got == 0) {
+        cb->free(buf);
+        return NULL;
     }
-    free(reply); /* XCB: Do not use custom allocators */
+    *length = got;
+    return buf;
+}
+
+/**
+ *  \brief Determines if the file behind a mapped snapshot still backs all of the mapping.
+ *
+ *  \param [in] snap The snapshot.
+ *  \return false iff snap is mapped and its file has been truncated since,
+ *          in which case reading the mapping past the new end raises SIGBUS.
+ */
+static bool x11_snapshot_intact(snapshot_c *snap) {
+    struct stat st;
+    return !snap->mapped || (fstat(snap->fd, &st) == 0 && (uintmax_t)st.st_size >= snap->length);
+}
+
+/**
+ *  \brief Reads what is left of a truncated file into a snapshot, in place of its mapping.
+ *
+ *  \param [in] cb The clipboard context.
+ *  \param [in] snap The mapped snapshot. The caller's reference is given up.
+ *  \return A reference to a snapshot holding the file's current contents, or
+ *          NULL if it is now empty or could not be read.
+ */
+static snapshot_c *x11_snapshot_reread(clipboard_c *cb, snapshot_c *snap) {
+    snapshot_c *ret = NULL;
+    size_t length = 0;
+    struct stat st;
+    unsigned char *buf;
 
-    if (buf != NULL && (pthread_mutex_lock(&cb->mu) == 0)) {
-        selection_c *sel = NULL;
-        for (int i = 0; i < LCB_MODE_END; i++) {
-            if (cb->selections[i].xmode == e->property) {
-                sel = &cb->selections[i];
+    if (fstat(snap->fd, &st) == 0 && st.st_size > 0 && (uintmax_t)st.st_size < snap->length) {
+        length = (size_t)st.st_size;
+    }
+    /* Allow for a NULL terminator, as for data read from other owners */
+    if (length > 0 && (buf = cb->malloc(length + 1)) != NULL) {
+        size_t got = 0;
+        while (got < length) {
+            ssize_t n = pread(snap->fd, buf + got, length - got, (off_t)got);
+            if (n > 0) {
+                got += (size_t)n;
+            } else if (n == 0 || errno != EINTR) {
                 break;
             }
         }
+        buf[got] = '\0';
+        if (got == 0 || (ret = x11_snapshot_new(cb, buf, got, snap->type, NULL, NULL)) == NULL) {
+            cb->free(buf);
+        }
+    }
+    x11_snapshot_unref(cb, snap);
+    return ret;
+}
 
-        if (sel != NULL && sel->target == actual_type) {
-            cb->free(sel->data);
-            sel->data = buf;
-            sel->length = bufsiz;
-            buf = NULL;
-        } else {
-            fprintf(stderr, "x11_retrieve_selection: [Warn] Mismatched selection: actual_type=%d\n", actual_type);
+/**
+ *  \brief Generates the data of a snapshot from its provider, if not yet held.
+ *
+ *  \param [in] cb The clipboard context.
+ *  \param [in] sel The selection the snapshot was taken from. sel->mu must not be held.
+ *  \param [in] snap The snapshot. The caller's reference is given up.
+ *  \return A reference to a snapshot holding the data, or NULL on failure.
+ *
+ *  If the provider memoises, the generated data replaces the provider as
+ *  the selection's data, unless the selection changed meanwhile.
+ */
+static snapshot_c *x11_snapshot_provide(clipboard_c *cb, selection_c *sel, snapshot_c *snap) {
+    if (!x11_snapshot_intact(snap)) {
+        /* The file was truncated under us; don't touch the mapping past its end */
+        return x11_snapshot_reread(cb, snap);
+    } else if (snap->data != NULL || (snap->provider.fn == NULL && snap->reader.fn == NULL)) {
+        if (snap->data == NULL) {
+            x11_snapshot_unref(cb, snap);
+            return NULL;
         }
+        return snap;
+    }
 
-        pthread_cond_broadcast(&cb->cond);
-        pthread_mutex_unlock(&cb->mu);
+    size_t length = 0;
+    char *data = snap->reader.fn != NULL ? (char *)x11_reader_read_all(cb, &snap->reader, &length) :
+                 snap->provider.fn(snap->provider.user, &length);
+    snapshot_c *ret = NULL;
+
+    if (data == NULL || length == 0 ||
+            (ret = x11_snapshot_new(cb, (unsigned char *)data, length, snap->type, NULL, NULL)) == NULL) {
+        cb->free(data);
+        x11_snapshot_unref(cb, snap);
+        return NULL;
+    }
+
+    if (snap->provider.memoise && pthread_mutex_lock(&sel->mu) == 0) {
+        if (sel->snap == snap) {
+            /* The selection's reference to the provider passes to the data */
+            sel->snap = x11_snapshot_ref(ret);
+            x11_snapshot_unref(cb, snap);
+        }
+        pthread_mutex_unlock(&sel->mu);
     }
-    cb->free(buf);
+    x11_snapshot_unref(cb, snap);
+    return ret;
 }
 
 /**
- *  \brief Sends the selection data to the requestor on SelectionRequest
+ *  \brief Releases the selection data.
  *
  *  \param [in] cb The clipboard context.
- *  \param [in] e The selection request event.
- *  \return true iff the data was sent (requestor's property was changed)
+ *  \param [in] sel The selection context. sel->mu must be held.
+ */
+static void x11_release_data(clipboard_c *cb, selection_c *sel) {
+    x11_snapshot_unref(cb, sel->snap);
+    sel->snap = NULL;
+    sel->cached = false;
+}
+
+/**
+ *  \brief Abandons any INCR transfer in progress for the selection.
  *
- *  Not currently ICCCM compliant as MULTIPLE target is unsupported. Also
- *  not compliant because we're not supplying a proper TIMESTAMP value.
+ *  \param [in] cb The clipboard context.
+ *  \param [in] sel The selection context. sel->mu must be held.
  */
-static bool x11_transmit_selection(clipboard_c *cb, xcb_selection_request_event_t *e) {
-    /* Default location to store data if none specified */
-    if (e->property == XCB_NONE) {
-        e->property = e->target;
+static void x11_incr_reset(clipboard_c *cb, selection_c *sel) {
+    cb->free(sel->incr.data);
+    sel->incr.data = NULL;
+    sel->incr.length = 0;
+    sel->incr.capacity = 0;
+    sel->incr.type = XCB_NONE;
+    sel->incr.active = false;
+}
+
+/**
+ *  \brief Appends the value of a property reply to an INCR transfer.
+ *
+ *  \param [in] cb The clipboard context.
+ *  \param [in] sel The selection context. sel->mu must be held.
+ *  \param [in] reply The property reply holding the next chunk.
+ *  \return true iff the chunk was appended.
+ */
+static bool x11_incr_append(clipboard_c *cb, selection_c *sel, xcb_get_property_reply_t *reply) {
+    size_t nbytes = xcb_get_property_value_length(reply);
+    if (nbytes == 0) {
+        return true;
     }
 
-    if (e->target == cb->std_atoms[X_ATOM_TARGETS].atom) {
-        xcb_atom_t targets[] = {
-            cb->std_atoms[X_ATOM_TIMESTAMP].atom,
-            cb->std_atoms[X_ATOM_TARGETS].atom,
-            cb->std_atoms[X_ATOM_UTF8_STRING].atom
-        };
-        xcb_change_property(cb->xc, XCB_PROP_MODE_REPLACE, e->requestor,
-                            e->property, XCB_ATOM_ATOM,
-                            sizeof(xcb_atom_t) * 8,
-                            sizeof(targets) / sizeof(xcb_atom_t), targets);
-    } else if (e->target == cb->std_atoms[X_ATOM_TIMESTAMP].atom) {
-        xcb_timestamp_t cur = XCB_CURRENT_TIME;
-        xcb_change_property(cb->xc, XCB_PROP_MODE_REPLACE, e->requestor,
-                            e->property, XCB_ATOM_INTEGER, sizeof(cur) * 8,
-                            1, &cur);
-    } else if (e->target == cb->std_atoms[X_ATOM_UTF8_STRING].atom) {
-        selection_c *sel = NULL;
-        if (pthread_mutex_lock(&cb->mu) != 0) {
-            return false;
-        }
+    if (sel->incr.type == XCB_NONE) {
+        sel->incr.type = reply->type;
+    } else if (sel->incr.type != reply->type) {
+        fprintf(stderr, "x11_incr_append: [Err] Chunk type changed mid-transfer\n");
+        return false;
+    }
 
-        for (int i = 0; i < LCB_MODE_END; i++) {
-            if (cb->selections[i].xmode == e->selection) {
-                sel = &cb->selections[i];
-                break;
-            }
+    if (sel->incr.length + nbytes > sel->incr.capacity) {
+        /* Grow geometrically so the total copy volume stays linear */
+        size_t capacity = sel->incr.capacity * 2;
+        if (capacity < sel->incr.length + nbytes) {
+            capacity = sel->incr.length + nbytes;
         }
 
-        if (sel == NULL || !sel->has_ownership || sel->data == NULL || sel->target != e->target) {
-            pthread_mutex_unlock(&cb->mu);
+        unsigned char *data = cb->realloc(sel->incr.data, capacity);
+        if (data == NULL) {
+            fprintf(stderr, "x11_incr_append: [Err] realloc failed\n");
             return false;
         }
-
-        xcb_change_property(cb->xc, XCB_PROP_MODE_REPLACE, e->requestor,
-                            e->property, e->target, 8, sel->length, sel->data);
-        pthread_mutex_unlock(&cb->mu);
-    } else {
-        /* Unknown target */
-        return false;
+        sel->incr.data = data;
+        sel->incr.capacity = capacity;
     }
 
+    memcpy(sel->incr.data + sel->incr.length, xcb_get_property_value(reply), nbytes);
+    sel->incr.length += nbytes;
     return true;
 }
 
 /**
- *  \brief The main event loop to process window messages.
- *
- *  \param [in] arg The clipboard context.
+ *  \brief Copies the selection data into a buffer, NULL terminating it
  *
- *  This thread will run indefinitely until the clipboard context's window
- *  is destroyed. It *must* receive a DestroyNotify message to end.
+ *  \param [in] snap The selection data
+ *  \param [out] buf The buffer to copy into, at least snap->length + 1 bytes.
  */
-static void *x11_event_loop(void *arg) {
-    clipboard_c *cb = (clipboard_c *)arg;
-    xcb_generic_event_t *e;
+static void copy_text_snapshot(snapshot_c *snap, char *buf) {
+    memcpy(buf, snap->data, snap->length);
+    buf[snap->length] = '\0';
+}
 
-    while ((e = xcb_wait_for_event(cb->xc))) {
-        if (e->response_type == 0) {
-            /* I think this cast is appropriate... */
-            xcb_generic_error_t *err = (xcb_generic_error_t *) e;
-            fprintf(stderr, "x11_event_loop: [Warn] Received X11 error: %d\n", err->error_code);
-            free(e); /* XCB: Do not use custom allocators */
+/**
+ *  \brief Determines if the foreign selection data cached is still current.
+ *
+ *  \param [in] cb The clipboard context.
+ *  \param [in] sel The selection context. sel->mu must be held.
+ *  \param [in] type The type of data wanted.
+ *  \return true iff data of that type may be served without a conversion.
+ *
+ *  Only possible while XFixes reports owner changes, as the owner and
+ *  ownership time the data was converted from are otherwise unknown.
+ */
+static bool x11_cache_valid(clipboard_c *cb, selection_c *sel, xcb_atom_t type) {
+    return cb->xfixes_event_base != 0 && sel->cached && !sel->converting &&
+           sel->snap != NULL && sel->snap->type == type &&
+           sel->cache_owner == sel->owner && sel->cache_time == sel->owner_time;
+}
+
+/**
+ *  \brief Determines if the owner's TARGETS cached are still current.
+ *
+ *  \param [in] cb The clipboard context.
+ *  \param [in] sel The selection context. sel->mu must be held.
+ *  \return true iff sel->targets may be used without a TARGETS conversion.
+ *
+ *  As with x11_cache_valid, only possible while XFixes reports owner changes,
+ *  as the same window may offer other targets once it takes the selection again.
+ */
+static bool x11_targets_valid(clipboard_c *cb, selection_c *sel) {
+    return cb->xfixes_event_base != 0 && sel->targets != NULL &&
+           sel->targets_owner != XCB_NONE && sel->targets_owner == sel->owner &&
+           sel->targets_time == sel->owner_time;
+}
+
+/**
+ *  \brief Chooses the most preferred type the owner offers.
+ *
+ *  \param [in] types The types wanted, in order of preference.
+ *  \param [in] count The number of types.
+ *  \param [in] targets The owner's TARGETS.
+ *  \param [in] ntargets The number of targets.
+ *  \return The index of the type chosen, or count if none is offered.
+ */
+static size_t x11_choose_target(const xcb_atom_t *types, size_t count, const xcb_atom_t *targets, size_t ntargets) {
+    for (size_t i = 0; i < count; i++) {
+        for (size_t j = 0; types[i] != XCB_NONE && j < ntargets; j++) {
+            if (targets[j] == types[i]) {
+                return i;
+            }
+        }
+    }
+    return count;
+}
+
+/**
+ *  \brief Asks the selection owner to convert the selection to the given type.
+ *
+ *  \param [in] cb The clipboard context.
+ *  \param [in] sel The selection context. sel->mu must be held.
+ *  \param [in] target The type to convert to.
+ *
+ *  Does nothing if a conversion is already in flight, so that concurrent
+ *  readers share its result; check sel->target to see if it is of the
+ *  type wanted. The data of the previous conversion is kept until this
+ *  one ends, for any readers yet to pick it up.
+ */
+static void x11_convert_selection(clipboard_c *cb, selection_c *sel, xcb_atom_t target) {
+    if (sel->converting) {
+        return;
+    }
+
+    x11_incr_reset(cb, sel);
+
+    sel->converting = true;
+    sel->convert_stale = false;
+    sel->prefetching = false;
+    sel->target = target;
+    xcb_convert_selection(cb->xc, cb->xw, sel->xmode,
+                          sel->target, sel->xmode, XCB_CURRENT_TIME);
+    xcb_flush(cb->xc);
+}
+
+/**
+ *  \brief Abandons the conversion in flight, if nobody is waiting for it.
+ *
+ *  \param [in] cb The clipboard context.
+ *  \param [in] sel The selection context. sel->mu must be held.
+ */
+static void x11_abandon_conversion(clipboard_c *cb, selection_c *sel) {
+    if (sel->converting && sel->waiters == 0 && sel->async == NULL) {
+        /* Late replies (and INCR chunks) will be ignored */
+        sel->converting = false;
+        x11_incr_reset(cb, sel);
+    }
+}
+
+/**
+ *  \brief Detaches asynchronous reads from the selection, ready to complete.
+ *
+ *  \param [in] cb The clipboard context.
+ *  \param [in] sel The selection context. sel->mu must be held.
+ *  \param [in] now If NULL, all reads are detached and passed a copy of the
+ *                  selection text (if available). Otherwise only reads whose
+ *                  deadline has passed are detached, without text.
+ *  \param [in] list The list to prepend the detached reads to.
+ *  \return The new head of list. Complete it with x11_async_dispatch.
+ */
+static async_c *x11_async_detach(clipboard_c *cb, selection_c *sel, const struct timespec *now, async_c *list) {
+    snapshot_c *snap = sel->snap;
+    bool has_text = now == NULL && !sel->converting && snap != NULL && snap->data != NULL &&
+                    snap->type == cb->std_atoms[X_ATOM_UTF8_STRING].atom;
+
+    for (async_c **it = &sel->async; *it != NULL;) {
+        async_c *a = *it;
+        if (now != NULL && x11_time_before(now, &a->deadline)) {
+            it = &a->next;
             continue;
         }
 
-        switch (e->response_type & ~0x80) {
-            case XCB_DESTROY_NOTIFY: {
-                xcb_destroy_notify_event_t *evt = (xcb_destroy_notify_event_t *)e;
-                if (evt->window == cb->xw) {
-                    free(e); /* XCB: Do not use custom allocators */
-                    return NULL;
-                }
-            }
-            break;
-            case XCB_SELECTION_CLEAR: {
-                x11_clear_selection(cb, (xcb_selection_clear_event_t *)e);
+        *it = a->next;
+        if (has_text && a->fn != NULL && (a->text = cb->malloc(snap->length + 1)) != NULL) {
+            copy_text_snapshot(snap, a->text);
+            a->length = snap->length;
+        }
+        a->next = list;
+        list = a;
+    }
+
+    return list;
+}
+
+/**
+ *  \brief Completes (and frees) a list of detached asynchronous reads.
+ *
+ *  \param [in] cb The clipboard context. No selection lock may be held, so
+ *                 that the callbacks may call back into the library.
+ *  \param [in] list The reads to complete.
+ */
+static void x11_async_dispatch(clipboard_c *cb, async_c *list) {
+    while (list != NULL) {
+        async_c *next = list->next;
+        if (list->fn != NULL) {
+            list->fn(list->text, list->length, list->user);
+        }
+        cb->free(list);
+        list = next;
+    }
+}
+
+/**
+ *  \brief Ends the conversion in flight, installing the data received.
+ *
+ *  \param [in] cb The clipboard context.
+ *  \param [in] sel The selection context. sel->mu must be held.
+ *  \param [in] data The data received, allocated with cb->malloc, or NULL
+ *                   if the conversion failed. The selection takes ownership.
+ *  \param [in] length The length of data.
+ *  \param [in] type The type of data.
+ *  \return The asynchronous reads to complete with x11_async_dispatch.
+ */
+static async_c *x11_finish_conversion(clipboard_c *cb, selection_c *sel, unsigned char *data, size_t length, xcb_atom_t type) {
+    xcb_atom_t utf8 = cb->std_atoms[X_ATOM_UTF8_STRING].atom;
+    bool streamed = sel->stream.active;
+    snapshot_c *snap = NULL;
+
+    if (data != NULL && sel->converting && !sel->has_ownership && sel->target == type) {
+        snap = x11_snapshot_new(cb, data, length, type, NULL, NULL);
+        if (snap == NULL) {
+            fprintf(stderr, "x11_finish_conversion: [Err] malloc failed\n");
+            cb->free(data);
+        }
+    } else if (data != NULL) {
+        fprintf(stderr, "x11_finish_conversion: [Warn] Mismatched selection: actual_type=%d\n", type);
+        cb->free(data);
+    }
+
+    if (sel->converting && !sel->has_ownership) {
+        /* The previous data goes even if the conversion failed */
+        x11_release_data(cb, sel);
+        if (snap != NULL) {
+            sel->snap = snap;
+            /* Any owner change before the owner replied has already been seen */
+            sel->cached = !sel->convert_stale;
+            sel->cache_owner = sel->owner;
+            sel->cache_time = sel->owner_time;
+        }
+    } else {
+        x11_snapshot_unref(cb, snap);
+    }
+
+    if (sel->converting) {
+        sel->conversions++;
+    }
+    sel->converting = false;
+    sel->stream.active = false;
+    x11_incr_reset(cb, sel);
+    if (sel->async != NULL && (sel->target != utf8 || streamed) && !sel->has_ownership) {
+        /* Asynchronous reads queued behind a conversion to another type (or
+           one streamed, which keeps no copy) want text */
+        x11_convert_selection(cb, sel, utf8);
+        pthread_cond_broadcast(&sel->cond);
+        return NULL;
+    }
+    pthread_cond_broadcast(&sel->cond);
+    return x11_async_detach(cb, sel, NULL, NULL);
+}
+
+/**
+ *  \brief Ends the conversion of a selection from the event loop.
+ *
+ *  \param [in] cb The clipboard context.
+ *  \param [in] xmode The selection atom.
+ *  \param [in] data As per x11_finish_conversion.
+ *  \param [in] length As per x11_finish_conversion.
+ *  \param [in] type As per x11_finish_conversion.
+ */
+static void x11_complete_conversion(clipboard_c *cb, xcb_atom_t xmode, unsigned char *data, size_t length, xcb_atom_t type) {
+    selection_c *sel = x11_find_selection(cb, xmode);
+
+    if (sel != NULL && pthread_mutex_lock(&sel->mu) == 0) {
+        async_c *done = x11_finish_conversion(cb, sel, data, length, type);
+        pthread_mutex_unlock(&sel->mu);
+        x11_async_dispatch(cb, done);
+    } else {
+        cb->free(data);
+    }
+}
+
+/**
+ *  \brief Times out the asynchronous reads of a context whose owner has not replied.
+ *
+ *  \param [in] cb The clipboard context. display->mu must not be held.
+ *  \param [in] now The current time.
+ *  \param [in,out] next The earliest deadline of the reads still pending.
+ *  \param [in,out] pending Set if any read is still pending, and so next is valid.
+ *  \return true iff any read was timed out.
+ */
+static bool x11_watchdog_scan(clipboard_c *cb, const struct timespec *now, struct timespec *next, bool *pending) {
+    async_c *expired = NULL;
+
+    for (int i = 0; i < LCB_MODE_END; i++) {
+        selection_c *sel = &cb->selections[i];
+        if (pthread_mutex_lock(&sel->mu) != 0) {
+            continue;
+        }
+        expired = x11_async_detach(cb, sel, now, expired);
+        x11_abandon_conversion(cb, sel);
+
+        for (async_c *a = sel->async; a != NULL; a = a->next) {
+            if (!*pending || x11_time_before(&a->deadline, next)) {
+                *next = a->deadline;
+                *pending = true;
             }
-            break;
-            case XCB_SELECTION_NOTIFY: {
-                x11_retrieve_selection(cb, (xcb_selection_notify_event_t *)e);
+        }
+        pthread_mutex_unlock(&sel->mu);
+    }
+
+    if (expired == NULL) {
+        return false;
+    }
+    x11_async_dispatch(cb, expired);
+    return true;
+}
+
+/**
+ *  \brief Times out asynchronous reads whose owner has not replied.
+ *
+ *  \param [in] arg The display.
+ *
+ *  This thread is started by x11_start_watchdog when first needed and
+ *  runs until watchdog_quit is set by x11_display_free. Each pass scans
+ *  the watched contexts one at a time, without d->mu, so that reads can be
+ *  started meanwhile; watchdog_kick makes sure none is missed. The context
+ *  being scanned is kept in d->scanning, which clipboard_free waits out.
+ */
+static void *x11_watchdog(void *arg) {
+    x11_display_c *d = (x11_display_c *)arg;
+
+    pthread_mutex_lock(&d->mu);
+    while (!d->watchdog_quit) {
+        struct timespec now, next;
+        bool pending = false, fired = false;
+        clipboard_c *cb = d->watched;
+
+        d->watchdog_kick = false;
+        d->watch_pass++;
+        x11_get_time(&now);
+        while (cb != NULL) {
+            if (cb->watch_pass == d->watch_pass) {
+                cb = cb->next_watched;
+                continue;
             }
-            break;
-            case XCB_SELECTION_REQUEST: {
-                xcb_selection_request_event_t *req = (xcb_selection_request_event_t *)e;
-                xcb_selection_notify_event_t notify = {0};
-                notify.response_type = XCB_SELECTION_NOTIFY;
-                notify.time = XCB_CURRENT_TIME;
-                notify.requestor = req->requestor;
-                notify.selection = req->selection;
-                notify.target = req->target;
-                notify.property = x11_transmit_selection(cb, req) ? req->property : XCB_NONE;
-                xcb_send_event(cb->xc, false, req->requestor, XCB_EVENT_MASK_PROPERTY_CHANGE, (char *)&notify);
-                xcb_flush(cb->xc);
+            cb->watch_pass = d->watch_pass;
+            d->scanning = cb;
+            pthread_mutex_unlock(&d->mu);
+
+            fired = x11_watchdog_scan(cb, &now, &next, &pending) || fired;
+
+            pthread_mutex_lock(&d->mu);
+            d->scanning = NULL;
+            pthread_cond_broadcast(&d->watchdog_cond);
+            /* If unwatched meanwhile, its successor may be gone too; start over */
+            cb = cb->watched ? cb->next_watched : d->watched;
+        }
+
+        if (!fired && !d->watchdog_kick && !d->watchdog_quit) {
+            if (pending) {
+                pthread_cond_timedwait(&d->watchdog_cond, &d->mu, &next);
+            } else {
+                pthread_cond_wait(&d->watchdog_cond, &d->mu);
             }
-            break;
-            case XCB_PROPERTY_NOTIFY: {
+        }
+    }
+    pthread_mutex_unlock(&d->mu);
+
+    return NULL;
+}
+
+/**
+ *  \brief Starts the display's watchdog thread if not already running,
+ *         and has it watch the context.
+ *
+ *  \param [in] cb The clipboard context. display->mu must not be held.
+ *  \return true iff the watchdog is running.
+ */
+static bool x11_start_watchdog(clipboard_c *cb) {
+    x11_display_c *d = cb->display;
+    bool ret;
+
+    pthread_mutex_lock(&d->mu);
+    if (!d->watchdog_initted) {
+        d->watchdog_initted = pthread_create(&d->watchdog, NULL,
+                                             x11_watchdog, (void *)d) == 0;
+    }
+    if (d->watchdog_initted && !cb->watched) {
+        cb->watched = true;
+        cb->next_watched = d->watched;
+        d->watched = cb;
+    }
+    ret = d->watchdog_initted;
+    pthread_mutex_unlock(&d->mu);
+    return ret;
+}
+
+/**
+ *  \brief Tells the watchdog to rescan the selections for new reads.
+ *
+ *  \param [in] cb The clipboard context. display->mu must not be held.
+ */
+static void x11_wake_watchdog(clipboard_c *cb) {
+    pthread_mutex_lock(&cb->display->mu);
+    cb->display->watchdog_kick = true;
+    /* Broadcast, as clipboard_free may be waiting on the same condition */
+    pthread_cond_broadcast(&cb->display->watchdog_cond);
+    pthread_mutex_unlock(&cb->display->mu);
+}
+
+/**
+ *  \brief Stops the watchdog from scanning the context.
+ *
+ *  \param [in] cb The clipboard context.
+ *
+ *  Once this returns, the watchdog neither scans the context nor
+ *  dispatches its reads.
+ */
+static void x11_unwatch_context(clipboard_c *cb) {
+    x11_display_c *d = cb->display;
+
+    pthread_mutex_lock(&d->mu);
+    if (cb->watched) {
+        for (clipboard_c **it = &d->watched; *it != NULL; it = &(*it)->next_watched) {
+            if (*it == cb) {
+                *it = cb->next_watched;
+                break;
             }
-            break;
-            default: {
-                /* Ignore unknown messages */
+        }
+        cb->watched = false;
+    }
+    while (d->scanning == cb) {
+        pthread_cond_wait(&d->watchdog_cond, &d->mu);
+    }
+    pthread_mutex_unlock(&d->mu);
+}
+
+/**
+ *  \brief Determines if a selection being prefetched is too large to continue.
+ *
+ *  \param [in] cb The clipboard context.
+ *  \param [in] xmode The selection atom.
+ *  \param [in] size The size of the data (in bytes), as far as known.
+ *  \return true iff the conversion should be given up.
+ */
+static bool x11_prefetch_exceeded(clipboard_c *cb, xcb_atom_t xmode, size_t size) {
+    selection_c *sel = x11_find_selection(cb, xmode);
+    bool ret = false;
+
+    if (sel != NULL && pthread_mutex_lock(&sel->mu) == 0) {
+        ret = sel->prefetching && size > cb->prefetch_size;
+        pthread_mutex_unlock(&sel->mu);
+    }
+    return ret;
+}
+
+/**
+ *  \brief Clears the selection data held in our cache on SelectionClear.
+ *
+ *  \param [in] cb The clipboard context.
+ *  \param [in] e The selection clear event.
+ */
+static void x11_clear_selection(clipboard_c *cb, xcb_selection_clear_event_t *e) {
+    if (e->owner != cb->xw) {
+        return;
+    }
+
+    selection_c *sel = x11_find_selection(cb, e->selection);
+    if (sel != NULL && (pthread_mutex_lock(&sel->mu) == 0)) {
+        snapshot_c *old = sel->snap;
+        sel->snap = NULL;
+        sel->cached = false;
+        __atomic_store_n(&sel->has_ownership, false, __ATOMIC_RELEASE);
+        sel->target = XCB_NONE;
+        pthread_mutex_unlock(&sel->mu);
+        /* Released outside the lock; transfers in progress hold their own reference */
+        x11_snapshot_unref(cb, old);
+    }
+}
+
+/**
+ *  \brief Hands a stream reader the conversion it is waiting for, if any.
+ *
+ *  \param [in] cb The clipboard context.
+ *  \param [in] xmode The selection atom, which also names the property written.
+ *  \return true iff a stream reader will read the property, so the event
+ *          loop must leave it alone.
+ */
+static bool x11_stream_ready(clipboard_c *cb, xcb_atom_t xmode) {
+    selection_c *sel = x11_find_selection(cb, xmode);
+    bool ret = false;
+
+    if (sel != NULL && pthread_mutex_lock(&sel->mu) == 0) {
+        if ((ret = sel->stream.active && sel->converting)) {
+            sel->stream.ready = true;
+            pthread_cond_broadcast(&sel->cond);
+        }
+        pthread_mutex_unlock(&sel->mu);
+    }
+    return ret;
+}
+
+/**
+ *  \brief Reads (and deletes) a property of known size from our window,
+ *         passing it on chunk by chunk.
+ *
+ *  \param [in] cb The clipboard context.
+ *  \param [in] property The property to read.
+ *  \param [in] type The type of the property, as probed.
+ *  \param [in] size The size of the property in bytes, as probed.
+ *  \param [in] fn Passed each chunk of at most transfer_size bytes, in order.
+ *                 Returns false to stop reading.
+ *  \param [in] user User data passed through to fn.
+ *  \return true iff the whole property was read.
+ *
+ *  Requests for successive chunks are pipelined (up to X11_PIPELINE_DEPTH
+ *  at once), so at most that many chunks are buffered at a time.
+ */
+static bool x11_stream_property(clipboard_c *cb, xcb_atom_t property, xcb_atom_t type, size_t size, clipboard_write_fn fn, void *user) {
+    xcb_get_property_cookie_t cookies[X11_PIPELINE_DEPTH];
+    size_t nchunks = (size + cb->transfer_size - 1) / cb->transfer_size;
+    size_t sent = 0;
+    bool ok = true;
+
+    /* Once stopped, only the replies already asked for are collected */
+    for (size_t i = 0; i < sent || (ok && i < nchunks); i++) {
+        for (; ok && sent < nchunks && sent < i + X11_PIPELINE_DEPTH; sent++) {
+            /* The property is only deleted once the final chunk has been read */
+            cookies[sent % X11_PIPELINE_DEPTH] = xcb_get_property(cb->xc, sent == nchunks - 1,
+                                                 cb->xw, property, type,
+                                                 (sent * cb->transfer_size) / 4,
+                                                 cb->transfer_size / 4);
+        }
+
+        xcb_get_property_reply_t *reply = xcb_get_property_reply(cb->xc,
+                                          cookies[i % X11_PIPELINE_DEPTH], NULL);
+        size_t offset = i * cb->transfer_size;
+        size_t expected = size - offset < cb->transfer_size ? size - offset : cb->transfer_size;
+        if (ok && (reply == NULL || reply->type != type ||
+                   (size_t)xcb_get_property_value_length(reply) != expected)) {
+            fprintf(stderr, "x11_stream_property: [Err] Invalid return value from xcb_get_property_reply\n");
+            ok = false;
+        }
+
+        if (ok && !fn(xcb_get_property_value(reply), expected, user)) {
+            ok = false;
+        }
+        free(reply); /* XCB: Do not use custom allocators */
+    }
+
+    if (sent < nchunks) {
+        xcb_delete_property(cb->xc, cb->xw, property);
+        xcb_flush(cb->xc);
+    }
+    return ok;
+}
+
+/**
+ *  \brief Copies a chunk to the position given, and advances it.
+ *
+ *  \param [in] data The chunk.
+ *  \param [in] length The length of the chunk.
+ *  \param [in,out] user The position to copy to, as an (unsigned char **).
+ *  \return true.
+ */
+static bool x11_copy_chunk(const void *data, size_t length, void *user) {
+    unsigned char **pos = (unsigned char **)user;
+    memcpy(*pos, data, length);
+    *pos += length;
+    return true;
+}
+
+/**
+ *  \brief Reads (and deletes) a property of known size from our window.
+ *
+ *  \param [in] cb The clipboard context.
+ *  \param [in] property The property to read.
+ *  \param [in] type The type of the property, as probed.
+ *  \param [out] buf The buffer to read into, at least size bytes long.
+ *  \param [in] size The size of the property in bytes, as probed.
+ *  \return true iff the whole property was read.
+ *
+ *  Each chunk is copied straight to its final place in buf.
+ */
+static bool x11_read_property(clipboard_c *cb, xcb_atom_t property, xcb_atom_t type, unsigned char *buf, size_t size) {
+    unsigned char *pos = buf;
+    return x11_stream_property(cb, property, type, size, x11_copy_chunk, &pos);
+}
+
+/**
+ *  \brief Retrieves the owner's TARGETS on SelectionNotify
+ *
+ *  \param [in] cb The clipboard context.
+ *  \param [in] e The selection notify event.
+ *
+ *  The list is cached for the owner. If a reader is waiting to choose a
+ *  type, the conversion to its most preferred type offered is requested
+ *  straight away, from here, rather than once the reader has woken up.
+ */
+static void x11_retrieve_targets(clipboard_c *cb, xcb_selection_notify_event_t *e) {
+    selection_c *sel = x11_find_selection(cb, e->selection);
+    xcb_get_property_reply_t *reply = NULL;
+    xcb_atom_t *targets = NULL;
+    size_t ntargets = 0;
+    async_c *done = NULL;
+
+    if (sel == NULL) {
+        return;
+    }
+
+    if (e->property != XCB_NONE) {
+        reply = xcb_get_property_reply(cb->xc, xcb_get_property(cb->xc, true, cb->xw,
+                                       e->property, XCB_ATOM_ATOM, 0, cb->transfer_size / 4), NULL);
+    }
+    if (reply != NULL && reply->type == XCB_ATOM_ATOM && reply->format == 32) {
+        ntargets = xcb_get_property_value_length(reply) / sizeof(xcb_atom_t);
+    }
+    if (ntargets > 0 && (targets = cb->malloc(ntargets * sizeof(xcb_atom_t))) == NULL) {
+        fprintf(stderr, "x11_retrieve_targets: [Err] malloc failed\n");
+        ntargets = 0;
+    } else if (ntargets > 0) {
+        memcpy(targets, xcb_get_property_value(reply), ntargets * sizeof(xcb_atom_t));
+    }
+    free(reply); /* XCB: Do not use custom allocators */
+
+    if (pthread_mutex_lock(&sel->mu) != 0) {
+        cb->free(targets);
+        return;
+    }
+
+    if (sel->converting && !sel->has_ownership && sel->target == cb->std_atoms[X_ATOM_TARGETS].atom) {
+        prefs_c *p = sel->prefs;
+        if (p != NULL && targets != NULL) {
+            p->listed = true;
+            p->chosen = x11_choose_target(p->types, p->count, targets, ntargets);
+        }
+        if (targets != NULL) {
+            /* Kept for the next reader, unless the owner changed while converting */
+            cb->free(sel->targets);
+            sel->targets = targets;
+            sel->ntargets = ntargets;
+            sel->targets_owner = sel->convert_stale ? XCB_NONE : sel->owner;
+            sel->targets_time = sel->owner_time;
+            targets = NULL;
+        }
+
+        if (p != NULL && p->chosen < p->count) {
+            /* The same conversion carries on to the data */
+            sel->prefs = NULL;
+            sel->target = p->types[p->chosen];
+            x11_incr_reset(cb, sel);
+            xcb_convert_selection(cb->xc, cb->xw, sel->xmode,
+                                  sel->target, sel->xmode, XCB_CURRENT_TIME);
+            xcb_flush(cb->xc);
+        } else {
+            done = x11_finish_conversion(cb, sel, NULL, 0, XCB_NONE);
+        }
+    }
+    pthread_mutex_unlock(&sel->mu);
+    x11_async_dispatch(cb, done);
+    cb->free(targets);
+}
+
+/**
+ *  \brief Retrieves the targets of a MULTIPLE conversion on SelectionNotify
+ *
+ *  \param [in] cb The clipboard context.
+ *  \param [in] e The selection notify event.
+ *
+ *  The pair list written back by the owner tells which targets it converted,
+ *  and into which properties. Their sizes are probed in one pipelined batch,
+ *  then each is read like the data of a single conversion. Targets sent
+ *  using INCR are left for the reader to convert on their own.
+ */
+static void x11_retrieve_multiple(clipboard_c *cb, xcb_selection_notify_event_t *e) {
+    selection_c *sel = x11_find_selection(cb, e->selection);
+    xcb_atom_t atom_pair = cb->std_atoms[X_ATOM_ATOM_PAIR].atom;
+    xcb_get_property_reply_t *reply = NULL;
+    xcb_get_property_cookie_t *probes = NULL;
+    multi_item_c *items = NULL;
+    size_t npairs = 0;
+
+    if (sel == NULL) {
+        return;
+    }
+
+    if (e->property != XCB_NONE) {
+        reply = xcb_get_property_reply(cb->xc, xcb_get_property(cb->xc, true, cb->xw,
+                                       e->property, atom_pair, 0, cb->transfer_size / 4), NULL);
+    }
+    if (reply != NULL && reply->type == atom_pair && reply->format == 32) {
+        npairs = xcb_get_property_value_length(reply) / (2 * sizeof(xcb_atom_t));
+    }
+    if (npairs > 0) {
+        items = cb->calloc(npairs, sizeof(multi_item_c));
+        probes = cb->malloc(npairs * sizeof(xcb_get_property_cookie_t));
+        if (items == NULL || probes == NULL) {
+            fprintf(stderr, "x11_retrieve_multiple: [Err] malloc failed\n");
+            npairs = 0;
+        }
+    }
+
+    if (npairs > 0) {
+        xcb_atom_t *pairs = (xcb_atom_t *)xcb_get_property_value(reply);
+        for (size_t i = 0; i < npairs; i++) {
+            items[i].target = pairs[2 * i];
+            items[i].property = pairs[2 * i + 1];
+            if (items[i].property != XCB_NONE) {
+                probes[i] = xcb_get_property(cb->xc, false, cb->xw, items[i].property, XCB_ATOM_ANY, 0, 0);
+            }
+        }
+
+        for (size_t i = 0; i < npairs; i++) {
+            if (items[i].property == XCB_NONE) {
+                /* Refused by the owner */
+                continue;
+            }
+
+            xcb_get_property_reply_t *probe = xcb_get_property_reply(cb->xc, probes[i], NULL);
+            xcb_atom_t type = probe != NULL ? probe->type : XCB_NONE;
+            size_t size = probe != NULL ? probe->bytes_after : 0;
+            free(probe); /* XCB: Do not use custom allocators */
+
+            if (type == cb->std_atoms[X_ATOM_INCR].atom) {
+                /* The transfer is never started, so the owner times out */
+                items[i].retry = true;
+            } else if (type != items[i].target || size == 0) {
+                xcb_delete_property(cb->xc, cb->xw, items[i].property);
+            } else if ((items[i].data = cb->malloc(size + 1)) == NULL) {
+                fprintf(stderr, "x11_retrieve_multiple: [Err] malloc failed\n");
+                xcb_delete_property(cb->xc, cb->xw, items[i].property);
+            } else if (!x11_read_property(cb, items[i].property, type, items[i].data, size)) {
+                cb->free(items[i].data);
+                items[i].data = NULL;
+            } else {
+                items[i].data[size] = '\0';
+                items[i].length = size;
+            }
+        }
+    }
+    cb->free(probes);
+    free(reply); /* XCB: Do not use custom allocators */
+
+    if (pthread_mutex_lock(&sel->mu) != 0) {
+        return;
+    }
+
+    async_c *done = NULL;
+    if (sel->converting && sel->target == cb->std_atoms[X_ATOM_MULTIPLE].atom) {
+        multi_c *m = sel->multi;
+        /* Without a pair list (e.g. MULTIPLE was refused), every target is converted on its own */
+        for (size_t j = 0; m != NULL && npairs > 0 && j < m->count; j++) {
+            m->items[j].retry = false;
+        }
+        for (size_t i = 0; m != NULL && i < npairs; i++) {
+            for (size_t j = 0; j < m->count; j++) {
+                if (m->items[j].target == items[i].target && m->items[j].data == NULL) {
+                    m->items[j].data = items[i].data;
+                    m->items[j].length = items[i].length;
+                    m->items[j].retry = items[i].retry;
+                    items[i].data = NULL;
+                    break;
+                }
+            }
+        }
+        done = x11_finish_conversion(cb, sel, NULL, 0, XCB_NONE);
+    }
+    pthread_mutex_unlock(&sel->mu);
+    x11_async_dispatch(cb, done);
+
+    for (size_t i = 0; i < npairs; i++) {
+        cb->free(items[i].data);
+    }
+    cb->free(items);
+}
+
+/**
+ *  \brief Retrieves the selection into our cache on SelectionNotify
+ *
+ *  \param [in] cb The clipboard context.
+ *  \param [in] e The selection notify event.
+ *
+ *  The property is first probed for its type and size so that the data
+ *  can be read into a single, exactly sized allocation. If the owner
+ *  replies with the INCR type, the transfer is continued chunk-by-chunk
+ *  from x11_incr_receive. Otherwise the conversion ends here, and any
+ *  asynchronous reads waiting for it are completed.
+ */
+static void x11_retrieve_selection(clipboard_c *cb, xcb_selection_notify_event_t *e) {
+    unsigned char *buf = NULL;
+    size_t bufsiz;
+    xcb_get_property_reply_t *reply;
+    xcb_atom_t actual_type;
+
+    if (e->target == cb->std_atoms[X_ATOM_MULTIPLE].atom) {
+        x11_retrieve_multiple(cb, e);
+        return;
+    } else if (e->target == cb->std_atoms[X_ATOM_TARGETS].atom) {
+        x11_retrieve_targets(cb, e);
+        return;
+    } else if (e->property == XCB_NONE) {
+        /* The owner refused (or there is no owner) */
+        x11_complete_conversion(cb, e->selection, NULL, 0, XCB_NONE);
+        return;
+    } else if (e->property != XCB_ATOM_PRIMARY && e->property != XCB_ATOM_SECONDARY && e->property != cb->std_atoms[X_ATOM_CLIPBOARD].atom) {
+        fprintf(stderr, "x11_retrieve_selection: [Warn] Unknown selection property returned: %d\n", e->property);
+        return;
+    } else if (x11_stream_ready(cb, e->property)) {
+        /* The stream reader reads the property itself */
+        return;
+    }
+
+    /* A zero length read returns just the type and size */
+    reply = xcb_get_property_reply(cb->xc, xcb_get_property(cb->xc, false, cb->xw,
+                                   e->property, XCB_ATOM_ANY, 0, 0), NULL);
+    /* reply->format should be 8, 16 or 32. */
+    if (reply == NULL || (reply->format % 8) != 0) {
+        fprintf(stderr, "x11_retrieve_selection: [Err] Invalid return value from xcb_get_property_reply\n");
+        free(reply); /* XCB: Do not use custom allocators */
+        x11_complete_conversion(cb, e->property, NULL, 0, XCB_NONE);
+        return;
+    }
+    actual_type = reply->type;
+    bufsiz = reply->bytes_after;
+    free(reply); /* XCB: Do not use custom allocators */
+
+    if (actual_type == cb->std_atoms[X_ATOM_INCR].atom) {
+        uint32_t incr_size = 0;
+
+        /* Reading (and deleting) the property tells the owner to start sending chunks */
+        reply = xcb_get_property_reply(cb->xc, xcb_get_property(cb->xc, true, cb->xw,
+                                       e->property, actual_type, 0, 1), NULL);
+        if (reply != NULL && xcb_get_property_value_length(reply) >= (int)sizeof(incr_size)) {
+            memcpy(&incr_size, xcb_get_property_value(reply), sizeof(incr_size));
+        }
+        free(reply); /* XCB: Do not use custom allocators */
+
+        if (x11_prefetch_exceeded(cb, e->property, incr_size)) {
+            /* The owner is left to time out */
+            x11_complete_conversion(cb, e->property, NULL, 0, XCB_NONE);
+            return;
+        }
+
+        selection_c *sel = x11_find_selection(cb, e->property);
+        if (sel != NULL && pthread_mutex_lock(&sel->mu) == 0) {
+            if (sel->converting) {
+                x11_incr_reset(cb, sel);
+                sel->incr.active = true;
+                /* The size is only a lower bound, but is a good initial guess. It
+                   comes from the owner, so is capped; x11_incr_append grows the
+                   buffer as data actually arrives. */
+                size_t capacity = incr_size < X11_INCR_PREALLOC_MAX ? incr_size : X11_INCR_PREALLOC_MAX;
+                if (capacity > 0 && (sel->incr.data = cb->malloc(capacity)) != NULL) {
+                    sel->incr.capacity = capacity;
+                }
+            }
+            pthread_mutex_unlock(&sel->mu);
+        }
+        return;
+    }
+
+    if (bufsiz == 0 || x11_prefetch_exceeded(cb, e->property, bufsiz)) {
+        xcb_delete_property(cb->xc, cb->xw, e->property);
+        x11_complete_conversion(cb, e->property, NULL, 0, XCB_NONE);
+        return;
+    }
+
+    /* Allow for a NULL terminator so the data can be handed out as-is */
+    buf = cb->malloc(bufsiz + 1);
+    if (buf == NULL) {
+        fprintf(stderr, "x11_retrieve_selection: [Err] malloc failed\n");
+        xcb_delete_property(cb->xc, cb->xw, e->property);
+    } else if (!x11_read_property(cb, e->property, actual_type, buf, bufsiz)) {
+        cb->free(buf);
+        buf = NULL;
+    } else {
+        buf[bufsiz] = '\0';
+    }
+
+    x11_complete_conversion(cb, e->property, buf, buf != NULL ? bufsiz : 0, actual_type);
+}
+
+/**
+ *  \brief Receives the next chunk of an INCR transfer on PropertyNotify
+ *
+ *  \param [in] cb The clipboard context.
+ *  \param [in] e The property notify event.
+ *
+ *  Each chunk is read (and deleted, which requests the next chunk) as soon
+ *  as the owner writes it. A zero-length chunk completes the transfer.
+ *  The read is a blocking round trip on the display's shared event loop,
+ *  so other contexts on the display wait for it (see clipboard_new).
+ */
+static void x11_incr_receive(clipboard_c *cb, xcb_property_notify_event_t *e) {
+    selection_c *sel = x11_find_selection(cb, e->atom);
+    size_t offset = 0, bytes_after = 1;
+    bool active = false;
+    async_c *done = NULL;
+
+    if (e->state != XCB_PROPERTY_NEW_VALUE || sel == NULL) {
+        return;
+    }
+
+    if (pthread_mutex_lock(&sel->mu) == 0) {
+        active = sel->incr.active;
+        if (sel->stream.active && sel->converting) {
+            /* The stream reader reads (and deletes) the chunk itself */
+            sel->stream.chunks++;
+            pthread_cond_broadcast(&sel->cond);
+        }
+        pthread_mutex_unlock(&sel->mu);
+    }
+
+    while (active && bytes_after > 0) {
+        /* Only this thread starts transfers, so re-checking incr.active after the round trip suffices */
+        xcb_get_property_cookie_t ck = xcb_get_property(cb->xc, true, cb->xw,
+                                       e->atom, XCB_ATOM_ANY,
+                                       offset / 4, cb->transfer_size / 4);
+        xcb_get_property_reply_t *reply = xcb_get_property_reply(cb->xc, ck, NULL);
+        size_t nbytes = reply != NULL ? xcb_get_property_value_length(reply) : 0;
+        bool ok = reply != NULL && (reply->format % 8) == 0 &&
+                  (reply->bytes_after == 0 || (nbytes % 4) == 0);
+
+        if (pthread_mutex_lock(&sel->mu) != 0) {
+            free(reply); /* XCB: Do not use custom allocators */
+            return;
+        }
+
+        active = sel->incr.active;
+        if (active && !(ok && x11_incr_append(cb, sel, reply))) {
+            fprintf(stderr, "x11_incr_receive: [Err] Failed to receive INCR chunk\n");
+            done = x11_finish_conversion(cb, sel, NULL, 0, XCB_NONE);
+            active = false;
+        } else if (active && offset == 0 && nbytes == 0) {
+            /* Zero-length chunk: transfer complete */
+            unsigned char *data = sel->incr.data;
+            sel->incr.data = NULL;
+            done = x11_finish_conversion(cb, sel, data, sel->incr.length, sel->incr.type);
+            active = false;
+        } else if (active && sel->prefetching && sel->incr.length > cb->prefetch_size) {
+            /* Too large to prefetch; the next reader will convert it again */
+            done = x11_finish_conversion(cb, sel, NULL, 0, XCB_NONE);
+            active = false;
+        }
+
+        if (reply != NULL) {
+            /* Also lets waiters restart their timeout, which applies per chunk */
+            sel->incr.chunks++;
+            for (async_c *a = sel->async; a != NULL; a = a->next) {
+                x11_get_deadline(cb, &a->deadline);
+            }
+            bytes_after = reply->bytes_after;
+            offset += nbytes;
+        }
+        pthread_cond_broadcast(&sel->cond);
+        pthread_mutex_unlock(&sel->mu);
+        free(reply); /* XCB: Do not use custom allocators */
+    }
+
+    x11_async_dispatch(cb, done);
+}
+
+/**
+ *  \brief Starts sending the selection to the requestor using INCR.
+ *
+ *  \param [in] cb The clipboard context.
+ *  \param [in] snap The data to send. The caller's reference passes to the transfer.
+ *  \param [in] requestor The requestor window.
+ *  \param [in] property The property on the requestor window to write to.
+ *  \return true iff the transfer was started.
+ */
+static bool x11_incr_send_start(clipboard_c *cb, snapshot_c *snap, xcb_window_t requestor, xcb_atom_t property) {
+    incr_send_c *t = cb->malloc(sizeof(incr_send_c));
+    if (t == NULL) {
+        x11_snapshot_unref(cb, snap);
+        return false;
+    }
+
+    /* Any stale transfer into the same property is superseded */
+    for (incr_send_c **it = &cb->incr_sends; *it != NULL;) {
+        if ((*it)->requestor == requestor && (*it)->property == property) {
+            incr_send_c *stale = *it;
+            *it = stale->next;
+            x11_snapshot_unref(cb, stale->snap);
+            cb->free(stale);
+        } else {
+            it = &(*it)->next;
+        }
+    }
+
+    t->requestor = requestor;
+    t->property = property;
+    t->snap = snap;
+    t->offset = 0;
+    t->next = cb->incr_sends;
+    cb->incr_sends = t;
+
+    /* We must see the requestor delete each chunk before we send the next */
+    /* (Our own windows, sharing the connection, already report property changes) */
+    uint32_t event_mask = XCB_EVENT_MASK_PROPERTY_CHANGE;
+    uint32_t size = snap->length > UINT32_MAX ? UINT32_MAX : (uint32_t)snap->length;
+    if (x11_find_context(cb->display, requestor) == NULL) {
+        xcb_change_window_attributes(cb->xc, requestor, XCB_CW_EVENT_MASK, &event_mask);
+    }
+    xcb_change_property(cb->xc, XCB_PROP_MODE_REPLACE, requestor,
+                        property, cb->std_atoms[X_ATOM_INCR].atom, 32, 1, &size);
+    return true;
+}
+
+/**
+ *  \brief Sends the next chunk of an INCR transfer on PropertyNotify
+ *
+ *  \param [in] cb The clipboard context.
+ *  \param [in] e The property notify event from the requestor's window.
+ *
+ *  The requestor deleting the property signals that it is ready for the
+ *  next chunk. A zero-length chunk completes the transfer. The transfer
+ *  holds a snapshot of the data, so it completes consistently even if
+ *  our data is replaced (or our ownership lost) meanwhile.
+ */
+static void x11_incr_send(clipboard_c *cb, xcb_property_notify_event_t *e) {
+    incr_send_c **prev = &cb->incr_sends, *t;
+
+    if (e->state != XCB_PROPERTY_DELETE) {
+        return;
+    }
+
+    for (t = cb->incr_sends; t != NULL; prev = &t->next, t = t->next) {
+        if (t->requestor == e->window && t->property == e->atom) {
+            break;
+        }
+    }
+    if (t == NULL) {
+        return;
+    }
+
+    size_t n;
+    if (t->snap->reader.fn != NULL) {
+        /* Each chunk is pulled only once the requestor is ready for it */
+        unsigned char *chunk = cb->malloc(cb->incr_threshold);
+        if (chunk == NULL) {
+            /* The transfer ends short */
+            fprintf(stderr, "x11_incr_send: [Err] malloc failed\n");
+        }
+        n = chunk != NULL ? x11_reader_fill(&t->snap->reader, t->offset, chunk, cb->incr_threshold) : 0;
+        xcb_change_property(cb->xc, XCB_PROP_MODE_REPLACE, t->requestor, t->property,
+                            t->snap->type, 8, n, chunk);
+        cb->free(chunk);
+    } else if (!x11_snapshot_intact(t->snap)) {
+        /* The mapped file was truncated mid-transfer, which ends short */
+        fprintf(stderr, "x11_incr_send: [Warn] File truncated while being sent\n");
+        n = 0;
+    } else {
+        n = t->snap->length - t->offset;
+        if (n > cb->incr_threshold) {
+            n = cb->incr_threshold;
+        }
+        xcb_change_property(cb->xc, XCB_PROP_MODE_REPLACE, t->requestor, t->property,
+                            t->snap->type, 8, n, t->snap->data + t->offset);
+    }
+    t->offset += n;
+
+    if (n == 0) {
+        *prev = t->next;
+        /* Other contexts may also be sending to the requestor */
+        if (x11_find_sender(cb->display, t->requestor, XCB_NONE) == NULL &&
+                x11_find_context(cb->display, t->requestor) == NULL) {
+            uint32_t event_mask = XCB_EVENT_MASK_NO_EVENT;
+            xcb_change_window_attributes(cb->xc, t->requestor, XCB_CW_EVENT_MASK, &event_mask);
+        }
+        x11_snapshot_unref(cb, t->snap);
+        cb->free(t);
+    }
+    xcb_flush(cb->xc);
+}
+
+/**
+ *  \brief Converts the selection to one target, writing it to the requestor.
+ *
+ *  \param [in] cb The clipboard context.
+ *  \param [in] sel The selection context. sel->mu must not be held.
+ *  \param [in] snap Our data for the selection, or NULL if we hold none.
+ *  \param [in] requestor The requestor window.
+ *  \param [in] target The target to convert to.
+ *  \param [in] property The property on the requestor window to write to.
+ *  \return true iff the data was sent (requestor's property was changed)
+ *
+ *  Data larger than cb->incr_threshold is sent using INCR. The only data
+ *  target offered is the type of the data we hold (UTF8_STRING for text).
+ *  Not ICCCM compliant because we're not supplying a proper TIMESTAMP value.
+ */
+static bool x11_transmit_target(clipboard_c *cb, selection_c *sel, snapshot_c *snap, xcb_window_t requestor, xcb_atom_t target, xcb_atom_t property) {
+    if (target == cb->std_atoms[X_ATOM_TARGETS].atom) {
+        xcb_atom_t targets[] = {
+            cb->std_atoms[X_ATOM_TIMESTAMP].atom,
+            cb->std_atoms[X_ATOM_TARGETS].atom,
+            cb->std_atoms[X_ATOM_MULTIPLE].atom,
+            snap != NULL ? snap->type : XCB_NONE
+        };
+        xcb_change_property(cb->xc, XCB_PROP_MODE_REPLACE, requestor,
+                            property, XCB_ATOM_ATOM,
+                            sizeof(xcb_atom_t) * 8,
+                            sizeof(targets) / sizeof(xcb_atom_t) - (snap == NULL), targets);
+    } else if (target == cb->std_atoms[X_ATOM_TIMESTAMP].atom) {
+        xcb_timestamp_t cur = XCB_CURRENT_TIME;
+        xcb_change_property(cb->xc, XCB_PROP_MODE_REPLACE, requestor,
+                            property, XCB_ATOM_INTEGER, sizeof(cur) * 8,
+                            1, &cur);
+    } else if (snap != NULL && target == snap->type && snap->reader.fn != NULL) {
+        /* Pulled a chunk at a time, so that it is never held whole */
+        if (snap->reader.length > cb->incr_threshold) {
+            return x11_incr_send_start(cb, x11_snapshot_ref(snap), requestor, property);
+        }
+
+        unsigned char *buf = cb->malloc(snap->reader.length);
+        size_t n = buf != NULL ? x11_reader_fill(&snap->reader, 0, buf, snap->reader.length) : 0;
+        if (n > 0) {
+            xcb_change_property(cb->xc, XCB_PROP_MODE_REPLACE, requestor,
+                                property, target, 8, n, buf);
+        }
+        cb->free(buf);
+        return n > 0;
+    } else if (snap != NULL && target == snap->type) {
+        /* Lazily provided data is only generated now that someone wants it */
+        snapshot_c *data = x11_snapshot_provide(cb, sel, x11_snapshot_ref(snap));
+        if (data == NULL) {
+            return false;
+        }
+
+        /* Sent from the snapshot, so that setting new data need not wait for us */
+        if (data->length > cb->incr_threshold) {
+            return x11_incr_send_start(cb, data, requestor, property);
+        }
+
+        xcb_change_property(cb->xc, XCB_PROP_MODE_REPLACE, requestor,
+                            property, target, 8, data->length, data->data);
+        x11_snapshot_unref(cb, data);
+    } else {
+        /* Unknown target */
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ *  \brief Converts the selection to each target of a MULTIPLE request.
+ *
+ *  \param [in] cb The clipboard context.
+ *  \param [in] sel The selection context. sel->mu must not be held.
+ *  \param [in] snap Our data for the selection, or NULL if we hold none.
+ *  \param [in] e The selection request event.
+ *  \return true iff the pair list could be read.
+ *
+ *  The requestor's property holds a list of (target, property) atom pairs.
+ *  Targets that could not be converted have their property replaced with
+ *  None in the list, which is then written back.
+ */
+static bool x11_transmit_multiple(clipboard_c *cb, selection_c *sel, snapshot_c *snap, xcb_selection_request_event_t *e) {
+    xcb_atom_t atom_pair = cb->std_atoms[X_ATOM_ATOM_PAIR].atom;
+    xcb_get_property_reply_t *reply;
+
+    /* MULTIPLE requests must name the property holding the pairs */
+    if (e->property == XCB_NONE) {
+        return false;
+    }
+
+    reply = xcb_get_property_reply(cb->xc, xcb_get_property(cb->xc, false, e->requestor,
+                                   e->property, atom_pair, 0, cb->transfer_size / 4), NULL);
+    if (reply == NULL || reply->type != atom_pair || reply->format != 32) {
+        free(reply); /* XCB: Do not use custom allocators */
+        return false;
+    }
+
+    xcb_atom_t *pairs = (xcb_atom_t *)xcb_get_property_value(reply);
+    int npairs = xcb_get_property_value_length(reply) / (int)(2 * sizeof(xcb_atom_t));
+    for (int i = 0; i < npairs; i++) {
+        xcb_atom_t target = pairs[2 * i], property = pairs[2 * i + 1];
+        /* Nested MULTIPLE requests are not supported */
+        if (property == XCB_NONE || target == cb->std_atoms[X_ATOM_MULTIPLE].atom ||
+                !x11_transmit_target(cb, sel, snap, e->requestor, target, property)) {
+            pairs[2 * i + 1] = XCB_NONE;
+        }
+    }
+
+    xcb_change_property(cb->xc, XCB_PROP_MODE_REPLACE, e->requestor, e->property,
+                        atom_pair, 32, npairs * 2, pairs);
+    free(reply); /* XCB: Do not use custom allocators */
+    return true;
+}
+
+/**
+ *  \brief Sends the selection data to the requestor on SelectionRequest
+ *
+ *  \param [in] cb The clipboard context.
+ *  \param [in] e The selection request event.
+ *  \return true iff the data was sent (requestor's property was changed)
+ */
+static bool x11_transmit_selection(clipboard_c *cb, xcb_selection_request_event_t *e) {
+    selection_c *sel = x11_find_selection(cb, e->selection);
+    snapshot_c *snap = NULL;
+    bool ret;
+
+    if (sel == NULL) {
+        return false;
+    }
+
+    /* Default location to store data if none specified */
+    if (e->property == XCB_NONE && e->target != cb->std_atoms[X_ATOM_MULTIPLE].atom) {
+        e->property = e->target;
+    }
+
+    if (pthread_mutex_lock(&sel->mu) == 0) {
+        if (sel->has_ownership) {
+            snap = x11_snapshot_get(sel, sel->target);
+        }
+        pthread_mutex_unlock(&sel->mu);
+    }
+
+    if (e->target == cb->std_atoms[X_ATOM_MULTIPLE].atom) {
+        ret = x11_transmit_multiple(cb, sel, snap, e);
+    } else {
+        ret = x11_transmit_target(cb, sel, snap, e->requestor, e->target, e->property);
+    }
+    x11_snapshot_unref(cb, snap);
+    return ret;
+}
+
+#ifdef LIBCLIPBOARD_USE_XFIXES
+/**
+ *  \brief Starts converting the selection in the background, to be cached.
+ *
+ *  \param [in] cb The clipboard context.
+ *  \param [in] sel The selection context, not owned by us. sel->mu must be held.
+ *
+ *  The conversion is given up if the data is larger than cb->prefetch_size,
+ *  unless a reader starts waiting for it in the meantime.
+ */
+static void x11_prefetch(clipboard_c *cb, selection_c *sel) {
+    if (cb->prefetch_size == 0 || sel->converting || !x11_start_watchdog(cb)) {
+        return;
+    }
+
+    /* A read without a callback, so that the watchdog times out the conversion */
+    async_c *a = cb->malloc(sizeof(async_c));
+    if (a == NULL) {
+        return;
+    }
+    memset(a, 0, sizeof(async_c));
+    x11_get_deadline(cb, &a->deadline);
+    a->next = sel->async;
+    sel->async = a;
+
+    x11_convert_selection(cb, sel, cb->std_atoms[X_ATOM_UTF8_STRING].atom);
+    sel->prefetching = true;
+    x11_wake_watchdog(cb);
+}
+
+/**
+ *  \brief Negotiates the XFixes extension for the display, if available.
+ *
+ *  \param [in] d The display, before the event loop is started.
+ *
+ *  Without XFixes, d->xfixes_event_base remains 0, disabling the cache of
+ *  foreign selections and clipboard_subscribe.
+ */
+static void x11_init_xfixes(x11_display_c *d) {
+    const xcb_query_extension_reply_t *ext = xcb_get_extension_data(d->xc, &xcb_xfixes_id);
+    if (ext == NULL || !ext->present) {
+        return;
+    }
+
+    /* The version must be negotiated before the extension is used */
+    xcb_xfixes_query_version_reply_t *version = xcb_xfixes_query_version_reply(d->xc,
+            xcb_xfixes_query_version(d->xc, XCB_XFIXES_MAJOR_VERSION, XCB_XFIXES_MINOR_VERSION), NULL);
+    /* SelectSelectionInput was introduced in version 1 */
+    bool supported = version != NULL && version->major_version >= 1;
+    free(version); /* XCB: Do not use custom allocators */
+    if (supported) {
+        d->xfixes_event_base = ext->first_event;
+    }
+}
+
+/**
+ *  \brief Starts tracking selection owner changes on the context's window.
+ *
+ *  \param [in] cb The clipboard context.
+ */
+static void x11_select_owner_changes(clipboard_c *cb) {
+    uint32_t mask = XCB_XFIXES_SELECTION_EVENT_MASK_SET_SELECTION_OWNER |
+                    XCB_XFIXES_SELECTION_EVENT_MASK_SELECTION_WINDOW_DESTROY |
+                    XCB_XFIXES_SELECTION_EVENT_MASK_SELECTION_CLIENT_CLOSE;
+
+    if (cb->display->xfixes_event_base == 0) {
+        return;
+    }
+    for (int i = 0; i < LCB_MODE_END; i++) {
+        xcb_xfixes_select_selection_input(cb->xc, cb->xw, cb->selections[i].xmode, mask);
+    }
+    cb->xfixes_event_base = cb->display->xfixes_event_base;
+}
+
+/**
+ *  \brief Invalidates the cache and notifies any subscriber on XFixesSelectionNotify
+ *
+ *  \param [in] cb The clipboard context.
+ *  \param [in] evt The selection notify event.
+ */
+static void x11_owner_changed(clipboard_c *cb, xcb_xfixes_selection_notify_event_t *evt) {
+    selection_c *sel = x11_find_selection(cb, evt->selection);
+    clipboard_owner_fn fn = NULL;
+    void *user = NULL;
+
+    if (sel == NULL) {
+        return;
+    }
+
+    if (pthread_mutex_lock(&sel->mu) == 0) {
+        sel->owner = evt->owner;
+        sel->owner_time = evt->selection_timestamp;
+        if (sel->converting) {
+            /* Still delivered to those waiting, but not cached */
+            sel->convert_stale = true;
+        } else if (!sel->has_ownership) {
+            /* Stale now; no need to keep it around */
+            x11_release_data(cb, sel);
+            cb->free(sel->targets);
+            sel->targets = NULL;
+            if (evt->owner != XCB_NONE && evt->owner != cb->xw) {
+                x11_prefetch(cb, sel);
+            }
+        }
+        pthread_mutex_unlock(&sel->mu);
+    }
+
+    if (pthread_mutex_lock(&cb->mu) == 0) {
+        fn = cb->owner_fn;
+        user = cb->owner_user;
+        pthread_mutex_unlock(&cb->mu);
+    }
+
+    if (fn != NULL) {
+        fn((clipboard_mode)(sel - cb->selections), evt->owner, evt->selection_timestamp, user);
+    }
+}
+#endif /* LIBCLIPBOARD_USE_XFIXES */
+
+/**
+ *  \brief Notes that the context's window is destroyed, so no more events will arrive.
+ *
+ *  \param [in] cb The clipboard context, which may be freed once this returns.
+ */
+static void x11_window_destroyed(clipboard_c *cb) {
+    pthread_mutex_lock(&cb->mu);
+    cb->destroyed = true;
+    pthread_cond_broadcast(&cb->cond);
+    pthread_mutex_unlock(&cb->mu);
+}
+
+/**
+ *  \brief Dispatches an event to the context whose window it concerns.
+ *
+ *  \param [in] d The display.
+ *  \param [in] e The event.
+ *  \return true iff the event concerned one of our contexts.
+ */
+static bool x11_dispatch_event(x11_display_c *d, xcb_generic_event_t *e) {
+    clipboard_c *cb = NULL;
+
+    switch (e->response_type & ~0x80) {
+        case XCB_DESTROY_NOTIFY: {
+            xcb_destroy_notify_event_t *evt = (xcb_destroy_notify_event_t *)e;
+            pthread_mutex_lock(&d->mu);
+            for (clipboard_c **it = &d->contexts; *it != NULL; it = &(*it)->next_context) {
+                if ((*it)->xw == evt->window) {
+                    cb = *it;
+                    *it = cb->next_context;
+                    break;
+                }
+            }
+            pthread_mutex_unlock(&d->mu);
+            if (cb != NULL) {
+                x11_window_destroyed(cb);
+            }
+        }
+        break;
+        case XCB_SELECTION_CLEAR: {
+            xcb_selection_clear_event_t *evt = (xcb_selection_clear_event_t *)e;
+            if ((cb = x11_find_context(d, evt->owner)) != NULL) {
+                x11_clear_selection(cb, evt);
+            }
+        }
+        break;
+        case XCB_SELECTION_NOTIFY: {
+            xcb_selection_notify_event_t *evt = (xcb_selection_notify_event_t *)e;
+            if ((cb = x11_find_context(d, evt->requestor)) != NULL) {
+                x11_retrieve_selection(cb, evt);
+            }
+        }
+        break;
+        case XCB_SELECTION_REQUEST: {
+            xcb_selection_request_event_t *req = (xcb_selection_request_event_t *)e;
+            xcb_selection_notify_event_t notify = {0};
+            if ((cb = x11_find_context(d, req->owner)) == NULL) {
+                break;
+            }
+            notify.response_type = XCB_SELECTION_NOTIFY;
+            notify.time = XCB_CURRENT_TIME;
+            notify.requestor = req->requestor;
+            notify.selection = req->selection;
+            notify.target = req->target;
+            notify.property = x11_transmit_selection(cb, req) ? req->property : XCB_NONE;
+            xcb_send_event(cb->xc, false, req->requestor, XCB_EVENT_MASK_PROPERTY_CHANGE, (char *)&notify);
+            xcb_flush(cb->xc);
+        }
+        break;
+        case XCB_PROPERTY_NOTIFY: {
+            xcb_property_notify_event_t *evt = (xcb_property_notify_event_t *)e;
+            /* The requestor of a transfer may be another of our windows */
+            if (evt->state == XCB_PROPERTY_DELETE) {
+                if ((cb = x11_find_sender(d, evt->window, evt->atom)) != NULL) {
+                    x11_incr_send(cb, evt);
+                }
+            } else if ((cb = x11_find_context(d, evt->window)) != NULL) {
+                x11_incr_receive(cb, evt);
+            }
+        }
+        break;
+        default: {
+#ifdef LIBCLIPBOARD_USE_XFIXES
+            /* Extension events have no fixed code */
+            if (d->xfixes_event_base != 0 &&
+                    (e->response_type & ~0x80) == d->xfixes_event_base + XCB_XFIXES_SELECTION_NOTIFY) {
+                xcb_xfixes_selection_notify_event_t *evt = (xcb_xfixes_selection_notify_event_t *)e;
+                if ((cb = x11_find_context(d, evt->window)) != NULL) {
+                    x11_owner_changed(cb, evt);
+                }
+            }
+#endif
+            /* Ignore unknown messages */
+        }
+    }
+    return cb != NULL;
+}
+
+/**
+ *  \brief The main event loop to process window messages.
+ *
+ *  \param [in] arg The display.
+ *
+ *  This thread will run indefinitely until the display's window is
+ *  destroyed. It *must* receive a DestroyNotify message to end.
+ */
+static void *x11_event_loop(void *arg) {
+    x11_display_c *d = (x11_display_c *)arg;
+    xcb_generic_event_t *e;
+
+    while ((e = xcb_wait_for_event(d->xc))) {
+        if (e->response_type == 0) {
+            /* I think this cast is appropriate... */
+            xcb_generic_error_t *err = (xcb_generic_error_t *) e;
+            fprintf(stderr, "x11_event_loop: [Warn] Received X11 error: %d\n", err->error_code);
+            free(e); /* XCB: Do not use custom allocators */
+            continue;
+        }
+
+        if ((e->response_type & ~0x80) == XCB_DESTROY_NOTIFY &&
+                ((xcb_destroy_notify_event_t *)e)->window == d->xw) {
+            free(e); /* XCB: Do not use custom allocators */
+            return NULL;
+        }
+        x11_dispatch_event(d, e);
+        free(e); /* XCB: Do not use custom allocators */
+    }
+
+    fprintf(stderr, "x11_event_loop: [Warn] xcb_wait_for_event returned NULL\n");
+    /* Don't leave contexts waiting on their DestroyNotify in clipboard_free */
+    pthread_mutex_lock(&d->mu);
+    d->dead = true;
+    while (d->contexts != NULL) {
+        clipboard_c *cb = d->contexts;
+        d->contexts = cb->next_context;
+        x11_window_destroyed(cb);
+    }
+    pthread_mutex_unlock(&d->mu);
+    return NULL;
+}
+
+/**
+ *  \brief Closes the display, once no context is using it.
+ *
+ *  \param [in] d The display, which may be partially initialised.
+ */
+static void x11_display_free(x11_display_c *d) {
+    if (d->watchdog_initted) {
+        pthread_mutex_lock(&d->mu);
+        d->watchdog_quit = true;
+        pthread_cond_broadcast(&d->watchdog_cond);
+        pthread_mutex_unlock(&d->mu);
+        pthread_join(d->watchdog, NULL);
+    }
+
+    if (d->event_loop_initted) {
+        /* This should send a DestroyNotify message as the termination condition */
+        xcb_destroy_window(d->xc, d->xw);
+        xcb_flush(d->xc);
+        pthread_join(d->event_loop, NULL);
+    }
+
+    if (d->xc != NULL && !d->foreign) {
+        xcb_disconnect(d->xc);
+    }
+    if (d->watchdog_cond_initted) {
+        pthread_cond_destroy(&d->watchdog_cond);
+    }
+    if (d->mu_initted) {
+        pthread_mutex_destroy(&d->mu);
+    }
+    free(d->name);
+    free(d);
+}
+
+/**
+ *  \brief Opens a display and starts its event loop.
+ *
+ *  \param [in] name The display name (NULL for the default).
+ *  \return The display, or NULL on error.
+ */
+static x11_display_c *x11_display_new(const char *name) {
+    x11_display_c *d = calloc(1, sizeof(x11_display_c));
+    if (d == NULL) {
+        return NULL;
+    }
+
+    if (name != NULL) {
+        d->name = malloc(strlen(name) + 1);
+        if (d->name == NULL) {
+            x11_display_free(d);
+            return NULL;
+        }
+        strcpy(d->name, name);
+    }
+
+    d->mu_initted = pthread_mutex_init(&d->mu, NULL) == 0;
+    if (!d->mu_initted) {
+        x11_display_free(d);
+        return NULL;
+    }
+
+    d->watchdog_cond_initted = x11_cond_init(&d->watchdog_cond);
+    if (!d->watchdog_cond_initted) {
+        x11_display_free(d);
+        return NULL;
+    }
+
+    int preferred_screen;
+    d->xc = xcb_connect(name, &preferred_screen);
+    assert(d->xc != NULL); /* Docs say return is never NULL */
+    if (xcb_connection_has_error(d->xc) != 0) {
+        x11_display_free(d);
+        return NULL;
+    }
+    d->xs = x11_get_screen(d->xc, preferred_screen);
+    assert(d->xs != NULL);
+
+    if (!x11_intern_atoms(d->xc, d->std_atoms, g_std_atom_names, X_ATOM_END, false)) {
+        x11_display_free(d);
+        return NULL;
+    }
+
+#ifdef LIBCLIPBOARD_USE_XFIXES
+    x11_init_xfixes(d);
+#endif
+
+    /* Structure notify mask to get the DestroyNotify that ends the event loop */
+    uint32_t event_mask = XCB_EVENT_MASK_STRUCTURE_NOTIFY;
+    d->xw = xcb_generate_id(d->xc);
+    xcb_create_window(d->xc, XCB_COPY_FROM_PARENT, d->xw, d->xs->root,
+                      0, 0, 1, 1, 0, XCB_WINDOW_CLASS_INPUT_ONLY,
+                      d->xs->root_visual, XCB_CW_EVENT_MASK, &event_mask);
+
+    d->event_loop_initted = pthread_create(&d->event_loop, NULL,
+                                           x11_event_loop, (void *)d) == 0;
+    if (!d->event_loop_initted) {
+        x11_display_free(d);
+        return NULL;
+    }
+
+    return d;
+}
+
+/**
+ *  \brief Prepares a connection owned by the host for use by contexts.
+ *
+ *  \param [in] xc The host's connection.
+ *  \param [in] xs The screen to create windows on.
+ *  \return The display, or NULL on error.
+ *
+ *  No event loop is started; the host feeds events via clipboard_handle_event.
+ */
+static x11_display_c *x11_display_new_foreign(xcb_connection_t *xc, xcb_screen_t *xs) {
+    x11_display_c *d = calloc(1, sizeof(x11_display_c));
+    if (d == NULL) {
+        return NULL;
+    }
+
+    d->foreign = true;
+    d->xc = xc;
+    d->xs = xs;
+    d->mu_initted = pthread_mutex_init(&d->mu, NULL) == 0;
+    if (!d->mu_initted) {
+        x11_display_free(d);
+        return NULL;
+    }
+
+    d->watchdog_cond_initted = x11_cond_init(&d->watchdog_cond);
+    if (!d->watchdog_cond_initted) {
+        x11_display_free(d);
+        return NULL;
+    }
+
+    if (!x11_intern_atoms(d->xc, d->std_atoms, g_std_atom_names, X_ATOM_END, false)) {
+        x11_display_free(d);
+        return NULL;
+    }
+
+#ifdef LIBCLIPBOARD_USE_XFIXES
+    x11_init_xfixes(d);
+#endif
+
+    return d;
+}
+
+/**
+ *  \brief Finds a display already in use.
+ *
+ *  \param [in] name The display name (NULL for the default), if xc is NULL.
+ *  \param [in] xc The host's connection, or NULL for a display we connected to.
+ *  \param [in] xs The screen on xc.
+ *  \return The display, or NULL if not in use. g_displays_mu must be held.
+ */
+static x11_display_c *x11_find_display(const char *name, xcb_connection_t *xc, xcb_screen_t *xs) {
+    for (x11_display_c *d = g_displays; d != NULL; d = d->next) {
+        if (xc != NULL) {
+            if (d->foreign && d->xc == xc && d->xs == xs) {
+                return d;
+            }
+            continue;
+        }
+
+        bool same_name = (name == NULL || d->name == NULL) ? name == d->name : strcmp(name, d->name) == 0;
+        /* A broken connection is not reused */
+        if (!d->foreign && same_name && xcb_connection_has_error(d->xc) == 0) {
+            return d;
+        }
+    }
+    return NULL;
+}
+
+/**
+ *  \brief Gets a reference to the display, opening it if not yet in use.
+ *
+ *  \param [in] name The display name (NULL for the default), if xc is NULL.
+ *  \param [in] xc The host's connection, or NULL to connect to name.
+ *  \param [in] screen The screen number to create windows on, if xc is given.
+ *  \return The display, or NULL on error. Release with x11_display_release.
+ */
+static x11_display_c *x11_display_acquire(const char *name, xcb_connection_t *xc, int screen) {
+    xcb_screen_t *xs = NULL;
+    x11_display_c *d, *created = NULL;
+
+    if (xc != NULL && (xs = x11_get_screen(xc, screen)) == NULL) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&g_displays_mu);
+    d = x11_find_display(name, xc, xs);
+    if (d == NULL) {
+        /* Setting up takes round trips, which must not hold up other contexts */
+        pthread_mutex_unlock(&g_displays_mu);
+        created = xc != NULL ? x11_display_new_foreign(xc, xs) : x11_display_new(name);
+        pthread_mutex_lock(&g_displays_mu);
+
+        /* Another context may have set it up meanwhile */
+        d = x11_find_display(name, xc, xs);
+        if (d == NULL && created != NULL) {
+            d = created;
+            created = NULL;
+            d->next = g_displays;
+            g_displays = d;
+        }
+    }
+    if (d != NULL) {
+        d->refs++;
+    }
+    pthread_mutex_unlock(&g_displays_mu);
+
+    if (created != NULL) {
+        x11_display_free(created);
+    }
+    return d;
+}
+
+/**
+ *  \brief Releases a reference to the display, closing it if it was the last.
+ *
+ *  \param [in] d The display.
+ */
+static void x11_display_release(x11_display_c *d) {
+    bool last;
+
+    pthread_mutex_lock(&g_displays_mu);
+    last = --d->refs == 0;
+    if (last) {
+        for (x11_display_c **it = &g_displays; *it != NULL; it = &(*it)->next) {
+            if (*it == d) {
+                *it = d->next;
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&g_displays_mu);
+
+    if (last) {
+        x11_display_free(d);
+    }
+}
+
+/**
+ *  \brief Removes the context from its display's list, if present.
+ *
+ *  \param [in] cb The clipboard context.
+ */
+static void x11_unlink_context(clipboard_c *cb) {
+    pthread_mutex_lock(&cb->display->mu);
+    for (clipboard_c **it = &cb->display->contexts; *it != NULL; it = &(*it)->next_context) {
+        if (*it == cb) {
+            *it = cb->next_context;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&cb->display->mu);
+}
+
+/**
+ *  \brief Instantiates a new clipboard context.
+ *
+ *  \param [in] cb_opts Implementation specific options (optional).
+ *  \param [in] xc The host's connection, or NULL to connect to cb_opts->x11.display_name.
+ *  \param [in] screen The screen number to use on xc.
+ *  \return The new clipboard context, or NULL on failure.
+ */
+static clipboard_c *x11_context_new(clipboard_opts *cb_opts, xcb_connection_t *xc, int screen) {
+    clipboard_opts defaults = {
+        .x11.display_name = NULL,
+        .x11.action_timeout = LCB_X11_ACTION_TIMEOUT_DEFAULT,
+        .x11.transfer_size = LCB_X11_TRANSFER_SIZE_DEFAULT,
+    };
+
+    if (cb_opts == NULL) {
+        cb_opts = &defaults;
+    }
+
+    clipboard_calloc_fn calloc_fn = cb_opts->user_calloc_fn ? cb_opts->user_calloc_fn : calloc;
+    clipboard_c *cb = calloc_fn(1, sizeof(clipboard_c));
+    if (cb == NULL) {
+        return NULL;
+    }
+    LCB_SET_ALLOCATORS(cb, cb_opts);
+
+    cb->action_timeout = cb_opts->x11.action_timeout > 0 ?
+                         cb_opts->x11.action_timeout : LCB_X11_ACTION_TIMEOUT_DEFAULT;
+    /* Round down to nearest multiple of 4 */
+    cb->transfer_size = (cb_opts->x11.transfer_size / 4) * 4;
+    if (cb->transfer_size == 0) {
+        cb->transfer_size = LCB_X11_TRANSFER_SIZE_DEFAULT;
+    }
+    if (cb_opts->x11.prefetch) {
+        cb->prefetch_size = cb_opts->x11.prefetch_size > 0 ?
+                            cb_opts->x11.prefetch_size : LCB_X11_PREFETCH_SIZE_DEFAULT;
+    }
+
+    cb->mu_initted = pthread_mutex_init(&cb->mu, NULL) == 0;
+    if (!cb->mu_initted) {
+        clipboard_free(cb);
+        return NULL;
+    }
+
+    cb->cond_initted = x11_cond_init(&cb->cond);
+    if (!cb->cond_initted) {
+        clipboard_free(cb);
+        return NULL;
+    }
+
+    for (int i = 0; i < LCB_MODE_END; i++) {
+        selection_c *sel = &cb->selections[i];
+        sel->mu_initted = pthread_mutex_init(&sel->mu, NULL) == 0;
+        sel->cond_initted = sel->mu_initted && x11_cond_init(&sel->cond);
+        if (!sel->cond_initted) {
+            clipboard_free(cb);
+            return NULL;
+        }
+    }
+
+    cb->display = x11_display_acquire(cb_opts->x11.display_name, xc, screen);
+    if (cb->display == NULL) {
+        clipboard_free(cb);
+        return NULL;
+    }
+    cb->xc = cb->display->xc;
+    cb->xs = cb->display->xs;
+    memcpy(cb->std_atoms, cb->display->std_atoms, sizeof(cb->std_atoms));
+
+    /* Leave room for the ChangeProperty header (plus the BIG-REQUESTS length) */
+    size_t max_request = (size_t)xcb_get_maximum_request_length(cb->xc) * 4;
+    cb->incr_threshold = cb->transfer_size;
+    if (max_request > 32 && max_request - 32 < cb->incr_threshold) {
+        cb->incr_threshold = ((max_request - 32) / 4) * 4;
+    }
+
+    cb->selections[LCB_CLIPBOARD].xmode = cb->std_atoms[X_ATOM_CLIPBOARD].atom;
+    cb->selections[LCB_PRIMARY].xmode   = XCB_ATOM_PRIMARY;
+    cb->selections[LCB_SECONDARY].xmode = XCB_ATOM_SECONDARY;
+
+    /* Structure notify mask to get DestroyNotify messages */
+    /* Property change mask for PropertyChange messages */
+    uint32_t event_mask = XCB_EVENT_MASK_STRUCTURE_NOTIFY | XCB_EVENT_MASK_PROPERTY_CHANGE;
+    cb->xw = xcb_generate_id(cb->xc);
+    /* Listed first, so that no event for the window goes undispatched */
+    pthread_mutex_lock(&cb->display->mu);
+    cb->next_context = cb->display->contexts;
+    cb->display->contexts = cb;
+    pthread_mutex_unlock(&cb->display->mu);
+
+    xcb_generic_error_t *err = xcb_request_check(cb->xc,
+                               xcb_create_window_checked(cb->xc,
+                                       XCB_COPY_FROM_PARENT, cb->xw, cb->xs->root,
+                                       0, 0, 10, 10, 0,  XCB_WINDOW_CLASS_INPUT_OUTPUT,
+                                       cb->xs->root_visual,
+                                       XCB_CW_EVENT_MASK, &event_mask));
+    if (err != NULL) {
+        /* Am I meant to free this? */
+        free(err); /* XCB: Do not use custom allocators */
+        x11_unlink_context(cb);
+        cb->xw = 0;
+        clipboard_free(cb);
+        return NULL;
+    }
+
+#ifdef LIBCLIPBOARD_USE_XFIXES
+    x11_select_owner_changes(cb);
+#endif
+    xcb_flush(cb->xc);
+
+    return cb;
+}
+
+LCB_API clipboard_c *LCB_CC clipboard_new(clipboard_opts *cb_opts) {
+    return x11_context_new(cb_opts, NULL, 0);
+}
+
+LCB_API clipboard_c *LCB_CC clipboard_new_with_connection(struct xcb_connection_t *xc, int screen, clipboard_opts *cb_opts) {
+    if (xc == NULL || xcb_connection_has_error(xc) != 0) {
+        return NULL;
+    }
+    return x11_context_new(cb_opts, xc, screen);
+}
+
+LCB_API bool LCB_CC clipboard_handle_event(clipboard_c *cb, const void *event) {
+    xcb_generic_event_t *e = (xcb_generic_event_t *)event;
+
+    /* Errors are left to the host */
+    if (cb == NULL || e == NULL || !cb->display->foreign || e->response_type == 0) {
+        return false;
+    }
+    return x11_dispatch_event(cb->display, e);
+}
+
+LCB_API void LCB_CC clipboard_free(clipboard_c *cb) {
+    if (cb == NULL) {
+        return;
+    }
+
+    if (cb->display != NULL) {
+        x11_unwatch_context(cb);
+    }
+
+    if (cb->xw != 0) {
+        bool wait;
+        if (cb->display->foreign) {
+            /* The host may never feed us the DestroyNotify, so stop dispatching to us now */
+            x11_unlink_context(cb);
+            wait = false;
+        } else {
+            pthread_mutex_lock(&cb->display->mu);
+            wait = !cb->display->dead;
+            pthread_mutex_unlock(&cb->display->mu);
+        }
+
+        /* Once the event loop sees the DestroyNotify, it stops dispatching events to us */
+        xcb_destroy_window(cb->xc, cb->xw);
+        xcb_flush(cb->xc);
+        pthread_mutex_lock(&cb->mu);
+        while (wait && !cb->destroyed) {
+            pthread_cond_wait(&cb->cond, &cb->mu);
+        }
+        pthread_mutex_unlock(&cb->mu);
+    }
+
+    if (cb->display != NULL) {
+        x11_display_release(cb->display);
+    }
+
+    if (cb->cond_initted) {
+        pthread_cond_destroy(&cb->cond);
+    }
+    if (cb->mu_initted) {
+        pthread_mutex_destroy(&cb->mu);
+    }
+
+    while (cb->incr_sends != NULL) {
+        incr_send_c *next = cb->incr_sends->next;
+        x11_snapshot_unref(cb, cb->incr_sends->snap);
+        cb->free(cb->incr_sends);
+        cb->incr_sends = next;
+    }
+
+    /* Free selection data */
+    for (int i = 0; i < LCB_MODE_END; i++) {
+        /* No more replies will arrive, so fail any reads still pending */
+        while (cb->selections[i].async != NULL) {
+            async_c *a = cb->selections[i].async;
+            cb->selections[i].async = a->next;
+            if (a->fn != NULL) {
+                a->fn(NULL, 0, a->user);
+            }
+            cb->free(a);
+        }
+        x11_release_data(cb, &cb->selections[i]);
+        cb->free(cb->selections[i].incr.data);
+        cb->free(cb->selections[i].targets);
+
+        if (cb->selections[i].cond_initted) {
+            pthread_cond_destroy(&cb->selections[i].cond);
+        }
+        if (cb->selections[i].mu_initted) {
+            pthread_mutex_destroy(&cb->selections[i].mu);
+        }
+    }
+
+    cb->free(cb);
+}
+
+LCB_API void LCB_CC clipboard_clear(clipboard_c *cb, clipboard_mode mode) {
+    if (cb == NULL || cb->xc == NULL) {
+        return;
+    }
+
+    xcb_atom_t sel;
+
+    switch (mode) {
+        case LCB_CLIPBOARD:
+            sel = cb->std_atoms[X_ATOM_CLIPBOARD].atom;
+            break;
+        case LCB_PRIMARY:
+            sel = XCB_ATOM_PRIMARY;
+            break;
+        case LCB_SECONDARY:
+            sel = XCB_ATOM_SECONDARY;
+            break;
+        default:
+            return;
+    }
+
+    xcb_set_selection_owner(cb->xc, XCB_NONE, sel, XCB_CURRENT_TIME);
+    xcb_flush(cb->xc);
+}
+
+LCB_API bool LCB_CC clipboard_has_ownership(clipboard_c *cb, clipboard_mode mode) {
+    if (cb == NULL || !VALID_MODE(mode)) {
+        return false;
+    }
+
+    /* Lock-free; only ever written under the selection lock */
+    return __atomic_load_n(&cb->selections[mode].has_ownership, __ATOMIC_ACQUIRE);
+}
+
+LCB_API bool LCB_CC clipboard_subscribe(clipboard_c *cb, clipboard_owner_fn fn, void *user) {
+    bool ret = false;
+
+    if (cb && (pthread_mutex_lock(&cb->mu) == 0)) {
+        /* Owner changes are tracked regardless; see x11_init_xfixes */
+        ret = cb->xfixes_event_base != 0;
+        if (ret) {
+            cb->owner_fn = fn;
+            cb->owner_user = user;
+        }
+        pthread_mutex_unlock(&cb->mu);
+    }
+    return ret;
+}
+
+LCB_API void LCB_CC clipboard_cache_stats(clipboard_c *cb, unsigned long *hits, unsigned long *misses) {
+    unsigned long h = 0, m = 0;
+
+    for (int i = 0; cb != NULL && i < LCB_MODE_END; i++) {
+        selection_c *sel = &cb->selections[i];
+        if (pthread_mutex_lock(&sel->mu) == 0) {
+            h += sel->cache_hits;
+            m += sel->cache_misses;
+            pthread_mutex_unlock(&sel->mu);
+        }
+    }
+    if (hits != NULL) {
+        *hits = h;
+    }
+    if (misses != NULL) {
+        *misses = m;
+    }
+}
+
+/**
+ *  \brief Copies the selection data into a newly allocated buffer
+ *
+ *  \param [in] cb The clipboard context
+ *  \param [in] snap The selection data
+ *  \param [out] ret The return location
+ *  \param [out] length The length of the returned data (optional)
+ */
+static void retrieve_text_selection(clipboard_c *cb, snapshot_c *snap, char **ret, size_t *length) {
+    *ret = cb->malloc(sizeof(char) * (snap->length + 1));
+    if (*ret != NULL) {
+        copy_text_snapshot(snap, *ret);
+
+        if (length != NULL) {
+            *length = snap->length;
+        }
+    }
+}
+
+/**
+ *  \brief Starts a blocking read.
+ *
+ *  \param [in] cb The clipboard context.
+ *  \param [out] call The bounds of the read.
+ *  \param [in] timeout The most time (ms) the read may take, or a negative
+ *                      value to only time out each reply after action_timeout.
+ */
+static void x11_call_begin(clipboard_c *cb, x11_call_c *call, int timeout) {
+    call->has_deadline = timeout >= 0;
+    if (call->has_deadline) {
+        x11_get_time(&call->deadline);
+        x11_add_time(&call->deadline, timeout);
+    }
+    call->cancels = __atomic_load_n(&cb->cancels, __ATOMIC_ACQUIRE);
+}
+
+/**
+ *  \brief Calculates when the next reply of a blocking read times out.
+ *
+ *  \param [in] cb The clipboard context.
+ *  \param [in] call The bounds of the read.
+ *  \param [out] timeout After action_timeout, but no later than the read's deadline.
+ */
+static void x11_call_deadline(clipboard_c *cb, const x11_call_c *call, struct timespec *timeout) {
+    x11_get_deadline(cb, timeout);
+    if (call->has_deadline && x11_time_before(&call->deadline, timeout)) {
+        *timeout = call->deadline;
+    }
+}
+
+/**
+ *  \brief Determines if clipboard_cancel was called during a blocking read.
+ *
+ *  \param [in] cb The clipboard context.
+ *  \param [in] call The bounds of the read.
+ *  \return true iff the read is cancelled.
+ */
+static bool x11_call_cancelled(clipboard_c *cb, const x11_call_c *call) {
+    return __atomic_load_n(&cb->cancels, __ATOMIC_ACQUIRE) != call->cancels;
+}
+
+/**
+ *  \brief Waits for a change to the selection, unless the read is cancelled.
+ *
+ *  \param [in] cb The clipboard context.
+ *  \param [in] sel The selection context. sel->mu must be held, and is
+ *                  released while waiting.
+ *  \param [in] call The bounds of the read.
+ *  \param [in] timeout When to stop waiting.
+ *  \return 0 if woken, ECANCELED if clipboard_cancel was called during the
+ *          read, or else the error from pthread_cond_timedwait.
+ */
+static int x11_call_wait(clipboard_c *cb, selection_c *sel, const x11_call_c *call, const struct timespec *timeout) {
+    int pret;
+
+    /* clipboard_cancel wakes us under sel->mu, so its count can't change unseen */
+    if (x11_call_cancelled(cb, call)) {
+        return ECANCELED;
+    }
+    pret = pthread_cond_timedwait(&sel->cond, &sel->mu, timeout);
+    return pret == 0 && x11_call_cancelled(cb, call) ? ECANCELED : pret;
+}
+
+/**
+ *  \brief Starts a conversion to the given type, or joins one in flight.
+ *
+ *  \param [in] cb The clipboard context.
+ *  \param [in] sel The selection context. sel->mu must be held.
+ *  \param [in] target The type to convert to.
+ *  \param [out] conversion The conversion joined, to pass to x11_await_conversion.
+ *  \return true iff joined; false if a conversion to another type, or one
+ *          that a stream reader keeps to itself, is in flight.
+ */
+static bool x11_join_conversion(clipboard_c *cb, selection_c *sel, xcb_atom_t target, unsigned long *conversion) {
+    if (sel->converting && (sel->target != target || sel->prefs != NULL || sel->stream.active)) {
+        return false;
+    }
+
+    /* Shares any conversion to the same type already in flight */
+    x11_convert_selection(cb, sel, target);
+    sel->prefetching = false;
+    *conversion = sel->conversions;
+    return true;
+}
+
+/**
+ *  \brief Waits for a conversion to end.
+ *
+ *  \param [in] cb The clipboard context.
+ *  \param [in] sel The selection context. sel->mu must be held, and is
+ *                  released while waiting.
+ *  \param [in] conversion The value of sel->conversions when the conversion started.
+ *  \param [in] call The bounds of the read.
+ *  \param [in,out] timeout The deadline, which is extended as INCR chunks arrive.
+ *  \return true iff the conversion ended in time.
+ */
+static bool x11_await_conversion(clipboard_c *cb, selection_c *sel, unsigned long conversion, const x11_call_c *call, struct timespec *timeout) {
+    unsigned long chunks = sel->incr.chunks;
+    int pret = 0;
+
+    while (pret == 0 && sel->conversions == conversion) {
+        pret = x11_call_wait(cb, sel, call, timeout);
+        if (pret != ECANCELED && sel->incr.chunks != chunks) {
+            /* INCR transfers time out per chunk, not per transfer */
+            chunks = sel->incr.chunks;
+            x11_call_deadline(cb, call, timeout);
+            pret = 0;
+        }
+    }
+    return sel->conversions != conversion;
+}
+
+/**
+ *  \brief Obtains the selection data, converting it if we don't own it
+ *         and the cache is not current
+ *
+ *  \param [in] cb The clipboard context
+ *  \param [in] sel The selection context. sel->mu must not be held.
+ *  \param [in] target The type of data wanted.
+ *  \param [in] call The bounds of the read.
+ *  \return A reference to the selection data, or NULL if there is none of
+ *          that type. The caller must release it with x11_snapshot_unref.
+ */
+static snapshot_c *x11_fetch_selection(clipboard_c *cb, selection_c *sel, xcb_atom_t target, const x11_call_c *call) {
+    snapshot_c *snap = NULL;
+    bool has_owner = true;
+
+    if (pthread_mutex_lock(&sel->mu) != 0) {
+        return NULL;
+    }
+
+    if (!sel->has_ownership && !sel->converting && !x11_cache_valid(cb, sel, target)) {
+        /* Not under the lock, so that the event loop can serve requests meanwhile */
+        pthread_mutex_unlock(&sel->mu);
+        xcb_get_selection_owner_reply_t *owner = xcb_get_selection_owner_reply(cb->xc,
+                xcb_get_selection_owner(cb->xc, sel->xmode), NULL);
+        has_owner = owner != NULL && owner->owner != XCB_NONE;
+        free(owner); /* XCB: Do not use custom allocators */
+        if (pthread_mutex_lock(&sel->mu) != 0) {
+            return NULL;
+        }
+    }
+
+    /* The selection may have changed hands while unlocked */
+    if (sel->has_ownership) {
+        /* Our own data is used as-is */
+        snap = x11_snapshot_get(sel, target);
+    } else if (x11_cache_valid(cb, sel, target)) {
+        sel->cache_hits++;
+        snap = x11_snapshot_get(sel, target);
+    } else if (!has_owner && !sel->converting) {
+        /* No selection owner; no data available */
+        sel->cache_misses++;
+    } else if (x11_call_cancelled(cb, call)) {
+        /* Not worth starting a conversion no one will wait for */
+        sel->cache_misses++;
+    } else {
+        /* Convert selection & wait for reply */
+        struct timespec timeout;
+        unsigned long conversion = 0;
+        bool joined = false;
+        int pret = 0;
+
+        sel->cache_misses++;
+        sel->waiters++;
+
+        x11_call_deadline(cb, call, &timeout);
+        /* A conversion to another type must end before ours can start */
+        while (pret == 0 && !(joined = x11_join_conversion(cb, sel, target, &conversion))) {
+            pret = x11_call_wait(cb, sel, call, &timeout);
+        }
+        if (joined && x11_await_conversion(cb, sel, conversion, call, &timeout)) {
+            snap = x11_snapshot_get(sel, target);
+        }
+
+        sel->waiters--;
+        x11_abandon_conversion(cb, sel);
+    }
+    pthread_mutex_unlock(&sel->mu);
+
+    /* Providers run without the lock, as they may take a while */
+    return snap != NULL ? x11_snapshot_provide(cb, sel, snap) : NULL;
+}
+
+LCB_API char LCB_CC *clipboard_text_ex(clipboard_c *cb, int *length, clipboard_mode mode) {
+    size_t len = 0;
+    char *ret = clipboard_text_ex2(cb, &len, mode);
+
+    if (ret != NULL && length != NULL) {
+        if (len > INT_MAX) {
+            /* Too long to report; see clipboard_text_ex2 */
+            cb->free(ret);
+            return NULL;
+        }
+        *length = (int)len;
+    }
+    return ret;
+}
+
+LCB_API char LCB_CC *clipboard_text_ex2(clipboard_c *cb, size_t *length, clipboard_mode mode) {
+    return clipboard_text_timed(cb, length, mode, -1);
+}
+
+LCB_API char LCB_CC *clipboard_text_timed(clipboard_c *cb, size_t *length, clipboard_mode mode, int timeout) {
+    char *ret = NULL;
+    x11_call_c call;
+
+    if (cb == NULL || !VALID_MODE(mode)) {
+        return NULL;
+    }
+
+    x11_call_begin(cb, &call, timeout);
+    snapshot_c *snap = x11_fetch_selection(cb, &cb->selections[mode], cb->std_atoms[X_ATOM_UTF8_STRING].atom, &call);
+    if (snap != NULL) {
+        retrieve_text_selection(cb, snap, &ret, length);
+        x11_snapshot_unref(cb, snap);
+    }
+
+    return ret;
+}
+
+LCB_API bool LCB_CC clipboard_text_into(clipboard_c *cb, char *buf, size_t cap, size_t *needed, clipboard_mode mode) {
+    bool ret = false;
+    x11_call_c call;
+
+    if (needed != NULL) {
+        *needed = 0;
+    }
+    if (cb == NULL || !VALID_MODE(mode)) {
+        return false;
+    }
+
+    x11_call_begin(cb, &call, -1);
+    snapshot_c *snap = x11_fetch_selection(cb, &cb->selections[mode], cb->std_atoms[X_ATOM_UTF8_STRING].atom, &call);
+    if (snap != NULL) {
+        if (needed != NULL) {
+            *needed = snap->length + 1;
+        }
+        if (buf != NULL && cap > snap->length) {
+            copy_text_snapshot(snap, buf);
+            ret = true;
+        }
+        x11_snapshot_unref(cb, snap);
+    }
+
+    return ret;
+}
+
+LCB_API bool LCB_CC clipboard_text_visit(clipboard_c *cb, clipboard_mode mode, clipboard_visit_fn fn, void *user) {
+    x11_call_c call;
+
+    if (cb == NULL || fn == NULL || !VALID_MODE(mode)) {
+        return false;
+    }
+
+    /* Our reference keeps the data alive even if the selection is cleared meanwhile */
+    x11_call_begin(cb, &call, -1);
+    snapshot_c *snap = x11_fetch_selection(cb, &cb->selections[mode], cb->std_atoms[X_ATOM_UTF8_STRING].atom, &call);
+    if (snap == NULL) {
+        return false;
+    }
+    fn((const char *)snap->data, snap->length, user);
+    x11_snapshot_unref(cb, snap);
+    return true;
+}
+
+LCB_API bool LCB_CC clipboard_text_async(clipboard_c *cb, clipboard_mode mode, clipboard_text_fn fn, void *user) {
+    if (cb == NULL || fn == NULL || !VALID_MODE(mode)) {
+        return false;
+    }
+
+    async_c *a = cb->malloc(sizeof(async_c));
+    if (a == NULL) {
+        return false;
+    }
+    a->fn = fn;
+    a->user = user;
+    a->text = NULL;
+    a->length = 0;
+    a->next = NULL;
+
+    selection_c *sel = &cb->selections[mode];
+    if (pthread_mutex_lock(&sel->mu) != 0) {
+        cb->free(a);
+        return false;
+    }
+
+    xcb_atom_t utf8 = cb->std_atoms[X_ATOM_UTF8_STRING].atom;
+    bool hit = !sel->has_ownership && x11_cache_valid(cb, sel, utf8);
+    if (sel->has_ownership || hit) {
+        /* Our own data (or a current copy) needs no round trip */
+        snapshot_c *snap = x11_snapshot_get(sel, utf8);
+        sel->cache_hits += hit;
+        pthread_mutex_unlock(&sel->mu);
+
+        if (snap != NULL && (snap = x11_snapshot_provide(cb, sel, snap)) != NULL) {
+            if ((a->text = cb->malloc(snap->length + 1)) != NULL) {
+                copy_text_snapshot(snap, a->text);
+                a->length = snap->length;
+            }
+            x11_snapshot_unref(cb, snap);
+        }
+        x11_async_dispatch(cb, a);
+        return true;
+    }
+
+    if (!x11_start_watchdog(cb)) {
+        pthread_mutex_unlock(&sel->mu);
+        cb->free(a);
+        return false;
+    }
+
+    sel->cache_misses++;
+    x11_get_deadline(cb, &a->deadline);
+    a->next = sel->async;
+    sel->async = a;
+    /* If converting to another type, text is asked for once that ends */
+    x11_convert_selection(cb, sel, utf8);
+    sel->prefetching = false;
+    pthread_mutex_unlock(&sel->mu);
+    x11_wake_watchdog(cb);
+    return true;
+}
+
+/**
+ *  \brief Takes ownership of the selection, publishing the given data.
+ *
+ *  \param [in] cb The clipboard context.
+ *  \param [in] sel The selection context. sel->mu must not be held.
+ *  \param [in] snap The data to publish, offered as its type. On success,
+ *                   the caller's reference passes to the selection.
+ *  \return true iff the selection was taken.
+ *
+ *  Requests still being served from the previous data keep it alive until
+ *  they finish.
+ */
+static bool x11_own_selection(clipboard_c *cb, selection_c *sel, snapshot_c *snap) {
+    snapshot_c *old;
+
+    if (pthread_mutex_lock(&sel->mu) != 0) {
+        return false;
+    }
+    old = sel->snap;
+    sel->snap = snap;
+    sel->cached = false;
+    sel->target = snap->type;
+    __atomic_store_n(&sel->has_ownership, true, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&sel->mu);
+
+    x11_snapshot_unref(cb, old);
+    xcb_set_selection_owner(cb->xc, cb->xw, sel->xmode, XCB_CURRENT_TIME);
+    xcb_flush(cb->xc);
+    return true;
+}
+
+/**
+ *  \brief Reads the selection property written for a stream reader,
+ *         passing it on chunk by chunk.
+ *
+ *  \param [in] cb The clipboard context.
+ *  \param [in] sel The selection context. sel->mu must not be held.
+ *  \param [in] conversion The value of sel->conversions when the conversion started.
+ *  \param [in] chunks The value of sel->stream.chunks once the owner replied.
+ *  \param [in] call The bounds of the read.
+ *  \param [in] fn Passed each chunk, as per clipboard_read_stream.
+ *  \param [in] user User data passed through to fn.
+ *  \return true iff all of the text was passed to fn.
+ *
+ *  If the owner sends the text using INCR, each chunk is read (and deleted,
+ *  which asks for the next one) only once the previous one has been passed
+ *  on, so the owner is held back by a slow fn rather than buffered for.
+ */
+static bool x11_stream_selection(clipboard_c *cb, selection_c *sel, unsigned long conversion, unsigned long chunks, const x11_call_c *call, clipboard_write_fn fn, void *user) {
+    xcb_atom_t utf8 = cb->std_atoms[X_ATOM_UTF8_STRING].atom;
+    xcb_get_property_reply_t *reply;
+    xcb_atom_t type;
+    size_t size;
+
+    /* A zero length read returns just the type and size */
+    reply = xcb_get_property_reply(cb->xc, xcb_get_property(cb->xc, false, cb->xw,
+                                   sel->xmode, XCB_ATOM_ANY, 0, 0), NULL);
+    if (reply == NULL || (reply->format % 8) != 0) {
+        free(reply); /* XCB: Do not use custom allocators */
+        return false;
+    }
+    type = reply->type;
+    size = reply->bytes_after;
+    free(reply); /* XCB: Do not use custom allocators */
+
+    if (type != cb->std_atoms[X_ATOM_INCR].atom) {
+        if (type != utf8 || size == 0) {
+            xcb_delete_property(cb->xc, cb->xw, sel->xmode);
+            xcb_flush(cb->xc);
+            return false;
+        }
+        return x11_stream_property(cb, sel->xmode, type, size, fn, user);
+    }
+
+    /* Deleting the property tells the owner to start sending chunks */
+    xcb_delete_property(cb->xc, cb->xw, sel->xmode);
+    xcb_flush(cb->xc);
+    for (;;) {
+        struct timespec timeout;
+        size_t offset = 0, bytes_after = 1;
+        bool arrived;
+        int pret = 0;
+
+        if (pthread_mutex_lock(&sel->mu) != 0) {
+            return false;
+        }
+        /* The owner must write each chunk within the timeout */
+        x11_call_deadline(cb, call, &timeout);
+        while (pret == 0 && sel->stream.chunks == chunks && sel->conversions == conversion) {
+            pret = x11_call_wait(cb, sel, call, &timeout);
+        }
+        arrived = pret != ECANCELED && sel->stream.chunks != chunks && sel->conversions == conversion;
+        chunks = sel->stream.chunks;
+        pthread_mutex_unlock(&sel->mu);
+        if (!arrived) {
+            return false;
+        }
+
+        while (bytes_after > 0) {
+            reply = xcb_get_property_reply(cb->xc, xcb_get_property(cb->xc, true, cb->xw,
+                                           sel->xmode, XCB_ATOM_ANY,
+                                           offset / 4, cb->transfer_size / 4), NULL);
+            size_t nbytes = reply != NULL ? xcb_get_property_value_length(reply) : 0;
+            if (reply == NULL || (reply->format % 8) != 0 ||
+                    (reply->bytes_after != 0 && (nbytes % 4) != 0)) {
+                fprintf(stderr, "x11_stream_selection: [Err] Failed to receive INCR chunk\n");
+                free(reply); /* XCB: Do not use custom allocators */
+                return false;
+            } else if (offset == 0 && nbytes == 0) {
+                /* Zero-length chunk: transfer complete */
+                free(reply); /* XCB: Do not use custom allocators */
+                return true;
+            } else if (reply->type != utf8 || !fn(xcb_get_property_value(reply), nbytes, user)) {
+                free(reply); /* XCB: Do not use custom allocators */
+                return false;
+            }
+
+            bytes_after = reply->bytes_after;
+            offset += nbytes;
+            free(reply); /* XCB: Do not use custom allocators */
+        }
+    }
+}
+
+/**
+ *  \brief Passes data to a stream reader in chunks of at most transfer_size.
+ *
+ *  \param [in] cb The clipboard context.
+ *  \param [in] snap The data to pass on.
+ *  \param [in] fn As per clipboard_read_stream.
+ *  \param [in] user User data passed through to fn.
+ *  \return true iff all of the data was passed to fn.
+ */
+static bool x11_stream_snapshot(clipboard_c *cb, snapshot_c *snap, clipboard_write_fn fn, void *user) {
+    for (size_t offset = 0; offset < snap->length; offset += cb->transfer_size) {
+        size_t n = snap->length - offset < cb->transfer_size ? snap->length - offset : cb->transfer_size;
+        if (!fn(snap->data + offset, n, user)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+LCB_API bool LCB_CC clipboard_read_stream(clipboard_c *cb, clipboard_mode mode, clipboard_write_fn fn, void *user) {
+    struct timespec timeout;
+    x11_call_c call;
+    unsigned long conversion = 0, chunks = 0;
+    bool waited = false, started = false, ready = false, ok = false;
+    snapshot_c *snap = NULL;
+    async_c *done = NULL;
+    int pret = 0;
+
+    if (cb == NULL || fn == NULL || !VALID_MODE(mode)) {
+        return false;
+    }
+
+    xcb_atom_t utf8 = cb->std_atoms[X_ATOM_UTF8_STRING].atom;
+    selection_c *sel = &cb->selections[mode];
+    x11_call_begin(cb, &call, -1);
+    if (pthread_mutex_lock(&sel->mu) != 0) {
+        return false;
+    }
+
+    if (sel->has_ownership) {
+        /* Our own data is used as-is */
+        snap = x11_snapshot_get(sel, utf8);
+    } else if (x11_cache_valid(cb, sel, utf8)) {
+        sel->cache_hits++;
+        snap = x11_snapshot_get(sel, utf8);
+    } else {
+        sel->cache_misses++;
+        sel->waiters++;
+        waited = true;
+
+        /* Nothing is kept for other readers to share, so the conversion is ours alone */
+        x11_call_deadline(cb, &call, &timeout);
+        while (pret == 0 && sel->converting) {
+            pret = x11_call_wait(cb, sel, &call, &timeout);
+        }
+        if (pret == 0 && !sel->converting) {
+            x11_convert_selection(cb, sel, utf8);
+            sel->stream.active = true;
+            sel->stream.ready = false;
+            conversion = sel->conversions;
+            started = true;
+
+            while (pret == 0 && sel->conversions == conversion && !sel->stream.ready) {
+                pret = x11_call_wait(cb, sel, &call, &timeout);
+            }
+            ready = pret != ECANCELED && sel->conversions == conversion && sel->stream.ready;
+            chunks = sel->stream.chunks;
+        }
+    }
+    pthread_mutex_unlock(&sel->mu);
+
+    if (snap != NULL) {
+        /* Providers run without the lock, as they may take a while */
+        if ((snap = x11_snapshot_provide(cb, sel, snap)) != NULL) {
+            ok = x11_stream_snapshot(cb, snap, fn, user);
+            x11_snapshot_unref(cb, snap);
+        }
+        return ok;
+    } else if (!waited) {
+        return false;
+    }
+
+    /* Not under the lock, so that the event loop can serve requests meanwhile */
+    if (ready) {
+        ok = x11_stream_selection(cb, sel, conversion, chunks, &call, fn, user);
+    }
+
+    if (pthread_mutex_lock(&sel->mu) != 0) {
+        return ok;
+    }
+    if (started && sel->converting && sel->conversions == conversion) {
+        done = x11_finish_conversion(cb, sel, NULL, 0, XCB_NONE);
+    }
+    sel->waiters--;
+    x11_abandon_conversion(cb, sel);
+    pthread_mutex_unlock(&sel->mu);
+    x11_async_dispatch(cb, done);
+    return ok;
+}
+
+/**
+ *  \brief Writes a chunk to a file descriptor.
+ *
+ *  \param [in] data The chunk.
+ *  \param [in] length The length of the chunk.
+ *  \param [in] user The file descriptor, as an (int *).
+ *  \return true iff the whole chunk was written.
+ */
+static bool write_fd(const void *data, size_t length, void *user) {
+    const char *pos = (const char *)data;
+    int fd = *(int *)user;
+
+    while (length > 0) {
+        ssize_t n = write(fd, pos, length);
+        if (n < 0 ? errno != EINTR : n == 0) {
+            /* A write that makes no progress would never finish */
+            return false;
+        } else if (n > 0) {
+            pos += n;
+            length -= (size_t)n;
+        }
+    }
+    return true;
+}
+
+LCB_API bool LCB_CC clipboard_read_to_fd(clipboard_c *cb, clipboard_mode mode, int fd) {
+    return clipboard_read_stream(cb, mode, write_fd, &fd);
+}
+
+LCB_API void LCB_CC clipboard_cancel(clipboard_c *cb) {
+    if (cb == NULL) {
+        return;
+    }
+
+    __atomic_add_fetch(&cb->cancels, 1, __ATOMIC_ACQ_REL);
+    for (int i = 0; i < LCB_MODE_END; i++) {
+        selection_c *sel = &cb->selections[i];
+        /* Under the lock, so a reader either sees the new count or is waiting to be woken */
+        if (pthread_mutex_lock(&sel->mu) == 0) {
+            pthread_cond_broadcast(&sel->cond);
+            pthread_mutex_unlock(&sel->mu);
+        }
+    }
+}
+
+LCB_API size_t LCB_CC clipboard_text_modes(clipboard_c *cb, const clipboard_mode *modes, size_t count, char **texts, size_t *lengths) {
+    snapshot_c *snaps[LCB_MODE_END] = {NULL};
+    unsigned long conversions[LCB_MODE_END] = {0};
+    bool wanted[LCB_MODE_END] = {false}, waiting[LCB_MODE_END] = {false}, joined[LCB_MODE_END] = {false};
+    struct timespec timeout;
+    x11_call_c call;
+    size_t ret = 0;
+
+    if (cb == NULL || modes == NULL || texts == NULL) {
+        return 0;
+    }
+
+    x11_call_begin(cb, &call, -1);
+    for (size_t i = 0; i < count; i++) {
+        texts[i] = NULL;
+        if (VALID_MODE(modes[i])) {
+            wanted[modes[i]] = true;
+        }
+    }
+
+    /* Each selection converts into its own property, so all can be in flight at once */
+    xcb_atom_t target = cb->std_atoms[X_ATOM_UTF8_STRING].atom;
+    for (int i = 0; i < LCB_MODE_END; i++) {
+        selection_c *sel = &cb->selections[i];
+        if (!wanted[i] || pthread_mutex_lock(&sel->mu) != 0) {
+            continue;
+        }
+
+        if (sel->has_ownership) {
+            snaps[i] = x11_snapshot_get(sel, target);
+        } else if (x11_cache_valid(cb, sel, target)) {
+            sel->cache_hits++;
+            snaps[i] = x11_snapshot_get(sel, target);
+        } else {
+            /* Unlike x11_fetch_selection, the owner is not looked up first, as
+               that would serialise a round trip per selection */
+            sel->cache_misses++;
+            sel->waiters++;
+            waiting[i] = true;
+            joined[i] = x11_join_conversion(cb, sel, target, &conversions[i]);
+        }
+        pthread_mutex_unlock(&sel->mu);
+    }
+
+    /* Then wait for all of them against one deadline */
+    x11_call_deadline(cb, &call, &timeout);
+    for (int i = 0; i < LCB_MODE_END; i++) {
+        selection_c *sel = &cb->selections[i];
+        int pret = 0;
+
+        if (!waiting[i] || pthread_mutex_lock(&sel->mu) != 0) {
+            continue;
+        }
+
+        /* A conversion to another type must end before ours can start */
+        while (!joined[i] && pret == 0 && !(joined[i] = x11_join_conversion(cb, sel, target, &conversions[i]))) {
+            pret = x11_call_wait(cb, sel, &call, &timeout);
+        }
+        if (joined[i] && x11_await_conversion(cb, sel, conversions[i], &call, &timeout)) {
+            snaps[i] = x11_snapshot_get(sel, target);
+        }
+
+        sel->waiters--;
+        x11_abandon_conversion(cb, sel);
+        pthread_mutex_unlock(&sel->mu);
+    }
+
+    /* Providers run without the lock, as they may take a while */
+    for (int i = 0; i < LCB_MODE_END; i++) {
+        if (snaps[i] != NULL) {
+            snaps[i] = x11_snapshot_provide(cb, &cb->selections[i], snaps[i]);
+        }
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        if (VALID_MODE(modes[i]) && snaps[modes[i]] != NULL) {
+            retrieve_text_selection(cb, snaps[modes[i]], &texts[i], lengths != NULL ? &lengths[i] : NULL);
+            if (texts[i] != NULL) {
+                ret++;
             }
         }
-        free(e); /* XCB: Do not use custom allocators */
     }
 
-    fprintf(stderr, "x11_event_loop: [Warn] xcb_wait_for_event returned NULL\n");
-    return NULL;
+    for (int i = 0; i < LCB_MODE_END; i++) {
+        x11_snapshot_unref(cb, snaps[i]);
+    }
+    return ret;
 }
 
-LCB_API clipboard_c *LCB_CC clipboard_new(clipboard_opts *cb_opts) {
-    clipboard_opts defaults = {
-        .x11.display_name = NULL,
-        .x11.action_timeout = LCB_X11_ACTION_TIMEOUT_DEFAULT,
-        .x11.transfer_size = LCB_X11_TRANSFER_SIZE_DEFAULT,
-    };
+LCB_API bool LCB_CC clipboard_set_text_ex(clipboard_c *cb, const char *src, int length, clipboard_mode mode) {
+    return clipboard_set_text_ex2(cb, src, length < 0 ? LCB_LENGTH_UNKNOWN : (size_t)length, mode);
+}
 
-    if (cb_opts == NULL) {
-        cb_opts = &defaults;
+LCB_API bool LCB_CC clipboard_set_text_ex2(clipboard_c *cb, const char *src, size_t length, clipboard_mode mode) {
+    if (cb == NULL || src == NULL || length == 0 || !VALID_MODE(mode)) {
+        return false;
     }
 
-    clipboard_calloc_fn calloc_fn = cb_opts->user_calloc_fn ? cb_opts->user_calloc_fn : calloc;
-    clipboard_c *cb = calloc_fn(1, sizeof(clipboard_c));
-    if (cb == NULL) {
-        return NULL;
+    if (length == LCB_LENGTH_UNKNOWN) {
+        length = strlen(src);
     }
-    LCB_SET_ALLOCATORS(cb, cb_opts);
 
-    cb->action_timeout = cb_opts->x11.action_timeout > 0 ?
-                         cb_opts->x11.action_timeout : LCB_X11_ACTION_TIMEOUT_DEFAULT;
-    /* Round down to nearest multiple of 4 */
-    cb->transfer_size = (cb_opts->x11.transfer_size / 4) * 4;
-    if (cb->transfer_size == 0) {
-        cb->transfer_size = LCB_X11_TRANSFER_SIZE_DEFAULT;
+    unsigned char *data = cb->malloc(sizeof(char) * (length + 1));
+    if (data == NULL) {
+        return false;
     }
+    memcpy(data, src, length);
+    data[length] = '\0';
 
-    cb->mu_initted = pthread_mutex_init(&cb->mu, NULL) == 0;
-    if (!cb->mu_initted) {
-        clipboard_free(cb);
-        return NULL;
+    snapshot_c *snap = x11_snapshot_new(cb, data, length, cb->std_atoms[X_ATOM_UTF8_STRING].atom, NULL, NULL);
+    if (snap == NULL) {
+        cb->free(data);
+        return false;
     }
-
-    cb->cond_initted = pthread_cond_init(&cb->cond, NULL) == 0;
-    if (!cb->cond_initted) {
-        clipboard_free(cb);
-        return NULL;
+    if (!x11_own_selection(cb, &cb->selections[mode], snap)) {
+        x11_snapshot_unref(cb, snap);
+        return false;
     }
 
-    int preferred_screen;
-    cb->xc = xcb_connect(cb_opts->x11.display_name, &preferred_screen);
-    assert(cb->xc != NULL); /* Docs say return is never NULL */
-    if (xcb_connection_has_error(cb->xc) != 0) {
-        clipboard_free(cb);
-        return NULL;
+    return true;
+}
+
+LCB_API bool LCB_CC clipboard_set_text_take(clipboard_c *cb, char *buf, size_t length, clipboard_free_fn free_fn, clipboard_mode mode) {
+    if (cb == NULL || buf == NULL || length == 0 || !VALID_MODE(mode)) {
+        return false;
     }
-    cb->xs = x11_get_screen(cb->xc, preferred_screen);
-    assert(cb->xs != NULL);
 
-    if (!x11_intern_atoms(cb->xc, cb->std_atoms, g_std_atom_names, X_ATOM_END)) {
-        clipboard_free(cb);
-        return NULL;
+    snapshot_c *snap = x11_snapshot_new(cb, (unsigned char *)buf, length,
+                                        cb->std_atoms[X_ATOM_UTF8_STRING].atom, free_fn, NULL);
+    if (snap == NULL) {
+        return false;
+    }
+    if (!x11_own_selection(cb, &cb->selections[mode], snap)) {
+        /* buf stays with the caller */
+        snap->data = NULL;
+        x11_snapshot_unref(cb, snap);
+        return false;
     }
 
-    cb->selections[LCB_CLIPBOARD].xmode = cb->std_atoms[X_ATOM_CLIPBOARD].atom;
-    cb->selections[LCB_PRIMARY].xmode   = XCB_ATOM_PRIMARY;
-    cb->selections[LCB_SECONDARY].xmode = XCB_ATOM_SECONDARY;
+    return true;
+}
 
-    /* Structure notify mask to get DestroyNotify messages */
-    /* Property change mask for PropertyChange messages */
-    uint32_t event_mask = XCB_EVENT_MASK_STRUCTURE_NOTIFY | XCB_EVENT_MASK_PROPERTY_CHANGE;
-    cb->xw = xcb_generate_id(cb->xc);
-    xcb_generic_error_t *err = xcb_request_check(cb->xc,
-                               xcb_create_window_checked(cb->xc,
-                                       XCB_COPY_FROM_PARENT, cb->xw, cb->xs->root,
-                                       0, 0, 10, 10, 0,  XCB_WINDOW_CLASS_INPUT_OUTPUT,
-                                       cb->xs->root_visual,
-                                       XCB_CW_EVENT_MASK, &event_mask));
-    if (err != NULL) {
-        cb->xw = 0;
-        /* Am I meant to free this? */
-        free(err); /* XCB: Do not use custom allocators */
-        clipboard_free(cb);
-        return NULL;
+LCB_API bool LCB_CC clipboard_set_file(clipboard_c *cb, const char *path, clipboard_mode mode) {
+    struct stat st;
+    void *map;
+    int fd;
+
+    if (cb == NULL || path == NULL || !VALID_MODE(mode)) {
+        return false;
     }
 
-    cb->event_loop_initted = pthread_create(&cb->event_loop, NULL,
-                                            x11_event_loop, (void *)cb) == 0;
-    if (!cb->event_loop_initted) {
-        clipboard_free(cb);
-        return NULL;
+    if ((fd = open(path, O_RDONLY)) == -1) {
+        return false;
+    }
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size <= 0 ||
+            (uintmax_t)st.st_size > SIZE_MAX) {
+        close(fd);
+        return false;
+    }
+    map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        close(fd);
+        return false;
     }
 
-    return cb;
+    /* Served (in INCR chunks if large) straight from the page cache */
+    snapshot_c *snap = x11_snapshot_new(cb, map, (size_t)st.st_size,
+                                        cb->std_atoms[X_ATOM_UTF8_STRING].atom, NULL, NULL);
+    if (snap == NULL) {
+        munmap(map, (size_t)st.st_size);
+        close(fd);
+        return false;
+    }
+    /* The descriptor is kept to check that the file still backs the mapping before each use */
+    snap->mapped = true;
+    snap->fd = fd;
+    if (!x11_own_selection(cb, &cb->selections[mode], snap)) {
+        x11_snapshot_unref(cb, snap);
+        return false;
+    }
+
+    return true;
 }
 
-LCB_API void LCB_CC clipboard_free(clipboard_c *cb) {
-    if (cb == NULL) {
-        return;
+LCB_API bool LCB_CC clipboard_set_text_provider(clipboard_c *cb, const clipboard_provider *provider, clipboard_mode mode) {
+    if (cb == NULL || provider == NULL || provider->fn == NULL || !VALID_MODE(mode)) {
+        return false;
     }
 
-    if (cb->event_loop_initted) {
-        /* This should send a DestroyNotify message as the termination condition */
-        xcb_destroy_window(cb->xc, cb->xw);
-        xcb_flush(cb->xc);
-        pthread_join(cb->event_loop, NULL);
-    } else if (cb->xw != 0) {
-        xcb_destroy_window(cb->xc, cb->xw);
+    snapshot_c *snap = x11_snapshot_new(cb, NULL, 0, cb->std_atoms[X_ATOM_UTF8_STRING].atom, NULL, provider);
+    if (snap == NULL) {
+        return false;
     }
+    if (!x11_own_selection(cb, &cb->selections[mode], snap)) {
+        /* Not taken, so provider->user is not ours to free */
+        snap->provider.fn = NULL;
+        x11_snapshot_unref(cb, snap);
+        return false;
+    }
+
+    return true;
+}
 
-    if (cb->xc != NULL) {
-        xcb_disconnect(cb->xc);
+LCB_API bool LCB_CC clipboard_set_text_reader(clipboard_c *cb, const clipboard_reader *reader, clipboard_mode mode) {
+    if (cb == NULL || reader == NULL || reader->fn == NULL || reader->length == 0 || !VALID_MODE(mode)) {
+        return false;
     }
 
-    if (cb->cond_initted) {
-        pthread_cond_destroy(&cb->cond);
+    /* A length of 0 tells requestors of an INCR transfer that it is unknown */
+    size_t length = reader->length != LCB_LENGTH_UNKNOWN ? reader->length : 0;
+    snapshot_c *snap = x11_snapshot_new(cb, NULL, length, cb->std_atoms[X_ATOM_UTF8_STRING].atom, NULL, NULL);
+    if (snap == NULL) {
+        return false;
     }
-    if (cb->mu_initted) {
-        pthread_mutex_destroy(&cb->mu);
+    snap->reader = *reader;
+    if (!x11_own_selection(cb, &cb->selections[mode], snap)) {
+        /* Not taken, so reader->user is not ours to free */
+        snap->reader.fn = NULL;
+        x11_snapshot_unref(cb, snap);
+        return false;
     }
 
-    /* Free selection data */
-    for (int i = 0; i < LCB_MODE_END; i++) {
-        if (cb->selections[i].data != NULL) {
-            cb->free(cb->selections[i].data);
+    return true;
+}
+
+/**
+ *  \brief Interns the atom naming a MIME type.
+ *
+ *  \param [in] cb The clipboard context. No selection lock may be held.
+ *  \param [in] mime The MIME type.
+ *  \param [in] only_if_exists If set, the atom is not created if no client
+ *                             has interned it yet.
+ *  \return The atom, or XCB_NONE on error (or if it does not exist).
+ */
+static xcb_atom_t x11_mime_atom(clipboard_c *cb, const char *mime, bool only_if_exists) {
+    xcb_intern_atom_reply_t *reply = xcb_intern_atom_reply(cb->xc,
+                                     xcb_intern_atom(cb->xc, only_if_exists, strlen(mime), mime), NULL);
+    xcb_atom_t atom = reply != NULL ? reply->atom : XCB_NONE;
+    free(reply); /* XCB: Do not use custom allocators */
+    return atom;
+}
+
+LCB_API void LCB_CC *clipboard_data(clipboard_c *cb, const char *mime, size_t *length, clipboard_mode mode) {
+    return clipboard_data_timed(cb, mime, length, mode, -1);
+}
+
+LCB_API void LCB_CC *clipboard_data_timed(clipboard_c *cb, const char *mime, size_t *length, clipboard_mode mode, int timeout) {
+    unsigned char *ret = NULL;
+    x11_call_c call;
+
+    if (cb == NULL || mime == NULL || !VALID_MODE(mode)) {
+        return NULL;
+    }
+
+    /* If nobody has interned the type, no owner can offer it */
+    x11_call_begin(cb, &call, timeout);
+    xcb_atom_t target = x11_mime_atom(cb, mime, true);
+    if (target == XCB_NONE) {
+        return NULL;
+    }
+
+    snapshot_c *snap = x11_fetch_selection(cb, &cb->selections[mode], target, &call);
+    if (snap != NULL) {
+        if ((ret = cb->malloc(snap->length + 1)) != NULL) {
+            copy_text_snapshot(snap, (char *)ret);
+            if (length != NULL) {
+                *length = snap->length;
+            }
         }
+        x11_snapshot_unref(cb, snap);
     }
 
-    cb->free(cb);
+    return ret;
 }
 
-LCB_API void LCB_CC clipboard_clear(clipboard_c *cb, clipboard_mode mode) {
-    if (cb == NULL || cb->xc == NULL) {
+/**
+ *  \brief Converts the selection to several targets with one MULTIPLE request.
+ *
+ *  \param [in] cb The clipboard context.
+ *  \param [in] sel The selection context. sel->mu must not be held.
+ *  \param [in,out] m The targets wanted, all with retry set. Their data is
+ *                    filled in as received. Targets left with retry set
+ *                    are to be converted on their own.
+ *  \param [in] call The bounds of the read.
+ *
+ *  Only one MULTIPLE conversion per context may be in flight; if another
+ *  is, this returns straight away.
+ */
+static void x11_convert_multiple(clipboard_c *cb, selection_c *sel, multi_c *m, const x11_call_c *call) {
+    xcb_atom_t multiple = cb->std_atoms[X_ATOM_MULTIPLE].atom;
+    xcb_atom_t *pairs;
+    size_t npairs = 0;
+    bool busy = true;
+
+    if (pthread_mutex_lock(&cb->mu) == 0) {
+        busy = cb->multiple_busy;
+        cb->multiple_busy = true;
+        pthread_mutex_unlock(&cb->mu);
+    }
+    if (busy) {
         return;
     }
 
-    xcb_atom_t sel;
+    /* Each target is converted into the property of the same name on our window */
+    if ((pairs = cb->malloc(m->count * 2 * sizeof(xcb_atom_t))) == NULL) {
+        fprintf(stderr, "x11_convert_multiple: [Err] malloc failed\n");
+    } else if (pthread_mutex_lock(&sel->mu) == 0) {
+        struct timespec timeout;
+        unsigned long conversion;
+        int pret = 0;
 
-    switch (mode) {
-        case LCB_CLIPBOARD:
-            sel = cb->std_atoms[X_ATOM_CLIPBOARD].atom;
-            break;
-        case LCB_PRIMARY:
-            sel = XCB_ATOM_PRIMARY;
-            break;
-        case LCB_SECONDARY:
-            sel = XCB_ATOM_SECONDARY;
-            break;
-        default:
-            return;
+        for (size_t i = 0; i < m->count; i++) {
+            if (m->items[i].target != XCB_NONE) {
+                pairs[2 * npairs] = pairs[2 * npairs + 1] = m->items[i].target;
+                npairs++;
+            }
+        }
+
+        sel->cache_misses++;
+        sel->waiters++;
+        x11_call_deadline(cb, call, &timeout);
+        /* A conversion to another type must end before ours can start */
+        while (pret == 0 && sel->converting) {
+            pret = x11_call_wait(cb, sel, call, &timeout);
+        }
+
+        if (pret == 0 && !sel->has_ownership) {
+            xcb_change_property(cb->xc, XCB_PROP_MODE_REPLACE, cb->xw, sel->xmode,
+                                cb->std_atoms[X_ATOM_ATOM_PAIR].atom, 32, npairs * 2, pairs);
+            x11_convert_selection(cb, sel, multiple);
+            sel->multi = m;
+            conversion = sel->conversions;
+            while (pret == 0 && sel->conversions == conversion) {
+                pret = x11_call_wait(cb, sel, call, &timeout);
+            }
+            sel->multi = NULL;
+        }
+
+        if (pret != 0) {
+            /* The owner is unresponsive (or the read cancelled), so don't try each target on its own too */
+            for (size_t i = 0; i < m->count; i++) {
+                m->items[i].retry = false;
+            }
+        }
+        sel->waiters--;
+        x11_abandon_conversion(cb, sel);
+        pthread_mutex_unlock(&sel->mu);
     }
+    cb->free(pairs);
 
-    xcb_set_selection_owner(cb->xc, XCB_NONE, sel, XCB_CURRENT_TIME);
-    xcb_flush(cb->xc);
+    if (pthread_mutex_lock(&cb->mu) == 0) {
+        cb->multiple_busy = false;
+        pthread_mutex_unlock(&cb->mu);
+    }
 }
 
-LCB_API bool LCB_CC clipboard_has_ownership(clipboard_c *cb, clipboard_mode mode) {
-    bool ret = false;
+LCB_API size_t LCB_CC clipboard_data_multiple(clipboard_c *cb, const char * const *mimes, size_t count, void **data, size_t *lengths, clipboard_mode mode) {
+    size_t ret = 0, wanted = 0;
+    multi_c m = {NULL, 0};
+    x11_call_c call;
+    atom_c *atoms;
 
-    if (!VALID_MODE(mode)) {
-        return false;
+    if (cb == NULL || mimes == NULL || data == NULL || count == 0 || count > INT_MAX || !VALID_MODE(mode)) {
+        return 0;
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (mimes[i] == NULL) {
+            return 0;
+        }
+        data[i] = NULL;
+        if (lengths != NULL) {
+            lengths[i] = 0;
+        }
     }
 
-    if (cb && (pthread_mutex_lock(&cb->mu) == 0)) {
-        ret = cb->selections[mode].has_ownership;
-        pthread_mutex_unlock(&cb->mu);
+    x11_call_begin(cb, &call, -1);
+    atoms = cb->malloc(count * sizeof(atom_c));
+    m.items = cb->calloc(count, sizeof(multi_item_c));
+    m.count = count;
+    /* All interned in one round trip; if nobody has interned a type, no owner can offer it */
+    if (atoms == NULL || m.items == NULL || !x11_intern_atoms(cb->xc, atoms, mimes, (int)count, true)) {
+        cb->free(atoms);
+        cb->free(m.items);
+        return 0;
+    }
+    for (size_t i = 0; i < count; i++) {
+        m.items[i].target = atoms[i].atom;
+        m.items[i].retry = atoms[i].atom != XCB_NONE;
+        wanted += m.items[i].retry;
+    }
+    cb->free(atoms);
+
+    selection_c *sel = &cb->selections[mode];
+    /* Our own data holds a single type, so needs no conversion */
+    if (wanted > 1 && !__atomic_load_n(&sel->has_ownership, __ATOMIC_ACQUIRE)) {
+        x11_convert_multiple(cb, sel, &m, &call);
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        multi_item_c *item = &m.items[i];
+        if (item->data == NULL && item->retry) {
+            snapshot_c *snap = x11_fetch_selection(cb, sel, item->target, &call);
+            if (snap != NULL) {
+                if ((item->data = cb->malloc(snap->length + 1)) != NULL) {
+                    copy_text_snapshot(snap, (char *)item->data);
+                    item->length = snap->length;
+                }
+                x11_snapshot_unref(cb, snap);
+            }
+        }
+
+        if (item->data != NULL) {
+            data[i] = item->data;
+            if (lengths != NULL) {
+                lengths[i] = item->length;
+            }
+            ret++;
+        }
     }
+    cb->free(m.items);
+
     return ret;
 }
 
 /**
- *  \brief Copies the selection data into a newly allocated buffer
+ *  \brief Obtains the selection data in the most preferred type the owner offers.
  *
- *  \param [in] cb The clipboard context
- *  \param [in] sel The selection context
- *  \param [out] ret The return location
- *  \param [out] length The length of the returned data (optional)
+ *  \param [in] cb The clipboard context.
+ *  \param [in] sel The selection context. sel->mu must not be held.
+ *  \param [in,out] p The types wanted. On return, p->chosen is the index of
+ *                    the type of the data returned.
+ *  \param [in] call The bounds of the read.
+ *  \return A reference to the data, or NULL if none of the types is available.
+ *
+ *  Unless the owner's TARGETS are cached, they are converted first, and the
+ *  event loop follows on with the conversion to the type chosen. Both round
+ *  trips to the owner are thus waited on as one. Owners without TARGETS
+ *  are asked for each type in turn.
  */
-static void retrieve_text_selection(clipboard_c *cb, selection_c *sel, char **ret, int *length) {
-    if (sel->data != NULL && sel->target == cb->std_atoms[X_ATOM_UTF8_STRING].atom) {
-        *ret = cb->malloc(sizeof(char) * (sel->length + 1));
-        if (*ret != NULL) {
-            memcpy(*ret, sel->data, sel->length);
-            (*ret)[sel->length] = '\0';
+static snapshot_c *x11_fetch_preferred(clipboard_c *cb, selection_c *sel, prefs_c *p, const x11_call_c *call) {
+    snapshot_c *snap = NULL;
+    bool converted = false;
 
-            if (length != NULL) {
-                *length = sel->length;
+    p->chosen = p->count;
+    p->listed = false;
+    if (pthread_mutex_lock(&sel->mu) != 0) {
+        return NULL;
+    }
+
+    if (sel->has_ownership || x11_targets_valid(cb, sel)) {
+        /* Our own data has a single type, which is all we offer */
+        p->listed = true;
+        p->chosen = sel->has_ownership ? x11_choose_target(p->types, p->count, &sel->target, 1) :
+                    x11_choose_target(p->types, p->count, sel->targets, sel->ntargets);
+    } else {
+        struct timespec timeout;
+        unsigned long chunks, conversion;
+        int pret = 0;
+
+        sel->waiters++;
+        x11_call_deadline(cb, call, &timeout);
+        /* A conversion to another type must end before ours can start */
+        while (pret == 0 && sel->converting) {
+            pret = x11_call_wait(cb, sel, call, &timeout);
+        }
+
+        if (pret == 0 && !x11_call_cancelled(cb, call)) {
+            sel->cache_misses++;
+            x11_convert_selection(cb, sel, cb->std_atoms[X_ATOM_TARGETS].atom);
+            sel->prefs = p;
+            converted = true;
+            conversion = sel->conversions;
+            chunks = sel->incr.chunks;
+            while (pret == 0 && sel->conversions == conversion) {
+                pret = x11_call_wait(cb, sel, call, &timeout);
+                if (pret != ECANCELED && sel->incr.chunks != chunks) {
+                    /* INCR transfers time out per chunk, not per transfer */
+                    chunks = sel->incr.chunks;
+                    x11_call_deadline(cb, call, &timeout);
+                    pret = 0;
+                }
             }
+            if (sel->prefs == p) {
+                sel->prefs = NULL;
+            }
+        }
+
+        sel->waiters--;
+        if (pret == 0 && p->chosen < p->count) {
+            snap = x11_snapshot_get(sel, p->types[p->chosen]);
+        } else if (pret != 0) {
+            /* The owner is unresponsive (or the read cancelled), so don't ask for each type in turn */
+            p->listed = true;
+            p->chosen = p->count;
+        }
+        x11_abandon_conversion(cb, sel);
+    }
+    pthread_mutex_unlock(&sel->mu);
+
+    if (snap != NULL) {
+        return x11_snapshot_provide(cb, sel, snap);
+    } else if (p->listed) {
+        /* Our own data, or TARGETS from the cache; the data itself may be cached too */
+        return !converted && p->chosen < p->count ? x11_fetch_selection(cb, sel, p->types[p->chosen], call) : NULL;
+    }
+
+    for (p->chosen = 0; p->chosen < p->count; p->chosen++) {
+        if (p->types[p->chosen] != XCB_NONE &&
+                (snap = x11_fetch_selection(cb, sel, p->types[p->chosen], call)) != NULL) {
+            return snap;
         }
     }
+    return NULL;
 }
 
-LCB_API char LCB_CC *clipboard_text_ex(clipboard_c *cb, int *length, clipboard_mode mode) {
-    char *ret = NULL;
+LCB_API void LCB_CC *clipboard_data_preferred(clipboard_c *cb, const char * const *mimes, size_t count, size_t *chosen, size_t *length, clipboard_mode mode) {
+    unsigned char *ret = NULL;
+    prefs_c p = {NULL, count, count, false};
+    x11_call_c call;
+    atom_c *atoms;
+    xcb_atom_t *types;
 
-    if (cb == NULL || !VALID_MODE(mode)) {
+    if (chosen != NULL) {
+        *chosen = count;
+    }
+    if (cb == NULL || mimes == NULL || count == 0 || count > INT_MAX || !VALID_MODE(mode)) {
         return NULL;
     }
+    for (size_t i = 0; i < count; i++) {
+        if (mimes[i] == NULL) {
+            return NULL;
+        }
+    }
 
-    if (pthread_mutex_lock(&cb->mu) == 0) {
-        selection_c *sel = &cb->selections[mode];
-        if (sel->has_ownership) {
-            retrieve_text_selection(cb, sel, &ret, length);
-        } else {
-            /* Convert selection & wait for reply */
-            struct timeval now;
-            struct timespec timeout;
-            int pret = 0;
-
-            xcb_get_selection_owner_reply_t *owner = xcb_get_selection_owner_reply(cb->xc,
-                    xcb_get_selection_owner(cb->xc, sel->xmode), NULL);
-            if (owner == NULL || owner->owner == 0) {
-                /* No selection owner; no data available */
-                pthread_mutex_unlock(&cb->mu);
-                free(owner); /* XCB: Do not use custom allocators */
-                return NULL;
-            }
-            free(owner); /* XCB: Do not use custom allocators */
-
-            /* Unset any old value */
-            cb->free(sel->data);
-            sel->data = NULL;
-            sel->length = 0;
-
-            sel->target = cb->std_atoms[X_ATOM_UTF8_STRING].atom;
-            xcb_convert_selection(cb->xc, cb->xw, sel->xmode,
-                                  sel->target, sel->xmode, XCB_CURRENT_TIME);
-            xcb_flush(cb->xc);
+    x11_call_begin(cb, &call, -1);
+    atoms = cb->malloc(count * sizeof(atom_c));
+    types = cb->malloc(count * sizeof(xcb_atom_t));
+    /* All interned in one round trip; if nobody has interned a type, no owner can offer it */
+    if (atoms == NULL || types == NULL || !x11_intern_atoms(cb->xc, atoms, mimes, (int)count, true)) {
+        cb->free(atoms);
+        cb->free(types);
+        return NULL;
+    }
+    for (size_t i = 0; i < count; i++) {
+        types[i] = atoms[i].atom;
+    }
+    cb->free(atoms);
+    p.types = types;
 
-            /* Calculate timeout */
-            gettimeofday(&now, NULL);
-            timeout.tv_sec = now.tv_sec + (cb->action_timeout / 1000);
-            timeout.tv_nsec = (now.tv_usec * 1000UL) + ((cb->action_timeout % 1000) * 1000000UL);
-            if (timeout.tv_nsec >= 1000000000UL) {
-                timeout.tv_sec += timeout.tv_nsec / 1000000000UL;
-                timeout.tv_nsec = timeout.tv_nsec % 1000000000UL;
+    snapshot_c *snap = x11_fetch_preferred(cb, &cb->selections[mode], &p, &call);
+    if (snap != NULL) {
+        if ((ret = cb->malloc(snap->length + 1)) != NULL) {
+            copy_text_snapshot(snap, (char *)ret);
+            if (length != NULL) {
+                *length = snap->length;
             }
-
-            while (pret == 0 && sel->data == NULL) {
-                pret = pthread_cond_timedwait(&cb->cond, &cb->mu, &timeout);
+            if (chosen != NULL) {
+                *chosen = p.chosen;
             }
-
-            retrieve_text_selection(cb, sel, &ret, length);
         }
-
-        pthread_mutex_unlock(&cb->mu);
+        x11_snapshot_unref(cb, snap);
     }
+    cb->free(types);
 
     return ret;
 }
 
-LCB_API bool LCB_CC clipboard_set_text_ex(clipboard_c *cb, const char *src, int length, clipboard_mode mode) {
-    bool ret = false;
+LCB_API bool LCB_CC clipboard_set_data(clipboard_c *cb, const char *mime, const void *data, size_t length, clipboard_mode mode) {
+    if (cb == NULL || mime == NULL || data == NULL || length == 0 || !VALID_MODE(mode)) {
+        return false;
+    }
 
-    if (cb == NULL || src == NULL || length == 0 || !VALID_MODE(mode)) {
+    xcb_atom_t type = x11_mime_atom(cb, mime, false);
+    if (type == XCB_NONE) {
         return false;
     }
 
-    if (pthread_mutex_lock(&cb->mu) == 0) {
-        selection_c *sel = &cb->selections[mode];
-        if (sel->data != NULL) {
-            cb->free(sel->data);
-        }
-        if (length < 0) {
-            length = strlen(src);
-        }
-
-        sel->data = cb->malloc(sizeof(char) * (length + 1));
-        if (sel->data != NULL) {
-            memcpy(sel->data, src, length);
-            sel->data[length] = '\0';
-            sel->length = length;
-            sel->has_ownership = true;
-            sel->target = cb->std_atoms[X_ATOM_UTF8_STRING].atom;
-            xcb_set_selection_owner(cb->xc, cb->xw, sel->xmode, XCB_CURRENT_TIME);
-            xcb_flush(cb->xc);
-            ret = true;
-        }
+    unsigned char *copy = cb->malloc(length);
+    if (copy == NULL) {
+        return false;
+    }
+    memcpy(copy, data, length);
 
-        pthread_mutex_unlock(&cb->mu);
+    snapshot_c *snap = x11_snapshot_new(cb, copy, length, type, NULL, NULL);
+    if (snap == NULL) {
+        cb->free(copy);
+        return false;
+    }
+    if (!x11_own_selection(cb, &cb->selections[mode], snap)) {
+        x11_snapshot_unref(cb, snap);
+        return false;
     }
 
-    return ret;
+    return true;
 }
 
 #endif /* LIBCLIPBOARD_BUILD_X11 */
@@ -0,0 +1,153 @@
+/**
+ *  \file bench_contention.c
+ *  \brief Benchmark of concurrent readers of different clipboard modes
+ *
+ *  \copyright Copyright (C) 2016 Jeremy Tan.
+ *             This file is released under the MIT license.
+ *             See LICENSE for details.
+ *
+ *  Threads reading a small PRIMARY selection run first alone, then next to
+ *  threads reading a large CLIPBOARD selection from the same context. If
+ *  modes do not contend, the PRIMARY read rate and worst case latency are
+ *  about the same in both runs.
+ */
+
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "libclipboard.h"
+
+#define N_PRIMARY_THREADS 2
+#define N_CLIPBOARD_THREADS 2
+#define RUN_MS 2000
+
+#ifdef LIBCLIPBOARD_BUILD_X11
+#include <pthread.h>
+
+typedef struct reader_t {
+    clipboard_c *cb;
+    clipboard_mode mode;
+    volatile int *stop;
+    unsigned long reads;
+    unsigned long failures;
+    double max_ms;
+} reader_t;
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static void *reader_main(void *arg) {
+    reader_t *r = (reader_t *)arg;
+
+    while (!*r->stop) {
+        double start = now_ms();
+        char *text = clipboard_text_ex(r->cb, NULL, r->mode);
+        double elapsed = now_ms() - start;
+
+        if (text == NULL) {
+            r->failures++;
+        }
+        free(text);
+        r->reads++;
+        if (elapsed > r->max_ms) {
+            r->max_ms = elapsed;
+        }
+    }
+    return NULL;
+}
+
+/** Reads PRIMARY (and optionally CLIPBOARD) from many threads for RUN_MS **/
+static int run(clipboard_c *reader, int with_clipboard) {
+    reader_t readers[N_PRIMARY_THREADS + N_CLIPBOARD_THREADS];
+    pthread_t threads[N_PRIMARY_THREADS + N_CLIPBOARD_THREADS];
+    int n = N_PRIMARY_THREADS + (with_clipboard ? N_CLIPBOARD_THREADS : 0);
+    volatile int stop = 0;
+
+    memset(readers, 0, sizeof(readers));
+    for (int i = 0; i < n; i++) {
+        readers[i].cb = reader;
+        readers[i].mode = i < N_PRIMARY_THREADS ? LCB_PRIMARY : LCB_CLIPBOARD;
+        readers[i].stop = &stop;
+        if (pthread_create(&threads[i], NULL, reader_main, &readers[i]) != 0) {
+            printf("FAIL - pthread_create failed\n");
+            return 1;
+        }
+    }
+
+    struct timespec run_time = {RUN_MS / 1000, (RUN_MS % 1000) * 1000000L};
+    nanosleep(&run_time, NULL);
+    stop = 1;
+
+    unsigned long primary_reads = 0, clipboard_reads = 0, failures = 0;
+    double primary_max = 0;
+    for (int i = 0; i < n; i++) {
+        pthread_join(threads[i], NULL);
+        failures += readers[i].failures;
+        if (readers[i].mode == LCB_PRIMARY) {
+            primary_reads += readers[i].reads;
+            if (readers[i].max_ms > primary_max) {
+                primary_max = readers[i].max_ms;
+            }
+        } else {
+            clipboard_reads += readers[i].reads;
+        }
+    }
+
+    printf("%-18s %14.0f %14.2fms %16.1f %10lu\n",
+           with_clipboard ? "with CLIPBOARD" : "PRIMARY only",
+           primary_reads * 1000.0 / RUN_MS, primary_max,
+           clipboard_reads * 1000.0 / RUN_MS, failures);
+    return 0;
+}
+
+int main(void) {
+    const size_t clipboard_size = 8 << 20;
+    clipboard_opts opts = {0};
+
+    opts.x11.action_timeout = 10000;
+    clipboard_c *owner = clipboard_new(&opts);
+    clipboard_c *reader = clipboard_new(&opts);
+    if (owner == NULL || reader == NULL) {
+        printf("FAIL - clipboard_new returned NULL\n");
+        return 1;
+    }
+
+    char *payload = malloc(clipboard_size);
+    if (payload == NULL) {
+        printf("FAIL - malloc failed\n");
+        return 1;
+    }
+    memset(payload, 'x', clipboard_size);
+    /* PRIMARY is the reader's own, so its reads need no round trip */
+    if (!clipboard_set_text_ex(owner, payload, (int)clipboard_size, LCB_CLIPBOARD) ||
+            !clipboard_set_text_ex(reader, "primary", -1, LCB_PRIMARY)) {
+        printf("FAIL - clipboard_set_text_ex failed\n");
+        return 1;
+    }
+    free(payload);
+
+    printf("%-18s %14s %16s %16s %10s\n", "run", "PRIMARY/s", "PRIMARY max", "CLIPBOARD/s", "failures");
+    if (run(reader, 0) != 0 || run(reader, 1) != 0) {
+        return 1;
+    }
+
+    clipboard_free(reader);
+    clipboard_free(owner);
+    return 0;
+}
+
+#else
+
+int main(void) {
+    printf("Skipped - only the X11 backend locks per selection\n");
+    return 0;
+}
+
+#endif /* LIBCLIPBOARD_BUILD_X11 */
@@ -0,0 +1,202 @@
+/**
+ *  \file bench_retrieve.c
+ *  \brief Benchmark of retrieving large selections from another context
+ *
+ *  \copyright Copyright (C) 2016 Jeremy Tan.
+ *             This file is released under the MIT license.
+ *             See LICENSE for details.
+ *
+ *  Reports the wall time and the allocator traffic of the reading context,
+ *  including an upper bound on the bytes moved by realloc, for two read
+ *  strategies: clipboard_text_ex, which reads into one exactly sized
+ *  buffer, and growing a buffer with realloc as each chunk arrives (as
+ *  reads used to). Each read uses a new context, so none is served from
+ *  the cache of a previous one.
+ */
+
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "libclipboard.h"
+
+#define N_ITER 5
+
+#ifdef LIBCLIPBOARD_BUILD_X11
+
+/** Allocations are prefixed with their size so realloc copies can be counted **/
+#define HEADER_SIZE 16
+
+static struct {
+    size_t allocs;
+    size_t bytes_allocated;
+    size_t realloc_copied;
+} g_stats;
+
+static void *count_malloc(size_t size) {
+    unsigned char *p = malloc(size + HEADER_SIZE);
+    if (p == NULL) {
+        return NULL;
+    }
+    memcpy(p, &size, sizeof(size));
+    g_stats.allocs++;
+    g_stats.bytes_allocated += size;
+    return p + HEADER_SIZE;
+}
+
+static void *count_calloc(size_t nmemb, size_t size) {
+    void *p = count_malloc(nmemb * size);
+    if (p != NULL) {
+        memset(p, 0, nmemb * size);
+    }
+    return p;
+}
+
+static void *count_realloc(void *ptr, size_t size) {
+    unsigned char *p = ptr ? (unsigned char *)ptr - HEADER_SIZE : NULL;
+    size_t old_size = 0;
+
+    if (p != NULL) {
+        memcpy(&old_size, p, sizeof(old_size));
+    }
+    p = realloc(p, size + HEADER_SIZE);
+    if (p == NULL) {
+        return NULL;
+    }
+    memcpy(p, &size, sizeof(size));
+    g_stats.allocs++;
+    g_stats.bytes_allocated += size;
+    g_stats.realloc_copied += old_size < size ? old_size : size;
+    return p + HEADER_SIZE;
+}
+
+static void count_free(void *ptr) {
+    if (ptr != NULL) {
+        free((unsigned char *)ptr - HEADER_SIZE);
+    }
+}
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+/** A buffer grown by realloc for each chunk, as the reads used to **/
+typedef struct grow_t {
+    char *data;
+    size_t length;
+} grow_t;
+
+static bool append_chunk(const void *data, size_t length, void *user) {
+    grow_t *g = (grow_t *)user;
+    char *p = count_realloc(g->data, g->length + length + 1);
+    if (p == NULL) {
+        return false;
+    }
+    memcpy(p + g->length, data, length);
+    g->data = p;
+    g->length += length;
+    g->data[g->length] = '\0';
+    return true;
+}
+
+/** Reads the clipboard N_ITER times with one strategy, printing a row of results **/
+static int run(clipboard_opts *reader_opts, int size, int realloc_per_chunk) {
+    double elapsed = 0;
+    size_t allocs = 0, allocated = 0, copied = 0;
+
+    for (int j = 0; j < N_ITER; j++) {
+        /* A new context has nothing cached, so the data is really read */
+        clipboard_c *reader = clipboard_new(reader_opts);
+        size_t length = 0;
+        char *text = NULL;
+        grow_t g = {NULL, 0};
+        if (reader == NULL) {
+            printf("FAIL - clipboard_new returned NULL\n");
+            return 1;
+        }
+
+        memset(&g_stats, 0, sizeof(g_stats));
+        double start = now_ms();
+        if (realloc_per_chunk) {
+            text = clipboard_read_stream(reader, LCB_CLIPBOARD, append_chunk, &g) ? g.data : NULL;
+            length = g.length;
+        } else {
+            text = clipboard_text_ex2(reader, &length, LCB_CLIPBOARD);
+        }
+        elapsed += now_ms() - start;
+        allocs += g_stats.allocs;
+        allocated += g_stats.bytes_allocated;
+        copied += g_stats.realloc_copied;
+
+        if (text == NULL || length != (size_t)size) {
+            printf("FAIL - read %zu of %d bytes\n", text ? length : 0, size);
+            return 1;
+        }
+        count_free(text);
+        clipboard_free(reader);
+    }
+
+    printf("%10d %14s %10d %10.2fms %10zu %14zu %14zu\n", size,
+           realloc_per_chunk ? "realloc/chunk" : "exact",
+           (size + (int)reader_opts->x11.transfer_size - 1) / (int)reader_opts->x11.transfer_size,
+           elapsed / N_ITER, allocs / N_ITER, allocated / N_ITER, copied / N_ITER);
+    return 0;
+}
+
+int main(void) {
+    /* Kept below the usual BIG-REQUESTS limit so the owner does not use INCR */
+    const int sizes[] = {1 << 20, 4 << 20, 8 << 20, 15 << 20};
+    clipboard_opts owner_opts = {0}, reader_opts = {0};
+
+    owner_opts.x11.transfer_size = 16 << 20;
+    /* Small chunks exaggerate the per-chunk cost of the read loop */
+    reader_opts.x11.transfer_size = 64 * 1024;
+    reader_opts.x11.action_timeout = 10000;
+    reader_opts.user_malloc_fn = count_malloc;
+    reader_opts.user_calloc_fn = count_calloc;
+    reader_opts.user_realloc_fn = count_realloc;
+    reader_opts.user_free_fn = count_free;
+
+    clipboard_c *owner = clipboard_new(&owner_opts);
+    if (owner == NULL) {
+        printf("FAIL - clipboard_new returned NULL\n");
+        return 1;
+    }
+
+    printf("%10s %14s %10s %12s %10s %14s %14s\n", "size", "strategy", "chunks", "time/iter",
+           "allocs", "allocated", "realloc_copy");
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        char *payload = malloc(sizes[i]);
+        if (payload == NULL) {
+            printf("FAIL - malloc failed\n");
+            return 1;
+        }
+        memset(payload, 'x', sizes[i]);
+        if (!clipboard_set_text_ex(owner, payload, sizes[i], LCB_CLIPBOARD)) {
+            printf("FAIL - clipboard_set_text_ex failed\n");
+            return 1;
+        }
+        free(payload);
+
+        if (run(&reader_opts, sizes[i], 0) != 0 || run(&reader_opts, sizes[i], 1) != 0) {
+            return 1;
+        }
+    }
+
+    clipboard_free(owner);
+    return 0;
+}
+
+#else
+
+int main(void) {
+    printf("Skipped - only the X11 backend transfers data in chunks\n");
+    return 0;
+}
+
+#endif /* LIBCLIPBOARD_BUILD_X11 */
@@ -11,6 +11,15 @@
 
 #include "libclipboard-test-private.h"
 
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+
 class BasicsTest : public ::testing::Test {
 };
 
@@ -161,6 +170,35 @@ TEST_P(WithMode, TestSetText) {
     clipboard_free(cb1);
 }
 
+TEST_P(WithMode, TestTextEx2) {
+    clipboard_c *cb1 = clipboard_new(NULL), *cb2 = clipboard_new(NULL);
+    size_t length = 0;
+    char *ret;
+
+    ASSERT_FALSE(clipboard_set_text_ex2(NULL, "test", LCB_LENGTH_UNKNOWN, mMode));
+    ASSERT_FALSE(clipboard_set_text_ex2(cb1, NULL, LCB_LENGTH_UNKNOWN, mMode));
+    ASSERT_FALSE(clipboard_set_text_ex2(cb1, "test", 0, mMode));
+    ASSERT_TRUE(clipboard_text_ex2(NULL, &length, mMode) == NULL);
+
+    ASSERT_TRUE(clipboard_set_text_ex2(cb1, "test", LCB_LENGTH_UNKNOWN, mMode));
+    TRY_RUN_STRNE(clipboard_text_ex2(cb2, &length, mMode), "test", ret);
+    ASSERT_STREQ("test", ret);
+    ASSERT_EQ(4u, length);
+    free(ret);
+
+    ASSERT_TRUE(clipboard_set_text_ex2(cb1, "test", 2, mMode));
+    ret = clipboard_text_ex2(cb1, &length, mMode);
+    ASSERT_STREQ("te", ret);
+    ASSERT_EQ(2u, length);
+    free(ret);
+    TRY_RUN_STRNE(clipboard_text_ex2(cb2, NULL, mMode), "te", ret);
+    ASSERT_STREQ("te", ret);
+    free(ret);
+
+    clipboard_free(cb2);
+    clipboard_free(cb1);
+}
+
 TEST_P(WithMode, TestGetText) {
     clipboard_c *cb1 = clipboard_new(NULL), *cb2 = clipboard_new(NULL);
     char *ret;
@@ -239,6 +277,641 @@ TEST_P(WithMode, TestNewlines) {
     clipboard_free(cb2);
 }
 
+TEST_P(WithMode, TestTextInto) {
+    clipboard_c *cb1 = clipboard_new(NULL), *cb2 = clipboard_new(NULL);
+    char buf[16] = "untouched";
+    size_t needed = 1;
+    bool ret;
+
+    ASSERT_FALSE(clipboard_text_into(NULL, buf, sizeof(buf), &needed, mMode));
+    ASSERT_EQ(0u, needed);
+
+    ASSERT_TRUE(clipboard_set_text_ex(cb1, "intotest", -1, mMode));
+    ASSERT_FALSE(clipboard_text_into(cb1, buf, 4, &needed, mMode));
+    ASSERT_EQ(strlen("intotest") + 1, needed);
+    ASSERT_STREQ("untouched", buf);
+    ASSERT_FALSE(clipboard_text_into(cb1, NULL, 0, &needed, mMode));
+    ASSERT_EQ(strlen("intotest") + 1, needed);
+
+    ASSERT_TRUE(clipboard_text_into(cb1, buf, needed, NULL, mMode));
+    ASSERT_STREQ("intotest", buf);
+
+    memset(buf, 0, sizeof(buf));
+    TRY_RUN_NE(clipboard_text_into(cb2, buf, sizeof(buf), &needed, mMode), true, ret);
+    ASSERT_TRUE(ret);
+    ASSERT_STREQ("intotest", buf);
+    ASSERT_EQ(strlen("intotest") + 1, needed);
+
+    clipboard_free(cb1);
+    clipboard_free(cb2);
+}
+
+static void append_visited_text(const char *text, size_t length, void *user) {
+    static_cast<std::string *>(user)->append(text, length);
+}
+
+TEST_P(WithMode, TestTextVisit) {
+    clipboard_c *cb1 = clipboard_new(NULL), *cb2 = clipboard_new(NULL);
+    std::string visited;
+    bool ret;
+
+    ASSERT_FALSE(clipboard_text_visit(NULL, mMode, append_visited_text, &visited));
+    ASSERT_FALSE(clipboard_text_visit(cb1, mMode, NULL, &visited));
+
+    ASSERT_TRUE(clipboard_set_text_ex(cb1, "visit\ntest", -1, mMode));
+    ASSERT_TRUE(clipboard_text_visit(cb1, mMode, append_visited_text, &visited));
+    ASSERT_EQ("visit\ntest", visited);
+
+    visited.clear();
+    TRY_RUN_NE(clipboard_text_visit(cb2, mMode, append_visited_text, &visited), true, ret);
+    ASSERT_TRUE(ret);
+    ASSERT_EQ("visit\ntest", visited);
+
+    clipboard_free(cb1);
+    clipboard_free(cb2);
+}
+
+struct ProviderState {
+    std::atomic<int> calls{0};
+    std::atomic<int> frees{0};
+};
+
+static char *provide_text(void *user, size_t *length) {
+    static_cast<ProviderState *>(user)->calls++;
+    char *ret = static_cast<char *>(malloc(strlen("provided")));
+    memcpy(ret, "provided", strlen("provided"));
+    *length = strlen("provided");
+    return ret;
+}
+
+static void free_provider_state(void *user) {
+    static_cast<ProviderState *>(user)->frees++;
+}
+
+/** Writes text to a file in the test's temporary directory, returning its path **/
+static std::string write_temp_file(const char *name, const char *text) {
+    std::string path = testing::TempDir() + name;
+    FILE *fp = fopen(path.c_str(), "wb");
+    if (fp != NULL) {
+        fwrite(text, 1, strlen(text), fp);
+        fclose(fp);
+    }
+    return path;
+}
+
+TEST_P(WithMode, TestSetFile) {
+    clipboard_c *cb1 = clipboard_new(NULL), *cb2 = clipboard_new(NULL);
+    std::string empty = write_temp_file("libclipboard-empty.txt", "");
+    std::string path = write_temp_file("libclipboard-file.txt", "from a\nfile");
+    char *ret1, *ret2;
+
+    ASSERT_FALSE(clipboard_set_file(NULL, path.c_str(), mMode));
+    ASSERT_FALSE(clipboard_set_file(cb1, NULL, mMode));
+    ASSERT_FALSE(clipboard_set_file(cb1, empty.c_str(), mMode));
+    ASSERT_FALSE(clipboard_set_file(cb1, (path + ".missing").c_str(), mMode));
+
+    /* The contents stay on the clipboard after the file is unlinked */
+    ASSERT_TRUE(clipboard_set_file(cb1, path.c_str(), mMode));
+    remove(path.c_str());
+    remove(empty.c_str());
+
+    ret1 = clipboard_text_ex(cb1, NULL, mMode);
+    TRY_RUN_STRNE(clipboard_text_ex(cb2, NULL, mMode), "from a\nfile", ret2);
+    ASSERT_STREQ("from a\nfile", ret1);
+    ASSERT_STREQ("from a\nfile", ret2);
+    free(ret1);
+    free(ret2);
+
+    clipboard_free(cb2);
+    clipboard_free(cb1);
+}
+
+/** Appends each chunk of clipboard_read_stream to a std::string **/
+static bool append_chunk(const void *data, size_t length, void *user) {
+    static_cast<std::string *>(user)->append(static_cast<const char *>(data), length);
+    return true;
+}
+
+static bool refuse_chunk(const void *, size_t, void *) {
+    return false;
+}
+
+TEST_P(WithMode, TestReadStream) {
+    clipboard_opts opts = {};
+    /* Small transfers make the owner send INCR, and the reader take several chunks */
+    opts.x11.transfer_size = 4096;
+    clipboard_c *cb1 = clipboard_new(&opts), *cb2 = clipboard_new(&opts);
+    std::string text(64 * 1024, 'x'), streamed;
+
+    ASSERT_FALSE(clipboard_read_stream(NULL, mMode, append_chunk, &streamed));
+    ASSERT_FALSE(clipboard_read_stream(cb1, mMode, NULL, &streamed));
+
+    text[0] = 'a';
+    text[text.size() - 1] = 'z';
+    ASSERT_TRUE(clipboard_set_text_ex(cb1, text.c_str(), static_cast<int>(text.size()), mMode));
+    ASSERT_TRUE(clipboard_read_stream(cb1, mMode, append_chunk, &streamed));
+    ASSERT_EQ(text, streamed);
+
+    bool ok = false;
+    for (int i = 0; i < 5 && !ok; i++) {
+        streamed.clear();
+        ok = clipboard_read_stream(cb2, mMode, append_chunk, &streamed);
+    }
+    ASSERT_TRUE(ok);
+    ASSERT_EQ(text, streamed);
+
+    /* A sink refusing the text stops the read, and later reads still work */
+    ASSERT_FALSE(clipboard_read_stream(cb2, mMode, refuse_chunk, NULL));
+    char *ret;
+    TRY_RUN_STRNE(clipboard_text_ex(cb2, NULL, mMode), text.c_str(), ret);
+    ASSERT_STREQ(text.c_str(), ret);
+    free(ret);
+
+    clipboard_free(cb2);
+    clipboard_free(cb1);
+}
+
+TEST_P(WithMode, TestTextProvider) {
+    clipboard_c *cb1 = clipboard_new(NULL), *cb2 = clipboard_new(NULL);
+    ProviderState state1, state2;
+    clipboard_provider provider = {provide_text, &state1, free_provider_state, false};
+    char *ret;
+
+    ASSERT_FALSE(clipboard_set_text_provider(NULL, &provider, mMode));
+    ASSERT_FALSE(clipboard_set_text_provider(cb1, NULL, mMode));
+
+    ASSERT_TRUE(clipboard_set_text_provider(cb1, &provider, mMode));
+#ifdef LIBCLIPBOARD_BUILD_X11
+    /* Nothing is generated until someone asks for it */
+    ASSERT_EQ(0, state1.calls);
+#endif
+    TRY_RUN_STRNE(clipboard_text_ex(cb2, NULL, mMode), "provided", ret);
+    ASSERT_STREQ("provided", ret);
+    free(ret);
+    ret = clipboard_text_ex(cb1, NULL, mMode);
+    ASSERT_STREQ("provided", ret);
+    free(ret);
+#ifdef LIBCLIPBOARD_BUILD_X11
+    /* Not memoised, so generated for every request */
+    ASSERT_GE(state1.calls, 2);
+#endif
+
+    provider.user = &state2;
+    provider.memoise = true;
+    ASSERT_TRUE(clipboard_set_text_provider(cb1, &provider, mMode));
+    ASSERT_EQ(1, state1.frees);
+    for (int i = 0; i < 3; i++) {
+        ret = clipboard_text_ex(cb1, NULL, mMode);
+        ASSERT_STREQ("provided", ret);
+        free(ret);
+    }
+    ASSERT_EQ(1, state2.calls);
+
+    clipboard_free(cb1);
+    clipboard_free(cb2);
+    ASSERT_EQ(1, state2.frees);
+}
+
+struct ReaderState {
+    std::string text;
+    std::atomic<size_t> max_cap{0};
+    std::atomic<int> frees{0};
+};
+
+static size_t read_text(void *user, size_t offset, void *buf, size_t cap) {
+    ReaderState *state = static_cast<ReaderState *>(user);
+    size_t n = offset < state->text.size() ? std::min(cap, state->text.size() - offset) : 0;
+    memcpy(buf, state->text.data() + offset, n);
+    if (cap > state->max_cap) {
+        state->max_cap = cap;
+    }
+    return n;
+}
+
+static void free_reader_state(void *user) {
+    static_cast<ReaderState *>(user)->frees++;
+}
+
+TEST_P(WithMode, TestTextReader) {
+    clipboard_opts opts = {};
+    /* Small transfers make the owner pull the text over INCR */
+    opts.x11.transfer_size = 4096;
+    clipboard_c *cb1 = clipboard_new(&opts), *cb2 = clipboard_new(NULL);
+    ReaderState state1, state2;
+    clipboard_reader reader = {read_text, &state1, free_reader_state, LCB_LENGTH_UNKNOWN};
+    char *ret;
+
+    state1.text.assign(64 * 1024, 'r');
+    state2.text = "short";
+    ASSERT_FALSE(clipboard_set_text_reader(NULL, &reader, mMode));
+    ASSERT_FALSE(clipboard_set_text_reader(cb1, NULL, mMode));
+
+    ASSERT_TRUE(clipboard_set_text_reader(cb1, &reader, mMode));
+    TRY_RUN_STRNE(clipboard_text_ex(cb2, NULL, mMode), state1.text.c_str(), ret);
+    ASSERT_STREQ(state1.text.c_str(), ret);
+    free(ret);
+#ifdef LIBCLIPBOARD_BUILD_X11
+    /* Pulled a chunk at a time */
+    ASSERT_LE(state1.max_cap.load(), 4096u);
+#endif
+    ret = clipboard_text_ex(cb1, NULL, mMode);
+    ASSERT_STREQ(state1.text.c_str(), ret);
+    free(ret);
+
+    /* Text of known length that fits in one chunk */
+    reader.user = &state2;
+    reader.length = state2.text.size();
+    ASSERT_TRUE(clipboard_set_text_reader(cb1, &reader, mMode));
+    ASSERT_EQ(1, state1.frees);
+    TRY_RUN_STRNE(clipboard_text_ex(cb2, NULL, mMode), "short", ret);
+    ASSERT_STREQ("short", ret);
+    free(ret);
+
+    clipboard_free(cb1);
+    clipboard_free(cb2);
+    ASSERT_EQ(1, state2.frees);
+}
+
+TEST_P(WithMode, TestData) {
+    clipboard_c *cb1 = clipboard_new(NULL), *cb2 = clipboard_new(NULL);
+    const char mime[] = "application/x-libclipboard-test";
+    const unsigned char data[] = {0x89, 'P', 'N', 'G', 0x00, 0x1a, 0x00, 0xff};
+    size_t length = 0;
+    void *ret;
+
+    ASSERT_FALSE(clipboard_set_data(NULL, mime, data, sizeof(data), mMode));
+    ASSERT_FALSE(clipboard_set_data(cb1, NULL, data, sizeof(data), mMode));
+    ASSERT_FALSE(clipboard_set_data(cb1, mime, NULL, sizeof(data), mMode));
+    ASSERT_FALSE(clipboard_set_data(cb1, mime, data, 0, mMode));
+    ASSERT_TRUE(clipboard_data(NULL, mime, &length, mMode) == NULL);
+    ASSERT_TRUE(clipboard_data(cb1, NULL, &length, mMode) == NULL);
+
+    /* Raw bytes, embedded NULs included, go through unchanged */
+    ASSERT_TRUE(clipboard_set_data(cb1, mime, data, sizeof(data), mMode));
+    TRY_RUN_EQ(clipboard_data(cb2, mime, &length, mMode), NULL, ret);
+    ASSERT_TRUE(ret != NULL);
+    ASSERT_GE(length, sizeof(data));
+    ASSERT_EQ(0, memcmp(data, ret, sizeof(data)));
+    free(ret);
+
+    ret = clipboard_data(cb1, mime, &length, mMode);
+    ASSERT_TRUE(ret != NULL);
+    ASSERT_EQ(0, memcmp(data, ret, sizeof(data)));
+    free(ret);
+
+    /* Only offered in the format it was set in */
+    ASSERT_TRUE(clipboard_text_ex(cb1, NULL, mMode) == NULL);
+    ASSERT_TRUE(clipboard_text_ex(cb2, NULL, mMode) == NULL);
+
+    ASSERT_TRUE(clipboard_set_text_ex(cb1, "text", -1, mMode));
+    char *text = NULL;
+    TRY_RUN_STRNE(clipboard_text_ex(cb2, NULL, mMode), "text", text);
+    ASSERT_STREQ("text", text);
+    free(text);
+    ASSERT_TRUE(clipboard_data(cb2, mime, &length, mMode) == NULL);
+
+    clipboard_free(cb1);
+    clipboard_free(cb2);
+}
+
+TEST_P(WithMode, TestDataMultiple) {
+    clipboard_c *cb1 = clipboard_new(NULL), *cb2 = clipboard_new(NULL);
+    /* Text is a format every owner knows of, but the data is not offered as text */
+    const char *mimes[] = {"UTF8_STRING", "application/x-libclipboard-test"};
+    const unsigned char data[] = {0x00, 0x01, 0x02, 0x00, 0xfe};
+    void *ret[2];
+    size_t lengths[2];
+    size_t n;
+
+    ASSERT_EQ(0u, clipboard_data_multiple(NULL, mimes, 2, ret, lengths, mMode));
+    ASSERT_EQ(0u, clipboard_data_multiple(cb1, NULL, 2, ret, lengths, mMode));
+    ASSERT_EQ(0u, clipboard_data_multiple(cb1, mimes, 2, NULL, lengths, mMode));
+
+    ASSERT_TRUE(clipboard_set_data(cb1, mimes[1], data, sizeof(data), mMode));
+    /* Formats that are not available come back as NULL */
+    TRY_RUN_NE(clipboard_data_multiple(cb2, mimes, 2, ret, lengths, mMode), 1u, n);
+    ASSERT_EQ(1u, n);
+    ASSERT_TRUE(ret[0] == NULL);
+    ASSERT_EQ(0u, lengths[0]);
+    ASSERT_TRUE(ret[1] != NULL);
+    ASSERT_GE(lengths[1], sizeof(data));
+    ASSERT_EQ(0, memcmp(data, ret[1], sizeof(data)));
+    free(ret[1]);
+
+    /* Also from our own data, and without lengths */
+    ASSERT_EQ(1u, clipboard_data_multiple(cb1, mimes, 2, ret, NULL, mMode));
+    ASSERT_TRUE(ret[0] == NULL);
+    ASSERT_EQ(0, memcmp(data, ret[1], sizeof(data)));
+    free(ret[1]);
+
+    clipboard_free(cb1);
+    clipboard_free(cb2);
+}
+
+TEST_P(WithMode, TestDataPreferred) {
+    clipboard_c *cb1 = clipboard_new(NULL), *cb2 = clipboard_new(NULL);
+    const char *mimes[] = {"UTF8_STRING", "application/x-libclipboard-test"};
+    const unsigned char data[] = {0x00, 0x7f, 0x80, 0xff};
+    size_t chosen = 0, length = 0;
+    void *ret;
+
+    ASSERT_TRUE(clipboard_data_preferred(NULL, mimes, 2, &chosen, &length, mMode) == NULL);
+    ASSERT_EQ(2u, chosen);
+    ASSERT_TRUE(clipboard_data_preferred(cb1, NULL, 2, &chosen, &length, mMode) == NULL);
+
+    /* Text is preferred, but only the second format is offered */
+    ASSERT_TRUE(clipboard_set_data(cb1, mimes[1], data, sizeof(data), mMode));
+    TRY_RUN_EQ(clipboard_data_preferred(cb2, mimes, 2, &chosen, &length, mMode), NULL, ret);
+    ASSERT_TRUE(ret != NULL);
+    ASSERT_EQ(1u, chosen);
+    ASSERT_GE(length, sizeof(data));
+    ASSERT_EQ(0, memcmp(data, ret, sizeof(data)));
+    free(ret);
+
+    /* Repeat reads give the same result, whether or not TARGETS were cached */
+    ret = clipboard_data_preferred(cb2, mimes, 2, &chosen, NULL, mMode);
+    ASSERT_TRUE(ret != NULL);
+    ASSERT_EQ(1u, chosen);
+    free(ret);
+
+    char *text;
+    ASSERT_TRUE(clipboard_set_text_ex(cb1, "preferred", -1, mMode));
+    TRY_RUN_STRNE(static_cast<char *>(clipboard_data_preferred(cb2, mimes, 2, &chosen, &length, mMode)),
+                  "preferred", text);
+    ASSERT_STREQ("preferred", text);
+    ASSERT_EQ(0u, chosen);
+    free(text);
+
+    clipboard_free(cb1);
+    clipboard_free(cb2);
+}
+
+/** Collects the result of clipboard_text_async **/
+struct AsyncResult {
+    std::mutex mu;
+    std::condition_variable cond;
+    bool done = false;
+    bool has_text = false;
+    std::string text;
+
+    /** Waits for completion, returning the text or "(null)" on failure **/
+    std::string Wait() {
+        std::unique_lock<std::mutex> lock(mu);
+        if (!cond.wait_for(lock, std::chrono::seconds(10), [this] { return done; })) {
+            return "(timeout)";
+        }
+        return has_text ? text : "(null)";
+    }
+
+    /** Allows the result to be reused **/
+    void Reset() {
+        std::lock_guard<std::mutex> lock(mu);
+        done = has_text = false;
+        text.clear();
+    }
+};
+
+static void complete_async(char *text, size_t length, void *user) {
+    AsyncResult *result = static_cast<AsyncResult *>(user);
+    std::lock_guard<std::mutex> lock(result->mu);
+    result->has_text = text != NULL;
+    if (text != NULL) {
+        result->text.assign(text, length);
+        free(text);
+    }
+    result->done = true;
+    result->cond.notify_all();
+}
+
+TEST_P(WithMode, TestTextAsync) {
+    clipboard_c *cb1 = clipboard_new(NULL), *cb2 = clipboard_new(NULL);
+    AsyncResult result;
+    std::string text;
+
+    ASSERT_FALSE(clipboard_text_async(NULL, mMode, complete_async, &result));
+    ASSERT_FALSE(clipboard_text_async(cb1, mMode, NULL, &result));
+
+    ASSERT_TRUE(clipboard_set_text_ex(cb1, "asynctest", -1, mMode));
+    ASSERT_TRUE(clipboard_text_async(cb1, mMode, complete_async, &result));
+    ASSERT_EQ("asynctest", result.Wait());
+
+    for (int i = 0; i < 5 && text != "asynctest"; i++) {
+        result.Reset();
+        ASSERT_TRUE(clipboard_text_async(cb2, mMode, complete_async, &result));
+        text = result.Wait();
+    }
+    ASSERT_EQ("asynctest", text);
+
+    clipboard_free(cb1);
+    clipboard_free(cb2);
+}
+
+/** Polls until done returns true, giving up after 5 s; returns its last result **/
+template <typename Fn>
+static bool poll_until(Fn done) {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (!done()) {
+        if (std::chrono::steady_clock::now() >= deadline) {
+            return false;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    return true;
+}
+
+#ifdef LIBCLIPBOARD_BUILD_X11
+TEST_F(BasicsTest, TestTextAsyncAllModes) {
+    clipboard_c *cb1 = clipboard_new(NULL), *cb2 = clipboard_new(NULL);
+    AsyncResult results[LCB_MODE_END], again;
+    const char *texts[LCB_MODE_END] = {"clipboard", "primary", "secondary"};
+
+    for (int i = 0; i < LCB_MODE_END; i++) {
+        ASSERT_TRUE(clipboard_set_text_ex(cb1, texts[i], -1, static_cast<clipboard_mode>(i)));
+    }
+    /* No need to wait: cb2 shares cb1's connection, so its requests follow cb1's SetSelectionOwner */
+
+    /* All reads are in flight at once, plus a second read sharing the first conversion */
+    for (int i = 0; i < LCB_MODE_END; i++) {
+        ASSERT_TRUE(clipboard_text_async(cb2, static_cast<clipboard_mode>(i), complete_async, &results[i]));
+    }
+    ASSERT_TRUE(clipboard_text_async(cb2, LCB_CLIPBOARD, complete_async, &again));
+    for (int i = 0; i < LCB_MODE_END; i++) {
+        ASSERT_EQ(texts[i], results[i].Wait());
+    }
+    ASSERT_EQ(texts[LCB_CLIPBOARD], again.Wait());
+
+    /* With no owner, the read fails promptly rather than timing out (once cb2 stops caching) */
+    clipboard_free(cb1);
+    ASSERT_TRUE(poll_until([cb2, &again] {
+        again.Reset();
+        return clipboard_text_async(cb2, LCB_CLIPBOARD, complete_async, &again) &&
+               again.Wait() == "(null)";
+    }));
+
+    /* Reads still pending are failed on free */
+    again.Reset();
+    ASSERT_TRUE(clipboard_text_async(cb2, LCB_PRIMARY, complete_async, &again));
+    clipboard_free(cb2);
+    ASSERT_EQ("(null)", again.Wait());
+}
+
+TEST_F(BasicsTest, TestTextModes) {
+    clipboard_c *cb1 = clipboard_new(NULL), *cb2 = clipboard_new(NULL);
+    const clipboard_mode modes[] = {LCB_CLIPBOARD, LCB_PRIMARY, LCB_SECONDARY, LCB_PRIMARY, LCB_MODE_END};
+    const char *expected[] = {"clipboard", "primary", "secondary", "primary", NULL};
+    char *texts[5];
+    size_t lengths[5];
+
+    ASSERT_EQ(0u, clipboard_text_modes(NULL, modes, 5, texts, lengths));
+    ASSERT_EQ(0u, clipboard_text_modes(cb2, modes, 5, NULL, lengths));
+
+    for (int i = 0; i < LCB_MODE_END; i++) {
+        ASSERT_TRUE(clipboard_set_text_ex(cb1, expected[i], -1, static_cast<clipboard_mode>(i)));
+    }
+    /* No need to wait: cb2 shares cb1's connection, so its requests follow cb1's SetSelectionOwner */
+
+    /* Repeated modes share one conversion; invalid modes give NULL */
+    ASSERT_EQ(4u, clipboard_text_modes(cb2, modes, 5, texts, lengths));
+    for (int i = 0; i < 4; i++) {
+        ASSERT_STREQ(expected[i], texts[i]);
+        ASSERT_EQ(strlen(expected[i]), lengths[i]);
+        free(texts[i]);
+    }
+    ASSERT_TRUE(texts[4] == NULL);
+
+    /* With no owners, every text is NULL (once cb2 stops caching) */
+    clipboard_free(cb1);
+    ASSERT_TRUE(poll_until([cb2, &modes, &texts] {
+        size_t found = clipboard_text_modes(cb2, modes, 3, texts, NULL);
+        for (int i = 0; i < 3; i++) {
+            free(texts[i]);
+        }
+        return found == 0;
+    }));
+
+    clipboard_free(cb2);
+}
+#endif
+
+struct OwnerChanges {
+    std::mutex mu;
+    std::condition_variable cond;
+    int changes[LCB_MODE_END] = {};
+};
+
+static void count_owner_change(clipboard_mode mode, unsigned long, unsigned long, void *user) {
+    OwnerChanges *changes = static_cast<OwnerChanges *>(user);
+    std::lock_guard<std::mutex> lock(changes->mu);
+    changes->changes[mode]++;
+    changes->cond.notify_all();
+}
+
+TEST_F(BasicsTest, TestSubscribe) {
+    clipboard_c *cb1 = clipboard_new(NULL), *cb2 = clipboard_new(NULL);
+    OwnerChanges changes;
+
+    ASSERT_FALSE(clipboard_subscribe(NULL, count_owner_change, &changes));
+#if defined(LIBCLIPBOARD_BUILD_X11) && defined(LIBCLIPBOARD_USE_XFIXES)
+    ASSERT_TRUE(clipboard_subscribe(cb2, count_owner_change, &changes));
+    ASSERT_TRUE(clipboard_set_text_ex(cb1, "subscribe", -1, LCB_PRIMARY));
+    {
+        std::unique_lock<std::mutex> lock(changes.mu);
+        ASSERT_TRUE(changes.cond.wait_for(lock, std::chrono::seconds(5),
+                                          [&changes] { return changes.changes[LCB_PRIMARY] > 0; }));
+        ASSERT_EQ(0, changes.changes[LCB_SECONDARY]);
+    }
+
+    ASSERT_TRUE(clipboard_subscribe(cb2, NULL, NULL));
+#else
+    ASSERT_FALSE(clipboard_subscribe(cb2, count_owner_change, &changes));
+#endif
+
+    clipboard_free(cb1);
+    clipboard_free(cb2);
+}
+
+TEST_F(BasicsTest, TestForeignCache) {
+    clipboard_c *cb1 = clipboard_new(NULL), *cb2 = clipboard_new(NULL);
+    unsigned long hits = 1, misses = 1, prev_hits, prev_misses;
+    char *ret;
+
+    clipboard_cache_stats(NULL, &hits, &misses);
+    ASSERT_EQ(0u, hits);
+    ASSERT_EQ(0u, misses);
+
+    ASSERT_TRUE(clipboard_set_text_ex(cb1, "cached", -1, LCB_CLIPBOARD));
+    TRY_RUN_STRNE(clipboard_text_ex(cb2, NULL, LCB_CLIPBOARD), "cached", ret);
+    ASSERT_STREQ("cached", ret);
+    free(ret);
+    clipboard_cache_stats(cb2, &prev_hits, &prev_misses);
+
+    ret = clipboard_text_ex(cb2, NULL, LCB_CLIPBOARD);
+    ASSERT_STREQ("cached", ret);
+    free(ret);
+    clipboard_cache_stats(cb2, &hits, &misses);
+#if defined(LIBCLIPBOARD_BUILD_X11) && defined(LIBCLIPBOARD_USE_XFIXES)
+    ASSERT_EQ(prev_hits + 1, hits);
+    ASSERT_EQ(prev_misses, misses);
+
+    /* A new owner invalidates the cache */
+    ASSERT_TRUE(clipboard_set_text_ex(cb1, "changed", -1, LCB_CLIPBOARD));
+    TRY_RUN_STRNE(clipboard_text_ex(cb2, NULL, LCB_CLIPBOARD), "changed", ret);
+    ASSERT_STREQ("changed", ret);
+    free(ret);
+#else
+    ASSERT_EQ(0u, hits);
+#endif
+
+    clipboard_free(cb1);
+    clipboard_free(cb2);
+}
+
+#if defined(LIBCLIPBOARD_BUILD_X11) && defined(LIBCLIPBOARD_USE_XFIXES)
+TEST_F(BasicsTest, TestPrefetch) {
+    clipboard_opts opts = {};
+    opts.x11.prefetch = true;
+    opts.x11.prefetch_size = 16;
+    clipboard_c *cb1 = clipboard_new(NULL), *cb2 = clipboard_new(&opts);
+    ProviderState state;
+    clipboard_provider provider = {provide_text, &state, free_provider_state, false};
+    OwnerChanges changes;
+    unsigned long hits = 0, misses, prev_misses;
+    char *ret;
+
+    /* The provider is only called for cb2's prefetch; the read must not convert again */
+    ASSERT_TRUE(clipboard_subscribe(cb2, count_owner_change, &changes));
+    ASSERT_TRUE(clipboard_set_text_provider(cb1, &provider, LCB_CLIPBOARD));
+    ASSERT_TRUE(poll_until([&state] { return state.calls == 1; }));
+    ASSERT_TRUE(poll_until([cb2, &hits] {
+        char *text = clipboard_text_ex(cb2, NULL, LCB_CLIPBOARD);
+        bool provided = text != NULL && !strcmp("provided", text);
+        free(text);
+        clipboard_cache_stats(cb2, &hits, NULL);
+        return provided && hits > 0;
+    }));
+    ASSERT_EQ(1u, hits);
+    ASSERT_EQ(1, state.calls);
+
+    /* Larger than prefetch_size, so converted on demand */
+    clipboard_cache_stats(cb2, NULL, &prev_misses);
+    ASSERT_TRUE(clipboard_set_text_ex(cb1, "too large to prefetch", -1, LCB_CLIPBOARD));
+    {
+        std::unique_lock<std::mutex> lock(changes.mu);
+        ASSERT_TRUE(changes.cond.wait_for(lock, std::chrono::seconds(5),
+                                          [&changes] { return changes.changes[LCB_CLIPBOARD] > 1; }));
+    }
+    ret = clipboard_text_ex(cb2, NULL, LCB_CLIPBOARD);
+    ASSERT_STREQ("too large to prefetch", ret);
+    free(ret);
+    clipboard_cache_stats(cb2, &hits, &misses);
+    ASSERT_EQ(1u, hits);
+    ASSERT_EQ(prev_misses + 1, misses);
+
+    clipboard_free(cb1);
+    clipboard_free(cb2);
+}
+#endif
+
 INSTANTIATE_TEST_CASE_P(ClipboardBasicsTest,
                         WithMode,
                         ::testing::Range(LCB_CLIPBOARD, LCB_MODE_END, 1));
@@ -24,8 +24,18 @@ struct {
     std::atomic<int> calloc_count;
     std::atomic<int> realloc_count;
     std::atomic<int> free_count;
+    /** Allocations of watch_size bytes (or one more) are counted in watch_count **/
+    std::atomic<size_t> watch_size;
+    std::atomic<int> watch_count;
 } g_alloc_counts;
 
+static void watch_alloc(size_t size) {
+    size_t watched = g_alloc_counts.watch_size;
+    if (watched != 0 && (size == watched || size == watched + 1)) {
+        g_alloc_counts.watch_count++;
+    }
+}
+
 struct {
     std::atomic<clipboard_malloc_fn> malloc_ptr;
     std::atomic<clipboard_calloc_fn> calloc_ptr;
@@ -35,6 +45,7 @@ struct {
 
 static void *mock_malloc(size_t size) {
     g_alloc_counts.malloc_count++;
+    watch_alloc(size);
     if (g_alloc_ptrs.malloc_ptr.load()) {
         void *ret;
         ret = g_alloc_ptrs.malloc_ptr.load()(size);
@@ -47,6 +58,7 @@ static void *mock_malloc(size_t size) {
 
 static void *mock_calloc(size_t nmemb, size_t size) {
     g_alloc_counts.calloc_count++;
+    watch_alloc(nmemb * size);
     if (g_alloc_ptrs.calloc_ptr.load()) {
         void *ret;
         ret = g_alloc_ptrs.calloc_ptr.load()(nmemb, size);
@@ -59,6 +71,7 @@ static void *mock_calloc(size_t nmemb, size_t size) {
 
 static void *mock_realloc(void *ptr, size_t size) {
     g_alloc_counts.realloc_count++;
+    watch_alloc(size);
     if (ptr == NULL) {
         g_alloc_counts.malloc_count++;
     }
@@ -92,6 +105,8 @@ protected:
         g_alloc_counts.calloc_count = 0;
         g_alloc_counts.realloc_count = 0;
         g_alloc_counts.free_count = 0;
+        g_alloc_counts.watch_size = 0;
+        g_alloc_counts.watch_count = 0;
 
         g_alloc_ptrs.malloc_ptr = malloc;
         g_alloc_ptrs.calloc_ptr = calloc;
@@ -173,3 +188,78 @@ TEST_F(CustomAllocatorsTest, TestAllocationFailOnGetText) {
     // No. of frees should at least match no. of successful allocs.
     ASSERT_GE(g_alloc_counts.free_count, alloc_counts - g_alloc_counts.alloc_fail_count);
 }
+
+TEST_F(CustomAllocatorsTest, TestTextIntoOwnedDoesNotAllocate) {
+    clipboard_c *cb = clipboard_new(&std_mock);
+    char buf[32];
+    ASSERT_TRUE(cb != NULL);
+
+    ASSERT_TRUE(clipboard_set_text(cb, "allocTest3"));
+    int alloc_counts = g_alloc_counts.malloc_count + g_alloc_counts.calloc_count;
+    ASSERT_TRUE(clipboard_text_into(cb, buf, sizeof(buf), NULL, LCB_CLIPBOARD));
+    ASSERT_STREQ("allocTest3", buf);
+    ASSERT_EQ(alloc_counts, g_alloc_counts.malloc_count + g_alloc_counts.calloc_count);
+    ASSERT_EQ(0, g_alloc_counts.realloc_count);
+
+    clipboard_free(cb);
+}
+
+TEST_F(CustomAllocatorsTest, TestSetTextTakeDoesNotCopy) {
+    clipboard_c *cb = clipboard_new(&std_mock);
+    char out[16];
+    ASSERT_TRUE(cb != NULL);
+
+    char *buf = static_cast<char *>(mock_malloc(8));
+    memcpy(buf, "takeTest", 8);
+    int malloc_count = g_alloc_counts.malloc_count;
+    int free_count = g_alloc_counts.free_count;
+    g_alloc_counts.watch_size = 8;
+
+    ASSERT_TRUE(clipboard_set_text_take(cb, buf, 8, NULL, LCB_CLIPBOARD));
+#ifdef LIBCLIPBOARD_BUILD_X11
+    // The buffer is adopted as-is: no copy of the payload, no release yet.
+    // Only the small snapshot header that refers to it is allocated.
+    ASSERT_EQ(0, g_alloc_counts.watch_count.load());
+    ASSERT_LE(g_alloc_counts.malloc_count - malloc_count, 1);
+    ASSERT_EQ(0, g_alloc_counts.realloc_count);
+    ASSERT_EQ(free_count, g_alloc_counts.free_count);
+#endif
+    g_alloc_counts.watch_size = 0;
+    ASSERT_TRUE(clipboard_text_into(cb, out, sizeof(out), NULL, LCB_CLIPBOARD));
+    ASSERT_STREQ("takeTest", out);
+
+    // Replacing the text releases the adopted buffer with the context's free
+    ASSERT_TRUE(clipboard_set_text(cb, "replaced"));
+    ASSERT_GT(g_alloc_counts.free_count, free_count);
+
+    clipboard_free(cb);
+    int alloc_counts = g_alloc_counts.malloc_count + g_alloc_counts.calloc_count;
+    ASSERT_GE(g_alloc_counts.free_count, alloc_counts - g_alloc_counts.alloc_fail_count);
+}
+
+static std::atomic<int> g_take_free_count;
+
+static void take_free(void *ptr) {
+    g_take_free_count++;
+    free(ptr);
+}
+
+TEST_F(CustomAllocatorsTest, TestSetTextTakeUsesFreeFn) {
+    clipboard_c *cb = clipboard_new(&std_mock);
+    ASSERT_TRUE(cb != NULL);
+    g_take_free_count = 0;
+
+    char *buf = static_cast<char *>(malloc(4));
+    memcpy(buf, "take", 4);
+    ASSERT_FALSE(clipboard_set_text_take(cb, buf, 0, take_free, LCB_CLIPBOARD));
+    ASSERT_FALSE(clipboard_set_text_take(NULL, buf, 4, take_free, LCB_CLIPBOARD));
+    ASSERT_EQ(0, g_take_free_count);
+
+    ASSERT_TRUE(clipboard_set_text_take(cb, buf, 4, take_free, LCB_CLIPBOARD));
+    char *text = clipboard_text(cb);
+    ASSERT_STREQ("take", text);
+    mock_free(text);
+
+    clipboard_free(cb);
+    ASSERT_EQ(1, g_take_free_count);
+}
@@ -0,0 +1,219 @@
+/**
+ *  \file test_x11_concurrency.cpp
+ *  \brief Concurrency tests for the X11 backend
+ *
+ *  \copyright Copyright (C) 2016 Jeremy Tan.
+ *             This file is released under the MIT license.
+ *             See LICENSE for details.
+ *
+ *  Best run with -DLIBCLIPBOARD_SANITIZE_THREAD=on to check for data races.
+ */
+#include <gtest/gtest.h>
+#include <libclipboard.h>
+
+#include "libclipboard-test-private.h"
+
+#ifdef LIBCLIPBOARD_BUILD_X11
+#include <string.h>
+#include <xcb/xcb.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+/** Takes ownership of CLIPBOARD on a new connection that never answers requests **/
+static xcb_connection_t *silent_owner() {
+    xcb_connection_t *xc = xcb_connect(NULL, NULL);
+    if (xcb_connection_has_error(xc)) {
+        xcb_disconnect(xc);
+        return nullptr;
+    }
+
+    xcb_screen_t *xs = xcb_setup_roots_iterator(xcb_get_setup(xc)).data;
+    xcb_window_t xw = xcb_generate_id(xc);
+    xcb_create_window(xc, XCB_COPY_FROM_PARENT, xw, xs->root, 0, 0, 1, 1, 0,
+                      XCB_WINDOW_CLASS_INPUT_ONLY, xs->root_visual, 0, NULL);
+    xcb_intern_atom_reply_t *reply = xcb_intern_atom_reply(xc,
+                                     xcb_intern_atom(xc, 0, strlen("CLIPBOARD"), "CLIPBOARD"), NULL);
+    if (reply == NULL) {
+        xcb_disconnect(xc);
+        return nullptr;
+    }
+    xcb_set_selection_owner(xc, xw, reply->atom, XCB_CURRENT_TIME);
+    /* Round trip so that ownership is established before we return */
+    free(xcb_get_selection_owner_reply(xc, xcb_get_selection_owner(xc, reply->atom), NULL));
+    free(reply);
+    return xc;
+}
+
+/** Milliseconds elapsed since start **/
+static long long elapsed_ms(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+               std::chrono::steady_clock::now() - start).count();
+}
+
+TEST(X11ConcurrencyTest, TestCrossReads) {
+    const int iterations = 200;
+    std::atomic<int> failures(0);
+    std::atomic<bool> done(false);
+
+    clipboard_c *a = clipboard_new(NULL), *b = clipboard_new(NULL);
+    ASSERT_TRUE(a != NULL);
+    ASSERT_TRUE(b != NULL);
+    ASSERT_TRUE(clipboard_set_text_ex(a, "from a", -1, LCB_PRIMARY));
+    ASSERT_TRUE(clipboard_set_text_ex(b, "from b", -1, LCB_CLIPBOARD));
+
+    /* Each context reads from the other while serving its own selection */
+    auto read_loop = [&](clipboard_c *cb, clipboard_mode mode, const char *expected) {
+        for (int i = 0; i < iterations; i++) {
+            char *text = clipboard_text_ex(cb, NULL, mode);
+            if (text == NULL || strcmp(text, expected) != 0) {
+                failures++;
+            }
+            free(text);
+        }
+    };
+    std::thread read_a(read_loop, a, LCB_CLIPBOARD, "from b");
+    std::thread read_b(read_loop, b, LCB_PRIMARY, "from a");
+
+    /* Replacing the data (with the same text) mid-read must not break the readers */
+    std::thread write_a([&]() {
+        for (int i = 0; i < iterations; i++) {
+            if (!clipboard_set_text_ex(a, "from a", -1, LCB_PRIMARY)) {
+                failures++;
+            }
+        }
+    });
+    std::thread poll_a([&]() {
+        while (!done) {
+            if (!clipboard_has_ownership(a, LCB_PRIMARY)) {
+                failures++;
+            }
+        }
+    });
+
+    read_a.join();
+    read_b.join();
+    write_a.join();
+    done = true;
+    poll_a.join();
+    ASSERT_EQ(0, failures.load());
+
+    clipboard_free(a);
+    clipboard_free(b);
+}
+
+TEST(X11ConcurrencyTest, TestTimedRead) {
+    clipboard_opts opts = {};
+    opts.x11.action_timeout = 10000;
+    clipboard_c *cb = clipboard_new(&opts);
+    ASSERT_TRUE(cb != NULL);
+    xcb_connection_t *owner = silent_owner();
+    ASSERT_TRUE(owner != nullptr);
+
+    /* The read's own deadline applies well before action_timeout */
+    auto start = std::chrono::steady_clock::now();
+    char *text = clipboard_text_timed(cb, NULL, LCB_CLIPBOARD, 300);
+    long long elapsed = elapsed_ms(start);
+    ASSERT_TRUE(text == NULL);
+    ASSERT_GE(elapsed, 300);
+    ASSERT_LT(elapsed, 5000);
+
+    xcb_disconnect(owner);
+    clipboard_free(cb);
+}
+
+TEST(X11ConcurrencyTest, TestCancel) {
+    clipboard_opts opts = {};
+    opts.x11.action_timeout = 10000;
+    clipboard_c *cb = clipboard_new(&opts);
+    ASSERT_TRUE(cb != NULL);
+    xcb_connection_t *owner = silent_owner();
+    ASSERT_TRUE(owner != nullptr);
+
+    std::atomic<bool> done(false);
+    long long elapsed = 0;
+    char *text = NULL;
+    auto start = std::chrono::steady_clock::now();
+    std::thread reader([&]() {
+        text = clipboard_text_ex(cb, NULL, LCB_CLIPBOARD);
+        elapsed = elapsed_ms(start);
+        done = true;
+    });
+
+    /* Cancelling before the read starts would not affect it, so keep at it */
+    while (!done) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        clipboard_cancel(cb);
+    }
+    reader.join();
+    ASSERT_TRUE(text == NULL);
+    ASSERT_LT(elapsed, 5000);
+
+    /* Reads started after the cancel are unaffected */
+    xcb_disconnect(owner);
+    clipboard_c *other = clipboard_new(NULL);
+    ASSERT_TRUE(other != NULL);
+    ASSERT_TRUE(clipboard_set_text(other, "after cancel"));
+    text = clipboard_text(cb);
+    ASSERT_TRUE(text != NULL);
+    ASSERT_STREQ("after cancel", text);
+    free(text);
+
+    clipboard_free(other);
+    clipboard_free(cb);
+}
+
+/** A provider that reads another context on the same display **/
+struct NestedRead {
+    clipboard_c *inner;
+    std::atomic<bool> inner_failed{false};
+};
+
+static char *provide_nested(void *user, size_t *length) {
+    NestedRead *nested = static_cast<NestedRead *>(user);
+    char *text = clipboard_text_ex(nested->inner, NULL, LCB_PRIMARY);
+    nested->inner_failed = text == NULL;
+    free(text);
+
+    char *ret = static_cast<char *>(malloc(strlen("outer")));
+    memcpy(ret, "outer", strlen("outer"));
+    *length = strlen("outer");
+    return ret;
+}
+
+TEST(X11ConcurrencyTest, TestProviderReadsSameDisplay) {
+    clipboard_opts opts = {};
+    opts.x11.action_timeout = 300;
+    clipboard_c *owner = clipboard_new(NULL), *reader = clipboard_new(NULL);
+    clipboard_c *primary = clipboard_new(NULL), *inner = clipboard_new(&opts);
+    ASSERT_TRUE(owner != NULL && reader != NULL && primary != NULL && inner != NULL);
+    NestedRead nested;
+    nested.inner = inner;
+    clipboard_provider provider = {provide_nested, &nested, NULL, false};
+    ASSERT_TRUE(clipboard_set_text_ex(primary, "inner", -1, LCB_PRIMARY));
+    ASSERT_TRUE(clipboard_set_text_provider(owner, &provider, LCB_CLIPBOARD));
+
+    /* The provider runs on the event loop, which cannot also serve the inner read */
+    auto start = std::chrono::steady_clock::now();
+    char *text = clipboard_text_ex(reader, NULL, LCB_CLIPBOARD);
+    long long elapsed = elapsed_ms(start);
+    ASSERT_TRUE(text != NULL);
+    ASSERT_STREQ("outer", text);
+    free(text);
+    ASSERT_TRUE(nested.inner_failed);
+    ASSERT_GE(elapsed, 300);
+    ASSERT_LT(elapsed, LCB_X11_ACTION_TIMEOUT_DEFAULT);
+
+    /* Outside of a callback, the same read succeeds */
+    text = clipboard_text_ex(inner, NULL, LCB_PRIMARY);
+    ASSERT_TRUE(text != NULL);
+    ASSERT_STREQ("inner", text);
+    free(text);
+
+    clipboard_free(owner);
+    clipboard_free(reader);
+    clipboard_free(primary);
+    clipboard_free(inner);
+}
+
+#endif /* LIBCLIPBOARD_BUILD_X11 */
@@ -0,0 +1,159 @@
+/**
+ *  \file test_x11_contexts.cpp
+ *  \brief Tests of many contexts sharing one X11 connection
+ *
+ *  \copyright Copyright (C) 2016 Jeremy Tan.
+ *             This file is released under the MIT license.
+ *             See LICENSE for details.
+ */
+#include <gtest/gtest.h>
+#include <libclipboard.h>
+
+#include "libclipboard-test-private.h"
+
+#ifdef LIBCLIPBOARD_BUILD_X11
+#include <dirent.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <xcb/xcb.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+/** Returns the resident set size of this process in bytes, or 0 if unknown **/
+static size_t resident_size() {
+    unsigned long size = 0, resident = 0;
+    FILE *fp = fopen("/proc/self/statm", "r");
+    if (fp != NULL) {
+        if (fscanf(fp, "%lu %lu", &size, &resident) != 2) {
+            resident = 0;
+        }
+        fclose(fp);
+    }
+    return resident * static_cast<size_t>(sysconf(_SC_PAGESIZE));
+}
+
+/** Returns the number of threads in this process, or 0 if unknown **/
+static size_t thread_count() {
+    size_t count = 0;
+    DIR *dir = opendir("/proc/self/task");
+    if (dir != NULL) {
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != NULL) {
+            if (entry->d_name[0] != '.') {
+                count++;
+            }
+        }
+        closedir(dir);
+    }
+    return count;
+}
+
+static void count_async(char *text, size_t, void *user) {
+    free(text);
+    (*static_cast<std::atomic<size_t> *>(user))++;
+}
+
+TEST(X11ContextsTest, TestThousandContexts) {
+    /* Well beyond the X server's limit on clients, so connections must be shared */
+    const size_t n = 1000;
+    std::vector<clipboard_c *> cbs(n);
+    clipboard_opts opts = {};
+    opts.x11.prefetch = true;
+
+    size_t threads_before = thread_count();
+    size_t rss_before = resident_size();
+    for (size_t i = 0; i < n; i++) {
+        cbs[i] = clipboard_new(&opts);
+        ASSERT_TRUE(cbs[i] != NULL) << "context " << i;
+    }
+    size_t rss_after = resident_size();
+    /* A context is a window and its bookkeeping, not a connection and a thread */
+    if (rss_before != 0 && rss_after > rss_before) {
+        ASSERT_LT((rss_after - rss_before) / n, 64u * 1024);
+    }
+
+    /* Contexts sharing a connection still exchange selections */
+    ASSERT_TRUE(clipboard_set_text(cbs[0], "shared"));
+    char *text = NULL;
+    for (int i = 0; i < 5 && text == NULL; i++) {
+        text = clipboard_text(cbs[n - 1]);
+    }
+    ASSERT_TRUE(text != NULL);
+    ASSERT_STREQ("shared", text);
+    free(text);
+
+    /* Prefetches and asynchronous reads in every context share one watchdog */
+    std::atomic<size_t> completed(0);
+    for (size_t i = 0; i < n; i++) {
+        ASSERT_TRUE(clipboard_text_async(cbs[i], LCB_CLIPBOARD, count_async, &completed));
+    }
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+    while (completed < n && std::chrono::steady_clock::now() < deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    ASSERT_EQ(n, completed.load());
+    if (threads_before != 0) {
+        /* The event loop and the watchdog */
+        ASSERT_LE(thread_count(), threads_before + 2);
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        clipboard_free(cbs[i]);
+    }
+}
+
+TEST(X11ContextsTest, TestHostConnection) {
+    xcb_connection_t *xc = xcb_connect(NULL, NULL);
+    ASSERT_EQ(0, xcb_connection_has_error(xc));
+    clipboard_c *hosted = clipboard_new_with_connection(xc, 0, NULL);
+    clipboard_c *cb = clipboard_new(NULL);
+    ASSERT_TRUE(hosted != NULL);
+    ASSERT_TRUE(cb != NULL);
+
+    /* The host's event loop; destroying its window stops it */
+    xcb_screen_t *xs = xcb_setup_roots_iterator(xcb_get_setup(xc)).data;
+    uint32_t event_mask = XCB_EVENT_MASK_STRUCTURE_NOTIFY;
+    xcb_window_t xw = xcb_generate_id(xc);
+    xcb_create_window(xc, XCB_COPY_FROM_PARENT, xw, xs->root, 0, 0, 1, 1, 0,
+                      XCB_WINDOW_CLASS_INPUT_ONLY, xs->root_visual, XCB_CW_EVENT_MASK, &event_mask);
+    xcb_flush(xc);
+    std::thread host([xc, xw, hosted]() {
+        xcb_generic_event_t *e;
+        while ((e = xcb_wait_for_event(xc))) {
+            bool done = (e->response_type & ~0x80) == XCB_DESTROY_NOTIFY &&
+                        ((xcb_destroy_notify_event_t *)e)->window == xw;
+            if (!done) {
+                clipboard_handle_event(hosted, e);
+            }
+            free(e);
+            if (done) {
+                break;
+            }
+        }
+    });
+
+    ASSERT_TRUE(clipboard_set_text(hosted, "from host"));
+    char *text = clipboard_text(cb);
+    ASSERT_TRUE(text != NULL);
+    ASSERT_STREQ("from host", text);
+    free(text);
+
+    ASSERT_TRUE(clipboard_set_text(cb, "to host"));
+    text = clipboard_text(hosted);
+    ASSERT_TRUE(text != NULL);
+    ASSERT_STREQ("to host", text);
+    free(text);
+    ASSERT_FALSE(clipboard_has_ownership(hosted, LCB_CLIPBOARD));
+
+    xcb_destroy_window(xc, xw);
+    xcb_flush(xc);
+    host.join();
+    clipboard_free(hosted);
+    clipboard_free(cb);
+    xcb_disconnect(xc);
+}
+
+#endif /* LIBCLIPBOARD_BUILD_X11 */
@@ -0,0 +1,304 @@
+/**
+ *  \file test_x11_transfers.cpp
+ *  \brief Large (INCR) transfer tests for the X11 backend
+ *
+ *  \copyright Copyright (C) 2016 Jeremy Tan.
+ *             This file is released under the MIT license.
+ *             See LICENSE for details.
+ */
+#include <gtest/gtest.h>
+#include <libclipboard.h>
+
+#include "libclipboard-test-private.h"
+
+#ifdef LIBCLIPBOARD_BUILD_X11
+#include <xcb/xcb.h>
+#include <string.h>
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+/** Generates a deterministic, printable payload of the given size **/
+static std::vector<char> make_payload(size_t size) {
+    std::vector<char> ret(size);
+    for (size_t i = 0; i < size; i++) {
+        ret[i] = 'a' + static_cast<char>((i * 31 + i / 4096) % 26);
+    }
+    return ret;
+}
+
+/**
+ *  A minimal foreign selection owner that always replies to UTF8_STRING
+ *  requests using the INCR protocol, independent of libclipboard.
+ */
+class IncrOwner {
+public:
+    IncrOwner(const std::vector<char> &data, size_t chunk_size)
+        : mData(data), mChunkSize(chunk_size) {}
+
+    ~IncrOwner() {
+        if (mThread.joinable()) {
+            xcb_destroy_window(mXc, mXw);
+            xcb_flush(mXc);
+            mThread.join();
+        }
+        if (mXc != nullptr) {
+            xcb_disconnect(mXc);
+        }
+    }
+
+    /** Takes ownership of CLIPBOARD and starts serving requests **/
+    bool Start() {
+        mXc = xcb_connect(NULL, NULL);
+        if (xcb_connection_has_error(mXc)) {
+            return false;
+        }
+
+        xcb_screen_t *xs = xcb_setup_roots_iterator(xcb_get_setup(mXc)).data;
+        uint32_t event_mask = XCB_EVENT_MASK_STRUCTURE_NOTIFY | XCB_EVENT_MASK_PROPERTY_CHANGE;
+        mXw = xcb_generate_id(mXc);
+        xcb_create_window(mXc, XCB_COPY_FROM_PARENT, mXw, xs->root, 0, 0, 10, 10, 0,
+                          XCB_WINDOW_CLASS_INPUT_OUTPUT, xs->root_visual,
+                          XCB_CW_EVENT_MASK, &event_mask);
+
+        mClipboard = Intern("CLIPBOARD");
+        mUtf8 = Intern("UTF8_STRING");
+        mIncr = Intern("INCR");
+        if (mClipboard == XCB_NONE || mUtf8 == XCB_NONE || mIncr == XCB_NONE) {
+            return false;
+        }
+
+        xcb_set_selection_owner(mXc, mXw, mClipboard, XCB_CURRENT_TIME);
+        /* Round trip so that ownership is established before we return */
+        free(xcb_get_selection_owner_reply(mXc, xcb_get_selection_owner(mXc, mClipboard), NULL));
+        mThread = std::thread(&IncrOwner::Run, this);
+        return true;
+    }
+
+private:
+    xcb_atom_t Intern(const char *name) {
+        xcb_intern_atom_reply_t *reply = xcb_intern_atom_reply(mXc,
+                                         xcb_intern_atom(mXc, 0, strlen(name), name), NULL);
+        xcb_atom_t ret = reply ? reply->atom : XCB_NONE;
+        free(reply);
+        return ret;
+    }
+
+    void Run() {
+        xcb_generic_event_t *e;
+        xcb_window_t requestor = XCB_NONE;
+        xcb_atom_t property = XCB_NONE;
+        size_t offset = 0;
+        bool sending = false;
+
+        while ((e = xcb_wait_for_event(mXc))) {
+            switch (e->response_type & ~0x80) {
+                case XCB_DESTROY_NOTIFY: {
+                    if (((xcb_destroy_notify_event_t *)e)->window == mXw) {
+                        free(e);
+                        return;
+                    }
+                }
+                break;
+                case XCB_SELECTION_REQUEST: {
+                    xcb_selection_request_event_t *req = (xcb_selection_request_event_t *)e;
+                    xcb_selection_notify_event_t notify = {};
+                    notify.response_type = XCB_SELECTION_NOTIFY;
+                    notify.time = XCB_CURRENT_TIME;
+                    notify.requestor = req->requestor;
+                    notify.selection = req->selection;
+                    notify.target = req->target;
+                    notify.property = XCB_NONE;
+
+                    if (req->target == mUtf8 && !sending) {
+                        uint32_t mask = XCB_EVENT_MASK_PROPERTY_CHANGE;
+                        uint32_t size = static_cast<uint32_t>(mData.size());
+                        requestor = req->requestor;
+                        property = req->property;
+                        offset = 0;
+                        sending = true;
+
+                        xcb_change_window_attributes(mXc, requestor, XCB_CW_EVENT_MASK, &mask);
+                        xcb_change_property(mXc, XCB_PROP_MODE_REPLACE, requestor, property,
+                                            mIncr, 32, 1, &size);
+                        notify.property = property;
+                    }
+                    xcb_send_event(mXc, false, req->requestor, XCB_EVENT_MASK_NO_EVENT, (char *)&notify);
+                    xcb_flush(mXc);
+                }
+                break;
+                case XCB_PROPERTY_NOTIFY: {
+                    xcb_property_notify_event_t *evt = (xcb_property_notify_event_t *)e;
+                    if (sending && evt->window == requestor && evt->atom == property &&
+                            evt->state == XCB_PROPERTY_DELETE) {
+                        size_t n = std::min(mChunkSize, mData.size() - offset);
+                        xcb_change_property(mXc, XCB_PROP_MODE_REPLACE, requestor, property,
+                                            mUtf8, 8, n, mData.data() + offset);
+                        offset += n;
+                        /* The zero-length chunk ends the transfer */
+                        sending = n > 0;
+                        xcb_flush(mXc);
+                    }
+                }
+                break;
+            }
+            free(e);
+        }
+    }
+
+    const std::vector<char> &mData;
+    size_t mChunkSize;
+    xcb_connection_t *mXc = nullptr;
+    xcb_window_t mXw = XCB_NONE;
+    xcb_atom_t mClipboard = XCB_NONE, mUtf8 = XCB_NONE, mIncr = XCB_NONE;
+    std::thread mThread;
+};
+
+class IncrReceiveTest : public ::testing::TestWithParam<size_t> {
+};
+
+TEST_P(IncrReceiveTest, TestReceiveIncr) {
+    std::vector<char> payload = make_payload(GetParam());
+    IncrOwner owner(payload, 256 * 1024);
+    ASSERT_TRUE(owner.Start());
+
+    clipboard_c *cb = clipboard_new(NULL);
+    ASSERT_TRUE(cb != NULL);
+
+    int length = 0;
+    char *text = clipboard_text_ex(cb, &length, LCB_CLIPBOARD);
+    ASSERT_TRUE(text != NULL);
+    ASSERT_EQ(static_cast<int>(payload.size()), length);
+    ASSERT_EQ(0, memcmp(payload.data(), text, payload.size()));
+    ASSERT_EQ('\0', text[length]);
+    free(text);
+
+    clipboard_free(cb);
+}
+
+/** Checks each chunk of clipboard_read_stream against the payload, without keeping it **/
+struct StreamCheck {
+    const std::vector<char> *payload;
+    size_t offset;
+    size_t max_chunk;
+};
+
+static bool check_chunk(const void *data, size_t length, void *user) {
+    StreamCheck *check = static_cast<StreamCheck *>(user);
+    if (length > check->payload->size() - check->offset ||
+            memcmp(check->payload->data() + check->offset, data, length) != 0) {
+        return false;
+    }
+    check->offset += length;
+    check->max_chunk = std::max(check->max_chunk, length);
+    return true;
+}
+
+TEST_P(IncrReceiveTest, TestStreamIncr) {
+    std::vector<char> payload = make_payload(GetParam());
+    IncrOwner owner(payload, 256 * 1024);
+    ASSERT_TRUE(owner.Start());
+
+    clipboard_c *cb = clipboard_new(NULL);
+    ASSERT_TRUE(cb != NULL);
+
+    StreamCheck check = {&payload, 0, 0};
+    ASSERT_TRUE(clipboard_read_stream(cb, LCB_CLIPBOARD, check_chunk, &check));
+    ASSERT_EQ(payload.size(), check.offset);
+    /* Chunks are passed on as the owner sends them */
+    ASSERT_LE(check.max_chunk, 256u * 1024);
+
+    clipboard_free(cb);
+}
+
+class IncrSendTest : public ::testing::TestWithParam<size_t> {
+};
+
+TEST_P(IncrSendTest, TestSendIncr) {
+    std::vector<char> payload = make_payload(GetParam());
+    clipboard_opts opts = {};
+    /* Small enough that every payload is sent using INCR */
+    opts.x11.transfer_size = 64 * 1024;
+
+    clipboard_c *cb1 = clipboard_new(&opts), *cb2 = clipboard_new(NULL);
+    ASSERT_TRUE(cb1 != NULL);
+    ASSERT_TRUE(cb2 != NULL);
+    ASSERT_TRUE(clipboard_set_text_ex(cb1, payload.data(), static_cast<int>(payload.size()), LCB_CLIPBOARD));
+
+    int length = 0;
+    char *text = NULL;
+    for (int i = 0; i < 5 && (text == NULL || length != static_cast<int>(payload.size())); i++) {
+        free(text);
+        text = clipboard_text_ex(cb2, &length, LCB_CLIPBOARD);
+    }
+    ASSERT_TRUE(text != NULL);
+    ASSERT_EQ(static_cast<int>(payload.size()), length);
+    ASSERT_EQ(0, memcmp(payload.data(), text, payload.size()));
+    free(text);
+
+    clipboard_free(cb2);
+    clipboard_free(cb1);
+}
+
+/** Generates the payload of make_payload on demand, so that it is never held whole **/
+static size_t read_payload(void *user, size_t offset, void *buf, size_t cap) {
+    size_t size = *static_cast<size_t *>(user);
+    size_t n = offset < size ? std::min(cap, size - offset) : 0;
+    for (size_t i = 0; i < n; i++) {
+        size_t pos = offset + i;
+        static_cast<char *>(buf)[i] = 'a' + static_cast<char>((pos * 31 + pos / 4096) % 26);
+    }
+    return n;
+}
+
+/* Needs over 2GB of memory; run with --gtest_also_run_disabled_tests */
+TEST(X11TransfersTest, DISABLED_TestMultiGigabyte) {
+    size_t size = (size_t(2) << 30) + 12345;
+    clipboard_reader reader = {read_payload, &size, NULL, size};
+
+    clipboard_c *cb1 = clipboard_new(NULL), *cb2 = clipboard_new(NULL);
+    ASSERT_TRUE(cb1 != NULL);
+    ASSERT_TRUE(cb2 != NULL);
+    ASSERT_TRUE(clipboard_set_text_reader(cb1, &reader, LCB_CLIPBOARD));
+
+    size_t length = 0;
+    char *text = NULL;
+    for (int i = 0; i < 5 && text == NULL; i++) {
+        text = clipboard_text_ex2(cb2, &length, LCB_CLIPBOARD);
+    }
+    ASSERT_TRUE(text != NULL);
+    ASSERT_EQ(size, length);
+    ASSERT_EQ('\0', text[length]);
+    std::vector<char> expected(1 << 20);
+    for (size_t offset = 0; offset < size; offset += expected.size()) {
+        size_t n = read_payload(&size, offset, expected.data(), expected.size());
+        ASSERT_EQ(0, memcmp(expected.data(), text + offset, n)) << "at offset " << offset;
+    }
+    free(text);
+
+    /* The int length cannot hold it */
+    int int_length = 0;
+    ASSERT_TRUE(clipboard_text_ex(cb2, &int_length, LCB_CLIPBOARD) == NULL);
+
+    clipboard_free(cb2);
+    clipboard_free(cb1);
+}
+
+INSTANTIATE_TEST_CASE_P(X11TransfersTest,
+                        IncrSendTest,
+                        ::testing::Values(1u << 20, 16u << 20));
+
+/* Too slow for every run (especially under TSAN); run with --gtest_also_run_disabled_tests */
+INSTANTIATE_TEST_CASE_P(DISABLED_X11TransfersLargeTest,
+                        IncrSendTest,
+                        ::testing::Values(64u << 20, 256u << 20));
+
+INSTANTIATE_TEST_CASE_P(X11TransfersTest,
+                        IncrReceiveTest,
+                        ::testing::Values(1u << 20, 16u << 20));
+
+INSTANTIATE_TEST_CASE_P(DISABLED_X11TransfersLargeTest,
+                        IncrReceiveTest,
+                        ::testing::Values(64u << 20, 256u << 20));
+
+#endif /* LIBCLIPBOARD_BUILD_X11 */